@@ -18,11 +18,37 @@
 #include "subgraph.h"
 #include "sgctree.h"
 #include "realheap.h"
+#include "distance.h"
+#include "knnindex.h"
+#include "distcache.h"
 
 /*--------- Common definitions --------- */
 #define opf_MAXARCW			100000.0
 #define opf_MAXDENS			1000.0
 #define opf_PROTOTYPE		1
+#define opf_MAPPED_MAGIC	"OPFM" //first bytes of a model file in the mapped format
+#define opf_DISTANCES_MAGIC	"OPFD" //first bytes of a distances file with header (files without it hold the full matrix)
+#define opf_DISTANCES_VERSION	2 //version 1 only stores float distances
+#define opf_DIST_TRIANGULAR	1 //flag of the header: only the upper triangle of the matrix is stored
+
+/* Types of the distances of a distances file */
+#define opf_DIST_FLOAT32	0
+#define opf_DIST_FLOAT16	1 //IEEE half precision
+#define opf_DIST_UINT16		2 //distance = value * scale of the file
+#define opf_DIST_UINT8		3 //distance = value * scale of the file
+
+/* Search of the knn graph of opf_CreateArcs and opf_CreateArcs2 */
+#define opf_KNN_BRUTE		0 //scan of all the nodes
+#define opf_KNN_KDTREE		1 //k-d tree (Euclidean and Manhattan arc weights)
+#define opf_KNN_VPTREE		2 //VP-tree (Euclidean and Manhattan arc weights)
+#define opf_KNN_INDEX		3 //k-d tree up to opf_KNN_KDTREE_MAXFEATS features, VP-tree otherwise
+#define opf_KNN_APPROX		4 //approximate graph by NN-Descent (any arc weight), stopped at the recall opf_KnnRecall
+#define opf_KNN_KDTREE_MAXFEATS	16
+#define opf_KNN_APPROX_MINK	10 //the approximate graph is built with at least this number of neighbors
+
+/* Priority queue of the clustering IFTs */
+#define opf_QUEUE_HEAP		0 //binary heap of real path values
+#define opf_QUEUE_BUCKET	1 //bucket queue of integer path values: opf_PDF and opf_PDFtoKmax round the densities
 
 #define opf_version "\nLibOPF version 3.1 (2015)\n"
 
@@ -30,12 +56,87 @@ typedef float (*opf_ArcWeightFun)(float *f1, float *f2, int n);
 
 extern opf_ArcWeightFun opf_ArcWeight;
 
+typedef float (*opf_BoundedArcWeightFun)(float *f1, float *f2, int n, float bound);
+
 extern char	opf_PrecomputedDistance;
-extern float  **opf_DistanceValue;
+extern void  **opf_DistanceValue; //rows of the precomputed distances, of type opf_DistanceType (read them by opf_Distance)
+extern char	opf_DistanceTriangular; //1 if the rows only hold the distances (i,j) for i <= j
+extern int	opf_DistanceType;       //opf_DIST_* type of the precomputed distances
+extern float	opf_DistanceScale;      //scale of the precomputed distances
+
+/* Header of a distances file. With opf_DIST_TRIANGULAR, it is followed
+   by the rows of the upper triangle of the matrix, diagonal included:
+   distances (i,i), (i,i+1), ..., (i,nsamples-1) for each i */
+typedef struct _opfdistancesheader {
+  char  magic[4];   //opf_DISTANCES_MAGIC
+  int   byteorder;  //0x01020304 in the byte order of the writer
+  int   version;    //opf_DISTANCES_VERSION
+  int   nsamples;
+  int   flags;      //opf_DIST_TRIANGULAR
+  int   type;       //opf_DIST_FLOAT32, opf_DIST_FLOAT16, opf_DIST_UINT16 or opf_DIST_UINT8 (0 in version 1)
+  float scale;      //distance = stored value * scale (0 in version 1, where it is 1)
+  int   reserved;
+} opf_DistancesHeader;
+
+// Precomputed distance between the samples at positions i and j, in any storage
+static inline float opf_Distance(int i, int j)
+{
+  int t;
+
+  if (opf_DistanceTriangular && (i > j))
+  {
+    t = i;
+    i = j;
+    j = t;
+  }
+  switch (opf_DistanceType)
+  {
+  case opf_DIST_FLOAT16:
+    return HalfToFloat(((unsigned short *)opf_DistanceValue[i])[j]) * opf_DistanceScale;
+  case opf_DIST_UINT16:
+    return ((unsigned short *)opf_DistanceValue[i])[j] * opf_DistanceScale;
+  case opf_DIST_UINT8:
+    return ((unsigned char *)opf_DistanceValue[i])[j] * opf_DistanceScale;
+  default:
+    return ((float *)opf_DistanceValue[i])[j];
+  }
+}
+
+extern DistCache *opf_DistanceCache; //cache of the computed distances, by sample position: the positions must identify the samples of every subgraph (NULL if none)
+
+float opf_CachedDistance(SNode *a, SNode *b, int nfeats); //It returns the distance of a and b from opf_DistanceCache, computing and storing it on a miss
+
+// Distance between the nodes a and b: precomputed, cached or computed by opf_ArcWeight
+static inline float opf_NodeDistance(SNode *a, SNode *b, int nfeats)
+{
+  if (opf_PrecomputedDistance)
+    return opf_Distance(a->position, b->position);
+  if (opf_DistanceCache != NULL)
+    return opf_CachedDistance(a, b, nfeats);
+  return opf_ArcWeight(a->feat, b->feat, nfeats);
+}
+
+extern int opf_NumThreads; //number of threads used by the parallel routines (1 runs the serial code)
+extern int opf_NumPivots;  //number of pivots of the lower-bound index built by opf_OPFTraining (0 builds no index)
+extern int opf_KnnMethod;  //search of the knn graph (opf_KNN_*); precomputed distances always scan, and so do arc weights that are not metrics unless opf_KNN_APPROX
+extern float opf_KnnRecall;         //recall target of the approximate knn graph (0-1)
+extern float opf_KnnMeasuredRecall; //recall of the last approximate knn graph measured on a sample of nodes (-1 if none was built)
+extern int opf_ClusteringQueue;     //priority queue of the clustering IFTs (opf_QUEUE_*)
+
+/* Work done by each thread of a parallel routine */
+typedef struct _opfthreadstats {
+  int nthreads;
+  int *nsamples; //samples processed by each thread
+  double *time;  //seconds spent by each thread
+} opf_ThreadStats;
+
+opf_ThreadStats *opf_CreateThreadStats(int nthreads);
+void opf_DestroyThreadStats(opf_ThreadStats **S);
 
 /*--------- Supervised OPF with complete graph -----------------------*/
 void opf_OPFTraining(Subgraph *Train); //Training function
 void opf_OPFClassifying(Subgraph *sgtrain, Subgraph *sg); //Classification function: it simply classifies samples from sg
+void opf_OPFClassifyingParallel(Subgraph *sgtrain, Subgraph *sg, int nthreads, opf_ThreadStats *stats); //Classification function with nthreads threads; stats may be NULL
 void opf_OPFLearning(Subgraph **sgtrain, Subgraph **sgeval); //Learning function
 void opf_OPFAgglomerativeLearning(Subgraph **sgtrain, Subgraph **sgeval); //Agglomerative learning function
 
@@ -45,6 +146,8 @@ int opf_OPFknnLearning(Subgraph *Train, Subgraph *Eval, int kmax); //It learns t
 void opf_OPFClustering4SupervisedLearning(Subgraph *sg); //it executes the OPF clustering algorithm using the labeled samples
 void opf_OPFClustering4SupervisedLearningForceOnePrototypePerClass(Subgraph *sg); //it executes the OPF clustering algorithm using the labeled samples
 void  opf_OPFknnClassify(Subgraph *Train, Subgraph *Test); // OPFknn classification function
+void  opf_OPFknnClassifyParallel(Subgraph *Train, Subgraph *Test, int nthreads, opf_ThreadStats *stats); // OPFknn classification function with nthreads threads; stats may be NULL
+void  opf_CreateKnnClassifierIndex(Subgraph *sg); // it creates the knn index of a kNN-OPF model, kept in its model file (none for precomputed distances and arc weights that are not metrics)
 
 /*--------- Unsupervised OPF -------------------------------------*/
 void opf_OPFClustering(Subgraph *sg); //Training function: it computes unsupervised training for the pre-computed best k.
@@ -61,20 +164,35 @@ void opf_MoveMisclassifiedNodes(Subgraph **sgtrain, Subgraph **sgeval, int *p);
 void opf_RemoveIrrelevantNodes(Subgraph **sg); //Remove irrelevant nodes
 void opf_MarkNodes(Subgraph *g, int i); //mark nodes and the whole path as relevants
 void opf_WriteModelFile(Subgraph *g, char *file); //write model file to disk
-Subgraph *opf_ReadModelFile(char *file); //read subgraph from opf model file
+Subgraph *opf_ReadModelFile(char *file); //read subgraph from opf model file (in either format)
+void opf_WriteMappedModelFile(Subgraph *g, char *file); //write model file in the mapped format
+Subgraph *opf_ReadMappedModelFile(char *file); //read model file in the mapped format, mapping its features into memory
 void opf_NormalizeFeatures(Subgraph *sg); //normalize features
 void opf_MSTPrototypes(Subgraph *sg); //Find prototypes by the MST approach
+void opf_CreatePivotIndex(Subgraph *sg, int npivots); //It creates the lower-bound index of a trained subgraph used by the classification
 Subgraph **opf_kFoldSubgraph(Subgraph *sg, int k); //It creates k folds for cross validation
 void opf_SplitSubgraph(Subgraph *sg, Subgraph **sg1, Subgraph **sg2, float perc1); //Split subgraph into two parts such that the size of the first part  is given by a percentual of samples.
 Subgraph *opf_MergeSubgraph(Subgraph *sg1, Subgraph *sg2); //Merge two subgraphs
 float opf_Accuracy(Subgraph *g); //Compute accuracy
 float *opf_Accuracy4Label(Subgraph *sg); // Compute accuracy for each class and it outputs an array with the values
 int **opf_ConfusionMatrix(Subgraph *sg); //Compute the confusion matrix
-float **opf_ReadDistances(char *fileName, int *n); //read distances from precomputed distances file
+void **opf_ReadDistances(char *fileName, int *n); //read distances from precomputed distances file (mapped into memory)
+void **opf_CreateDistances(char *fileName, int n, int type, float scale); //create a distances file of n samples (upper triangle) of an opf_DIST_* type, mapped for writing
+void opf_RetypeDistances(char *fileName, void ***M, int n, int type, float scale); //change the type of the distances of opf_CreateDistances, converted in place, and cut the file
+void opf_DestroyDistances(void ***M, int n); //unmap the distances of opf_ReadDistances or opf_CreateDistances
+void opf_ReadThreadsOption(int *argc, char **argv); //it reads and removes the option "-t <nthreads>" from the command line
+void opf_ReadPivotsOption(int *argc, char **argv); //it reads and removes the option "-p <npivots>" from the command line
+void opf_ReadKnnOption(int *argc, char **argv); //it reads and removes the options "-a <brute|kdtree|vptree|index|approx>" and "-r <recall>" from the command line
+void opf_ReadQueueOption(int *argc, char **argv); //it reads and removes the option "-q <heap|bucket>" from the command line
+int opf_ReadDistanceTypeOption(int *argc, char **argv); //it reads and removes the option "-f <float32|float16|uint16|uint8>" from the command line and returns the opf_DIST_* type
+void opf_ReadDistanceCacheOption(int *argc, char **argv); //it reads and removes the option "-c <megabytes>" from the command line, the size of the cache of opf_CreateDistanceCache
+void opf_CreateDistanceCache(Subgraph *sg1, Subgraph *sg2); //it creates opf_DistanceCache for the positions of the nodes of sg1 and sg2 (which may be NULL), if its size was given
+void opf_WriteDistanceCacheStats(FILE *fp); //it writes the hits and misses of opf_DistanceCache, if any
 float opf_NormalizedCut( Subgraph *sg );
 void  opf_BestkMinCut(Subgraph *sg, int kmin, int kmax);
 void  opf_CreateArcs(Subgraph *sg, int knn); //it creates arcs for each node (adjacency relation)
 void  opf_DestroyArcs(Subgraph *sg); //it destroys the adjacency relation
+void  opf_SymmetrizePlateaus(Subgraph *sg); //it adds the arc (j,i) for every arc (i,j) between nodes of equal density
 void  opf_PDF(Subgraph *sg); //it computes the PDf for each node
 void opf_ElimMaxBelowVolume(Subgraph *sg, int V); // Eliminate maxima in the graph with volume below V
 void opf_ElimMaxBelowArea(Subgraph *sg, int A); //Eliminate maxima in the graph with area below A
@@ -96,6 +214,18 @@ float opf_SquaredChordDist(float *f1, float *f2, int n); //Compute  Squared Chor
 float opf_SquaredChiSquaredDist(float *f1, float *f2, int n); //Compute  Squared Chi-squared distance between feature vectors
 float opf_BrayCurtisDist(float *f1, float *f2, int n); //Compute  Bray Curtis distance between feature vectors
 
+/*------------ Bounded distance functions ------------------------------ */
+/* Same values as above when they are not greater than bound; otherwise any value greater than bound */
+float opf_EuclDistBounded(float *f1, float *f2, int n, float bound);
+float opf_EuclDistLogBounded(float *f1, float *f2, int n, float bound);
+float opf_ChiSquaredDistBounded(float *f1, float *f2, int n, float bound);
+float opf_ManhattanDistBounded(float *f1, float *f2, int n, float bound);
+float opf_CanberraDistBounded(float *f1, float *f2, int n, float bound);
+float opf_SquaredChordDistBounded(float *f1, float *f2, int n, float bound);
+float opf_SquaredChiSquaredDistBounded(float *f1, float *f2, int n, float bound);
+float opf_BrayCurtisDistBounded(float *f1, float *f2, int n, float bound);
+opf_BoundedArcWeightFun opf_BoundedArcWeight(opf_ArcWeightFun f); //It returns the bounded version of an arc weight function (it ignores the bound if there is none)
+
 /* -------- Auxiliary functions used to optimize BestkMinCut -------- */
 float* opf_CreateArcs2(Subgraph *sg, int kmax); //Creates arcs for each node (adjacency relation) and returns
                                                //the maximum distances for each k=1,2,...,kmax
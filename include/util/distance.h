@@ -0,0 +1,68 @@
+#ifndef _DISTANCE_H_
+#define _DISTANCE_H_
+
+#include "common.h"
+
+/* Instruction sets of the distance kernels */
+#define SIMD_SCALAR 0
+#define SIMD_SSE4   1
+#define SIMD_AVX2   2
+#define SIMD_AVX512 3
+
+/* A kernel returns the distance between f1 and f2 when it is not above
+   bound. Otherwise it may stop early and return any value above bound.
+   FLT_MAX gives the full distance. */
+typedef float (*DistanceKernel)(float *f1, float *f2, int n, float bound);
+
+/* A kernel that returns the sum of exp(-x[i] / k), i = 0..n-1, as the
+   densities of the knn graphs. Each exponential is within a relative
+   error of EXP_MAXRELERR, and those of the vector kernels below FLT_MIN
+   are 0. The scalar kernel uses the double precision exp. */
+typedef float (*ExpSumKernel)(float *x, int n, float k);
+#define EXP_MAXRELERR 3e-7
+
+typedef struct _distancekernels {
+  DistanceKernel eucl;              /* squared Euclidean */
+  DistanceKernel chisquared;        /* chi-squared */
+  DistanceKernel manhattan;         /* Manhattan (L1) */
+  DistanceKernel canberra;          /* Canberra */
+  DistanceKernel squaredchord;      /* squared chord */
+  DistanceKernel squaredchisquared; /* squared chi-squared */
+  DistanceKernel braycurtis;        /* Bray Curtis */
+  ExpSumKernel   expsum;            /* sum of exponentials */
+} DistanceKernels;
+
+/* Kernels in use. They are installed at startup for the best
+   instruction set supported by the CPU, which can be lowered by
+   setting the environment variable OPF_SIMD to 0 (scalar), 1 (SSE4),
+   2 (AVX2) or 3 (AVX-512). */
+extern DistanceKernels DistKernels;
+
+int   DetectSIMDLevel(void); /* It returns the best instruction set supported by the CPU */
+int   SetSIMDLevel(int level); /* It installs the kernels of level (at most the detected one) and returns the installed level */
+void  GetDistanceKernels(int level, DistanceKernels *K); /* It gets the kernels of a given level, without installing them */
+char *SIMDLevelName(int level);
+
+/* Conversions between float and IEEE half precision (rounded to the
+   nearest, ties to even) */
+unsigned short FloatToHalf(float f);
+
+static inline float HalfToFloat(unsigned short h)
+{
+  union { float f; unsigned int u; } v;
+  unsigned int e = (h >> 10) & 0x1f, m = h & 0x3ff;
+
+  if (e == 0) // zero and subnormals: m * 2^-24
+  {
+    v.f = (float)m * (1.0f / 16777216.0f);
+    v.u |= (unsigned int)(h & 0x8000) << 16;
+  }
+  else if (e == 0x1f) // infinities and NaNs
+    v.u = ((unsigned int)(h & 0x8000) << 16) | 0x7f800000 | (m << 13);
+  else
+    v.u = ((unsigned int)(h & 0x8000) << 16) | ((e + 112) << 23) | (m << 13);
+
+  return v.f;
+}
+
+#endif
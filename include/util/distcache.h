@@ -0,0 +1,45 @@
+#ifndef _DISTCACHE_H_
+#define _DISTCACHE_H_
+
+#include "common.h"
+
+/* Bounded cache of the distances between pairs of samples, identified
+   by their positions 0..nsamples-1. The distances are kept in row
+   tiles, each one with the distances from DC_TILEROWS consecutive
+   samples to all the samples, and a lookup finds the tile of its row
+   by a table. The distance of (i,j) goes to the row i, and also to the
+   row j if its tile is cached. The tile of sample i may only take the
+   slots of the set (i / DC_TILEROWS) % nsets, where the tile that came
+   first is evicted. Each set has its own lock, so threads may look up
+   and store distances at the same time, and counts its hits and
+   misses. */
+
+#define DC_TILEROWS 4   //rows of a tile
+#define DC_MAXSETS  256 //maximum number of sets (and locks)
+
+typedef struct _distcacheset {
+  int  next;       //slot of the set that is evicted next
+  long long hits, misses;
+} DistCacheSet;
+
+typedef struct _distcache {
+  int    nsamples;
+  int   *tileslot;  //slot of each tile (NIL if not cached)
+  int   *slottile;  //tile of each slot (NIL if empty); slot s belongs to the set s % nsets
+  int    nslots;
+  DistCacheSet *set;
+  int    nsets;     //a power of 2
+  float *value;     //DC_TILEROWS*nsamples distances of each slot, NaN where not stored yet
+  void  *lock;      //one lock per set
+} DistCache;
+
+/* It creates a cache of at most maxbytes bytes of distances among
+   nsamples samples, with one tile per set at least */
+DistCache *CreateDistCache(int nsamples, size_t maxbytes);
+void DestroyDistCache(DistCache **C);
+
+int  DistCacheGet(DistCache *C, int i, int j, float *d); //It returns 1 and the distance of (i,j) in d if it is stored, 0 otherwise
+void DistCachePut(DistCache *C, int i, int j, float d); //It stores the distance of (i,j), evicting a tile if needed
+void DistCacheStats(DistCache *C, long long *hits, long long *misses); //It returns the hits and misses of DistCacheGet so far
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef _KNNINDEX_H_
+#define _KNNINDEX_H_
+
+#include "common.h"
+#include "subgraph.h"
+
+/* Exact spatial indices for the k-nearest neighbors of the nodes of a
+   subgraph. The neighbors are ranked by an arc weight that must be an
+   increasing function of a metric, and ties are broken by the lowest
+   node index, so a search returns the same list as a scan of all the
+   nodes. The k-d tree splits the feature space by coordinates and
+   serves the Euclidean and Manhattan metrics, bounding the distance to
+   a cell by its offsets in the coordinates split so far; the VP-tree
+   only uses the triangle inequality of its metric. */
+
+#define KNN_KDTREE 1
+#define KNN_VPTREE 2
+#define KNN_GRAPH  3 //approximate lists of the nodes of the subgraph (NN-Descent)
+
+#define KNN_L1 1 //k-d tree bounds for Manhattan
+#define KNN_L2 2 //k-d tree bounds for Euclidean
+
+#define KNN_LEAFSIZE 8  //maximum number of nodes in a leaf
+#define KNN_SLACK 1e-3  //relative slack of the bounds of the VP-tree, which absorbs rounding
+
+#define KNN_RECALL_SAMPLE   100   //nodes whose exact lists measure the recall of the approximate graph
+#define KNN_DESCENT_MAXITER 30    //maximum number of rounds of NN-Descent
+#define KNN_DESCENT_DELTA   0.001 //NN-Descent stops when a round changes fewer than DELTA*n*k entries
+
+typedef float (*KnnWeightFun)(float *f1, float *f2, int n, float bound); //arc weight that ranks the neighbors (any value above bound when it is greater)
+typedef float (*KnnMetricFun)(float *f1, float *f2, int n); //metric of the VP-tree
+typedef float (*KnnBoundFun)(float w); //metric distance above which no arc weight is w or lower (loosened)
+
+typedef struct _knntreenode {
+  int   first, last; //nodes perm[first..last-1] of a leaf
+  int   left, right; //children (NIL in leaves)
+  int   dim;         //k-d tree: coordinate of the split
+  float split;       //k-d tree: nodes in left have coordinate <= split, in right >= split
+  int   vp;          //VP-tree: vantage point
+  float mu;          //VP-tree: nodes in left are at distance <= mu from vp, in right >= mu
+} KnnTreeNode;
+
+typedef struct _knnindex {
+  int          type;   //KNN_KDTREE or KNN_VPTREE
+  Subgraph    *sg;
+  int         *perm;   //nodes in the order of the leaves
+  float       *feat;   //feature vectors in the order of perm, so that a leaf is read contiguously
+  int          featstride;
+  KnnTreeNode *node;
+  int          nnodes; //number of tree nodes
+  int          root;
+  int          norm;   //k-d tree: KNN_L1 or KNN_L2
+  KnnMetricFun metric; //VP-tree only
+  int          k;       //graph: number of neighbors of each node
+  float       *graphd;  //graph: graphd[i*k+l] is the weight of the l-th neighbor of node i
+  int         *graphnn; //graph: graphnn[i*k+l] is the l-th neighbor of node i
+  float        recall;  //graph: recall measured on KNN_RECALL_SAMPLE nodes
+} KnnIndex;
+
+KnnIndex *CreateKdTree(Subgraph *sg, int norm); //It creates a k-d tree of the nodes of sg for the norm KNN_L1 or KNN_L2
+KnnIndex *CreateVpTree(Subgraph *sg, KnnMetricFun metric); //It creates a VP-tree of the nodes of sg
+/* It creates an approximate knn graph of the nodes of sg by NN-Descent,
+   stopping once the recall measured on a sample reaches recall (0-1) */
+KnnIndex *CreateKnnGraph(Subgraph *sg, int k, KnnWeightFun weight, float recall);
+void      DestroyKnnIndex(KnnIndex **T);
+
+void      WriteKnnIndex(KnnIndex *T, FILE *fp); //It writes a k-d tree or VP-tree, without the feature vectors
+KnnIndex *ReadKnnIndex(Subgraph *sg, FILE *fp, KnnMetricFun metric); //It reads a tree of the nodes of sg (metric is that of a VP-tree)
+
+/* It finds the k nodes of lowest weight(feat, node feature vector),
+   skipping node exclude (NIL for none), and returns them in nn[0..k-1]
+   with their weights in d[0..k-1], sorted by weight and then by index.
+   Entries without a node keep d = FLT_MAX. */
+void KnnIndexSearch(KnnIndex *T, float *feat, int exclude, int k, KnnWeightFun weight, KnnBoundFun bound,
+                    float *d, int *nn);
+// It finds the k-nearest neighbors of node i of the indexed subgraph, as KnnIndexSearch (approximate for a graph)
+void KnnIndexNodeSearch(KnnIndex *T, int i, int k, KnnWeightFun weight, KnnBoundFun bound, float *d, int *nn);
+
+#endif
@@ -4,6 +4,8 @@
 #include "common.h"
 #include "set.h"
 
+#define SG_ALIGNMENT 64 //alignment in bytes of the contiguous feature matrix and of its rows
+
 /*--------- Data types ----------------------------- */
 typedef struct _snode {
   float pathval; //path value
@@ -26,7 +28,6 @@ typedef struct _snode {
                 //for kmax, but the opf_PDF and opf_NormalizedCut computation
                 //need only be done for the current k,
                 //or until k+nplatadj is reached.
-  Set   *adj;    //adjacency list for knn graphs
 } SNode;
 
 typedef struct _subgraph {
@@ -40,16 +41,55 @@ typedef struct _subgraph {
   float maxdens; //maximum density value
   float K;       //Constant for opf_PDF computation
   int  *ordered_list_of_nodes; // Store the list of nodes in the increasing order of cost for speeding up supervised classification.
+  float *featmatrix; //contiguous feature matrix (NULL if every node owns its feature vector)
+  int   featstride;  //number of floats between two rows of featmatrix (nfeats padded to SG_ALIGNMENT bytes)
+  int   npivots;     //number of pivots of the lower-bound index (0 if there is no index)
+  int   pivotmetric; //metric of the pivot distances
+  int  *pivot;       //nodes used as pivots
+  float *pivotdist;  //pivotdist[i*npivots+p]: distance from node i to pivot p
+  void  *mapping;     //memory-mapped model file that holds featmatrix (NULL if featmatrix was allocated)
+  size_t mappingsize; //size in bytes of the mapping
+  struct _knnindex *knnindex; //k-d tree or VP-tree of the nodes for the kNN classification (NULL if none)
+  int   knnmetric;            //metric of the knn index
+  /* adjacency of knn graphs in compressed sparse rows: the arcs of node
+     i are arcnode[arcoffset[i]..arcoffset[i+1]-1], with weights in
+     arcweight (arcoffset is NULL if there are no arcs) */
+  int   *arcoffset;
+  int   *arcnode;
+  float *arcweight;
+  char   arcsshared; //1 if arcoffset, arcnode and arcweight belong to another subgraph (they are not deallocated)
+  /* arcs inserted after the graph was built (plateau arcs). They are
+     kept in chains, the last inserted first, until MergeSgArcs moves
+     them in front of the arcs of their nodes */
+  int   *ovfhead;   //first overflow arc of each node (NIL if none)
+  int   *ovfnode;
+  int   *ovfnext;
+  float *ovfweight;
+  int    novf, ovfsize; //number of overflow arcs and size of the pool
 } Subgraph;
 
+/*----------- Contiguous feature matrix ------------------------*/
+#define SgFeatStride(nfeats) ((((nfeats) * (int)sizeof(float) + SG_ALIGNMENT - 1) / SG_ALIGNMENT) * (SG_ALIGNMENT / (int)sizeof(float)))
+#define SgFeatRow(sg, i) ((sg)->featmatrix + (size_t)(i) * (sg)->featstride) //i-th row of the feature matrix
+
 /*----------- Constructor and destructor ------------------------*/
 Subgraph *CreateSubgraph(int nnodes); //Allocates nodes without features
+void AllocSubgraphFeats(Subgraph *sg, int nfeats); //Allocates a contiguous feature matrix and points node[i].feat to its i-th row
 void DestroySubgraph(Subgraph **sg); //Deallocates memory for subgraph
 
 void WriteSubgraph(Subgraph *g, char *file); //write subgraph to disk
 Subgraph *ReadSubgraph(char *file);//read subgraph from opf format file
-Subgraph *CopySubgraph(Subgraph *g);//Copy subgraph (does not copy Arcs)
+Subgraph *CopySubgraph(Subgraph *g);//Copy subgraph (and its arcs)
+
+/*----------- Arcs of knn graphs ------------------------*/
+#define SgNumArcs(sg, i) ((sg)->arcoffset[(i) + 1] - (sg)->arcoffset[i]) //number of arcs of node i (overflow arcs not included)
+
+void AllocSgArcs(Subgraph *sg, int narcs); //Allocates room for narcs arcs, to be filled node by node with arcoffset
+void InsertSgOverflowArc(Subgraph *sg, int i, int j, float w); //Inserts the arc (i,j) of weight w in front of the arcs of i
+void MergeSgArcs(Subgraph *sg); //Moves the overflow arcs in front of the arcs of their nodes
+void DestroySgArcs(Subgraph *sg); //Deallocates the arcs
 
-void CopySNode(SNode *dest, SNode *src, int nfeats); //Copy nodes
+void CopySNode(SNode *dest, SNode *src, int nfeats); //Copy nodes (the arcs belong to the subgraph and are not copied)
 void SwapSNode(SNode *a, SNode *b); //Swap nodes
+void ExchangeSNode(SNode *a, SNode *b, int nfeats); //Swap nodes of distinct subgraphs, keeping each feature vector in its subgraph
 #endif // _SUBGRAPH_H_
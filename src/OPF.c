@@ -25,27 +25,156 @@
 
 #include "OPF.h"
 
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 char opf_PrecomputedDistance;
-float **opf_DistanceValue;
+void **opf_DistanceValue;
+char opf_DistanceTriangular = 0;
+int opf_DistanceType = opf_DIST_FLOAT32;
+float opf_DistanceScale = 1.0;
+static void *opf_DistanceMapping = NULL; //mapping of the distances file
+static size_t opf_DistanceMappingSize = 0;
+DistCache *opf_DistanceCache = NULL;
+static int opf_DistanceCacheSize = 0; //megabytes of the cache created by opf_CreateDistanceCache (0 for none)
+
+int opf_NumThreads = 1;
+int opf_NumPivots = 0;
+int opf_KnnMethod = opf_KNN_BRUTE;
+float opf_KnnRecall = 0.95;
+float opf_KnnMeasuredRecall = -1.0;
+int opf_ClusteringQueue = opf_QUEUE_HEAP;
 
 opf_ArcWeightFun opf_ArcWeight = opf_EuclDistLog;
 
+/*--------- Dense graph engine -------------------------------------*/
+/* opf_MSTPrototypes and opf_OPFTraining run on a complete graph, so
+   they keep the path costs in a flat array and take the next node by
+   a linear scan instead of using a heap: each iteration costs O(n)
+   and no relaxation needs a heap update. Ties are broken by the
+   lowest node index, while the RealHeap of the former engine removed
+   tied nodes in an order set by its layout. The path costs are the
+   same, but with tied costs the MST, the prototypes, the predecessors
+   and ordered_list_of_nodes can differ from those of the heap, so
+   model files change and opf_MarkNodes (pruning) walks another tree. */
+
+// It returns the node not done yet with minimum cost lower than FLT_MAX, or NIL
+static int opf_DenseArgMin(float *cost, char *done, int n)
+{
+  float mincost = FLT_MAX;
+  int q;
+
+#pragma omp simd reduction(min : mincost)
+  for (q = 0; q < n; q++)
+    mincost = MIN(mincost, done[q] ? FLT_MAX : cost[q]);
+
+  if (mincost == FLT_MAX)
+    return NIL;
+
+  for (q = 0; q < n; q++)
+    if (!done[q] && (cost[q] == mincost))
+      break;
+
+  return q;
+}
+
+/*--------- Training distance buffer -------------------------------*/
+/* opf_MSTPrototypes computes the distance of every pair of training
+   nodes once, and the IFT of opf_OPFTraining needs almost all of them
+   again. The training keeps them in a packed upper triangular buffer
+   whose row a holds d(a,b) for b > a. When the whole triangle does not
+   fit in half of the available memory, only its first nrows rows are
+   kept and the remaining pairs are computed again. */
+typedef struct _opfpairbuffer {
+  float *value;
+  int n;     //number of nodes
+  int nrows; //number of rows kept
+} opf_PairBuffer;
+
+static opf_PairBuffer *opf_CreatePairBuffer(int n)
+{
+  opf_PairBuffer *B = NULL;
+  double avail, size;
+  long pages = sysconf(_SC_AVPHYS_PAGES), pagesize = sysconf(_SC_PAGESIZE);
+  int nrows;
+
+  if (n < 2)
+    return NULL;
+
+  avail = (pages > 0 && pagesize > 0) ? 0.5 * (double)pages * (double)pagesize : 0.0;
+
+  nrows = n - 1;
+  size = 0.5 * (double)n * (double)(n - 1) * sizeof(float);
+  if (size > avail) // keep the first rows that fit
+  {
+    nrows = (int)(avail / ((double)n * sizeof(float)));
+    while ((nrows > 0) && ((double)nrows * (2.0 * n - nrows - 1) * 0.5 * sizeof(float) > avail))
+      nrows--;
+    if (nrows == 0)
+      return NULL;
+  }
+
+  B = (opf_PairBuffer *)calloc(1, sizeof(opf_PairBuffer));
+  B->n = n;
+  B->nrows = nrows;
+  B->value = (float *)malloc((size_t)nrows * (2 * (size_t)n - nrows - 1) / 2 * sizeof(float));
+  if (B->value == NULL)
+  {
+    free(B);
+    return NULL;
+  }
+
+  return B;
+}
+
+static void opf_DestroyPairBuffer(opf_PairBuffer **B)
+{
+  if (*B != NULL)
+  {
+    free((*B)->value);
+    free(*B);
+    *B = NULL;
+  }
+}
+
+// It returns the buffer entry of the pair (p,q), or NULL if it is not kept
+static float *opf_PairBufferEntry(opf_PairBuffer *B, int p, int q)
+{
+  int a = MIN(p, q), b = MAX(p, q);
+
+  if ((B == NULL) || (a >= B->nrows))
+    return NULL;
+
+  return &B->value[(size_t)a * (2 * (size_t)B->n - a - 1) / 2 + (b - a - 1)];
+}
+
+static void opf_MSTPrototypesBuffered(Subgraph *sg, opf_PairBuffer *B);
+
 /*--------- Supervised OPF -------------------------------------*/
 //Training function -----
 void opf_OPFTraining(Subgraph *sg)
 {
   int p, q, i;
-  float tmp, weight;
-  RealHeap *Q = NULL;
+  float tmp, weight, *entry;
   float *pathval = NULL;
+  char *done = NULL;
+  opf_PairBuffer *B = NULL;
 
-  // compute optimum prototypes
-  opf_MSTPrototypes(sg);
+  /* compute optimum prototypes, keeping the distances for the IFT,
+     unless they are precomputed or cached */
+  if (!opf_PrecomputedDistance && (opf_DistanceCache == NULL))
+    B = opf_CreatePairBuffer(sg->nnodes);
+  opf_MSTPrototypesBuffered(sg, B);
 
   // initialization
   pathval = AllocFloatArray(sg->nnodes);
-
-  Q = CreateRealHeap(sg->nnodes, pathval);
+  done = (char *)calloc(sg->nnodes, sizeof(char));
 
   for (p = 0; p < sg->nnodes; p++)
   {
@@ -54,7 +183,6 @@ void opf_OPFTraining(Subgraph *sg)
       sg->node[p].pred = NIL;
       pathval[p] = 0;
       sg->node[p].label = sg->node[p].truelabel;
-      InsertRealHeap(Q, p);
     }
     else
     { // non-prototypes
@@ -64,54 +192,352 @@ void opf_OPFTraining(Subgraph *sg)
 
   // IFT with fmax
   i = 0;
-  while (!IsEmptyRealHeap(Q))
+  while ((p = opf_DenseArgMin(pathval, done, sg->nnodes)) != NIL)
   {
-    RemoveRealHeap(Q, &p);
+    done[p] = 1;
 
     sg->ordered_list_of_nodes[i] = p;
     i++;
     sg->node[p].pathval = pathval[p];
 
+#pragma omp parallel for if (opf_NumThreads > 1) num_threads(opf_NumThreads) private(tmp, weight, entry) schedule(static)
     for (q = 0; q < sg->nnodes; q++)
     {
       if (p != q)
       {
         if (pathval[p] < pathval[q])
         {
-          if (!opf_PrecomputedDistance)
-            weight = opf_ArcWeight(sg->node[p].feat, sg->node[q].feat, sg->nfeats);
+          if ((entry = opf_PairBufferEntry(B, p, q)) != NULL)
+            weight = *entry;
           else
-            weight = opf_DistanceValue[sg->node[p].position][sg->node[q].position];
+            weight = opf_NodeDistance(&sg->node[p], &sg->node[q], sg->nfeats);
           tmp = MAX(pathval[p], weight);
           if (tmp < pathval[q])
           {
             sg->node[q].pred = p;
             sg->node[q].label = sg->node[p].label;
-            UpdateRealHeap(Q, q, tmp);
+            pathval[q] = tmp;
           }
         }
       }
     }
   }
 
-  DestroyRealHeap(&Q);
+  opf_DestroyPairBuffer(&B);
   free(pathval);
+  free(done);
+
+  // lower-bound index for the classification
+  opf_CreatePivotIndex(sg, opf_NumPivots);
 }
 
-//Classification function: it simply classifies samples from sg -----
-void opf_OPFClassifying(Subgraph *sgtrain, Subgraph *sg)
+/*--------- Pivot lower-bound index -------------------------------*/
+/* When the arc weight is an increasing function g of a metric d, the
+   triangle inequality gives, for any pivot node v,
+   weight(x,n) >= g(|d(x,v) - d(n,v)|). The index keeps d(n,v) for
+   every training node n and a few pivots v chosen far apart, and the
+   classification skips the training nodes whose bound is not below
+   the current minimum cost, since they cannot conquer the sample. The
+   bounds are loosened by opf_PIVOT_SLACK (relative to the distances
+   involved) to absorb rounding, so a skipped node would never have
+   changed the label. */
+#define opf_PIVOT_SLACK 1e-3
+#define opf_PIVOT_MAGIC 0x5650504F //"OPPV", marks the index section of a model file
+#define opf_KNNINDEX_MAGIC 0x4E4B504F //"OPKN", marks the knn index section of a model file
+
+#define opf_PIVOT_NONE      0
+#define opf_PIVOT_EUCLLOG   1 //opf_EuclDistLog = g(Euclidean)
+#define opf_PIVOT_EUCL      2 //opf_EuclDist = Euclidean^2
+#define opf_PIVOT_MANHATTAN 3
+/* Canberra is not indexed: as implemented (|a-b|/|a+b|), it breaks the
+   triangle inequality when the features have mixed signs */
+
+// It returns the metric of the current arc weight, or opf_PIVOT_NONE
+static int opf_PivotMetricOfArcWeight(void)
+{
+  if (opf_ArcWeight == opf_EuclDistLog)
+    return opf_PIVOT_EUCLLOG;
+  if (opf_ArcWeight == opf_EuclDist)
+    return opf_PIVOT_EUCL;
+  if (opf_ArcWeight == opf_ManhattanDist)
+    return opf_PIVOT_MANHATTAN;
+  return opf_PIVOT_NONE;
+}
+
+static float opf_PivotMetric(int metric, float *f1, float *f2, int n)
+{
+  switch (metric)
+  {
+  case opf_PIVOT_EUCLLOG:
+  case opf_PIVOT_EUCL:
+    return sqrtf(DistKernels.eucl(f1, f2, n, FLT_MAX));
+  default:
+    return DistKernels.manhattan(f1, f2, n, FLT_MAX);
+  }
+}
+
+// It returns the metric distance below which an arc can reach weight w, already loosened
+static float opf_PivotThreshold(int metric, float w)
+{
+  double d;
+
+  switch (metric)
+  {
+  case opf_PIVOT_EUCLLOG: // log(d^2 + 1) is rounded in float, so tiny distances may give weight 0
+    d = sqrt(expm1(w / opf_MAXARCW) * (1.0 + 1e-5) + FLT_EPSILON);
+    break;
+  case opf_PIVOT_EUCL:
+    d = sqrt(w);
+    break;
+  default:
+    d = w;
+    break;
+  }
+
+  return (float)(d * (1.0 + opf_PIVOT_SLACK));
+}
+
+// It creates the lower-bound index of a trained subgraph with npivots pivots (no index if npivots is 0)
+void opf_CreatePivotIndex(Subgraph *sg, int npivots)
+{
+  int metric = opf_PivotMetricOfArcWeight(), i, p, far;
+  float *mindist = NULL;
+
+  free(sg->pivot);
+  free(sg->pivotdist);
+  sg->pivot = NULL;
+  sg->pivotdist = NULL;
+  sg->npivots = 0;
+  sg->pivotmetric = opf_PIVOT_NONE;
+
+  npivots = MIN(npivots, sg->nnodes);
+  if ((npivots <= 0) || opf_PrecomputedDistance)
+    return;
+  if (metric == opf_PIVOT_NONE)
+  {
+    fprintf(stderr, "\nThe arc weight is not a metric: no pivot index is created\n");
+    return;
+  }
+
+  sg->npivots = npivots;
+  sg->pivotmetric = metric;
+  sg->pivot = AllocIntArray(npivots);
+  sg->pivotdist = AllocFloatArray(sg->nnodes * npivots);
+  mindist = AllocFloatArray(sg->nnodes);
+  for (i = 0; i < sg->nnodes; i++)
+    mindist[i] = FLT_MAX;
+
+  // farthest-first selection, starting from the first node
+  far = 0;
+  for (p = 0; p < npivots; p++)
+  {
+    sg->pivot[p] = far;
+#pragma omp parallel for if (opf_NumThreads > 1) num_threads(opf_NumThreads) schedule(static)
+    for (i = 0; i < sg->nnodes; i++)
+    {
+      float d = opf_PivotMetric(metric, sg->node[i].feat, sg->node[sg->pivot[p]].feat, sg->nfeats);
+      sg->pivotdist[(size_t)i * npivots + p] = d;
+      mindist[i] = MIN(mindist[i], d);
+    }
+    for (i = 0; i < sg->nnodes; i++)
+      if (mindist[i] > mindist[far])
+        far = i;
+  }
+
+  free(mindist);
+}
+
+/*--------- Tiled classification ---------------------------------*/
+/* opf_OPFClassifying compares each test sample with the training
+   nodes in cost order until the next path cost is not lower than its
+   current minimum. Instead of walking the whole list for one sample at
+   a time, a block of test samples walks it together, one tile of
+   training nodes at a time, so the feature vectors of a tile are read
+   from cache by every sample of the block. Each sample keeps its own
+   minimum cost and stops when the next path cost reaches it. The
+   nodes of each sample are visited in the same order as before, so
+   the labels are the same. */
+#define opf_CLASSIFY_BLOCK 64           //test samples per block
+#define opf_CLASSIFY_TILE_BYTES 131072  //bytes of training features per tile
+
+typedef struct _opfordered {
+  float *pathval; //path costs in cost order
+  int *label;     //labels in cost order
+  float **feat;   //feature vectors in cost order
+  int n;          //number of training nodes
+  int tile;       //training nodes per tile
+  int npivots;    //number of pivots of the lower-bound index (0 if it is not used)
+  int pivotmetric;
+  float **pivotfeat; //feature vectors of the pivots
+  float *pivotdist;  //pivot distances in cost order
+  float *pivotmax;   //maximum distance to each pivot
+  opf_BoundedArcWeightFun arcweight; //bounded version of opf_ArcWeight
+} opf_OrderedTrain;
+
+static opf_OrderedTrain *opf_CreateOrderedTrain(Subgraph *sgtrain)
+{
+  opf_OrderedTrain *T = (opf_OrderedTrain *)calloc(1, sizeof(opf_OrderedTrain));
+  int j, k, p;
+
+  T->n = sgtrain->nnodes;
+  T->pathval = AllocFloatArray(T->n);
+  T->label = AllocIntArray(T->n);
+  T->feat = (float **)calloc(T->n, sizeof(float *));
+  for (j = 0; j < T->n; j++)
+  {
+    k = sgtrain->ordered_list_of_nodes[j];
+    T->pathval[j] = sgtrain->node[k].pathval;
+    T->label[j] = sgtrain->node[k].label;
+    T->feat[j] = sgtrain->node[k].feat;
+  }
+  T->tile = MAX(16, opf_CLASSIFY_TILE_BYTES / (int)(MAX(sgtrain->nfeats, 1) * sizeof(float)));
+  T->arcweight = opf_BoundedArcWeight(opf_ArcWeight);
+
+  if ((sgtrain->npivots > 0) && (sgtrain->pivotmetric == opf_PivotMetricOfArcWeight()))
+  {
+    T->npivots = sgtrain->npivots;
+    T->pivotmetric = sgtrain->pivotmetric;
+    T->pivotfeat = (float **)calloc(T->npivots, sizeof(float *));
+    T->pivotdist = AllocFloatArray(T->n * T->npivots);
+    for (p = 0; p < T->npivots; p++)
+      T->pivotfeat[p] = sgtrain->node[sgtrain->pivot[p]].feat;
+    for (j = 0; j < T->n; j++)
+      memcpy(&T->pivotdist[(size_t)j * T->npivots],
+             &sgtrain->pivotdist[(size_t)sgtrain->ordered_list_of_nodes[j] * T->npivots],
+             T->npivots * sizeof(float));
+    T->pivotmax = AllocFloatArray(T->npivots);
+    for (j = 0; j < T->n * T->npivots; j++)
+      T->pivotmax[j % T->npivots] = MAX(T->pivotmax[j % T->npivots], T->pivotdist[j]);
+  }
+
+  return T;
+}
+
+static void opf_DestroyOrderedTrain(opf_OrderedTrain **T)
+{
+  if (*T != NULL)
+  {
+    free((*T)->pathval);
+    free((*T)->label);
+    free((*T)->feat);
+    free((*T)->pivotfeat);
+    free((*T)->pivotdist);
+    free((*T)->pivotmax);
+    free(*T);
+    *T = NULL;
+  }
+}
+
+/* A node n can only conquer a sample x when, for every pivot v,
+   d(n,v) lies in [d(x,v) - thresh, d(x,v) + thresh], where thresh is
+   the metric distance of the current minimum cost. The intervals are
+   widened by the slack and computed again when the minimum changes. */
+static void opf_PivotIntervals(opf_OrderedTrain *T, float *xdist, float thresh, float *lo, float *hi)
+{
+  float r;
+  int p;
+
+  for (p = 0; p < T->npivots; p++)
+  {
+    r = thresh + opf_PIVOT_SLACK * (xdist[p] + T->pivotmax[p]);
+    lo[p] = xdist[p] - r;
+    hi[p] = xdist[p] + r;
+  }
+}
+
+// It returns 1 if the j-th node is outside the intervals of a sample
+static inline int opf_PivotExcludes(opf_OrderedTrain *T, float *lo, float *hi, int j)
+{
+  float *ndist = &T->pivotdist[(size_t)j * T->npivots];
+  int p;
+
+  for (p = 0; p < T->npivots; p++)
+    if ((ndist[p] < lo[p]) || (ndist[p] > hi[p]))
+      return 1;
+
+  return 0;
+}
+
+// It classifies the samples first,...,last-1 of sg
+static void opf_ClassifyBlock(opf_OrderedTrain *T, Subgraph *sg, int first, int last)
+{
+  float minCost[opf_CLASSIFY_BLOCK], tmp, weight;
+  float *xdist = NULL, *lo = NULL, *hi = NULL;
+  int label[opf_CLASSIFY_BLOCK], active[opf_CLASSIFY_BLOCK];
+  int b, nb = last - first, nactive, t, tend, j, p, np = T->npivots;
+
+  // first node in cost order
+  for (b = 0; b < nb; b++)
+  {
+    weight = opf_ArcWeight(T->feat[0], sg->node[first + b].feat, sg->nfeats);
+    minCost[b] = MAX(T->pathval[0], weight);
+    label[b] = T->label[0];
+    active[b] = b;
+  }
+  nactive = nb;
+
+  // distances to the pivots and intervals of the nodes that may conquer each sample
+  if (np > 0)
+  {
+    xdist = AllocFloatArray(nb * np);
+    lo = AllocFloatArray(nb * np);
+    hi = AllocFloatArray(nb * np);
+    for (b = 0; b < nb; b++)
+    {
+      for (p = 0; p < np; p++)
+        xdist[b * np + p] = opf_PivotMetric(T->pivotmetric, sg->node[first + b].feat, T->pivotfeat[p], sg->nfeats);
+      opf_PivotIntervals(T, &xdist[b * np], opf_PivotThreshold(T->pivotmetric, minCost[b]), &lo[b * np], &hi[b * np]);
+    }
+  }
+
+  // remaining nodes, one tile at a time
+  for (t = 1; (t < T->n) && (nactive > 0); t = tend)
+  {
+    tend = MIN(t + T->tile, T->n);
+    for (b = 0; b < nactive;)
+    {
+      int s = active[b];
+      float *feat = sg->node[first + s].feat;
+
+      for (j = t; (j < tend) && (minCost[s] > T->pathval[j]); j++)
+      {
+        if ((np > 0) && opf_PivotExcludes(T, &lo[s * np], &hi[s * np], j))
+          continue; // the node cannot offer a cost lower than minCost
+        weight = T->arcweight(T->feat[j], feat, sg->nfeats, minCost[s]); // only a weight below minCost matters
+        tmp = MAX(T->pathval[j], weight);
+        if (tmp < minCost[s])
+        {
+          minCost[s] = tmp;
+          label[s] = T->label[j];
+          if (np > 0)
+            opf_PivotIntervals(T, &xdist[s * np], opf_PivotThreshold(T->pivotmetric, minCost[s]), &lo[s * np], &hi[s * np]);
+        }
+      }
+      if (j < tend) // path costs are sorted, so the sample is done
+        active[b] = active[--nactive];
+      else
+        b++;
+    }
+  }
+
+  for (b = 0; b < nb; b++)
+    sg->node[first + b].label = label[b];
+  free(xdist);
+  free(lo);
+  free(hi);
+}
+
+// It classifies the samples first,...,last-1 of sg with precomputed or cached distances
+static void opf_ClassifyBlockScan(Subgraph *sgtrain, Subgraph *sg, int first, int last)
 {
   int i, j, k, l, label = -1;
   float tmp, weight, minCost;
 
-  for (i = 0; i < sg->nnodes; i++)
+  for (i = first; i < last; i++)
   {
     j = 0;
     k = sgtrain->ordered_list_of_nodes[j];
-    if (!opf_PrecomputedDistance)
-      weight = opf_ArcWeight(sgtrain->node[k].feat, sg->node[i].feat, sg->nfeats);
-    else
-      weight = opf_DistanceValue[sgtrain->node[k].position][sg->node[i].position];
+    weight = opf_NodeDistance(&sgtrain->node[k], &sg->node[i], sg->nfeats);
 
     minCost = MAX(sgtrain->node[k].pathval, weight);
     label = sgtrain->node[k].label;
@@ -122,10 +548,7 @@ void opf_OPFClassifying(Subgraph *sgtrain, Subgraph *sg)
 
       l = sgtrain->ordered_list_of_nodes[j + 1];
 
-      if (!opf_PrecomputedDistance)
-        weight = opf_ArcWeight(sgtrain->node[l].feat, sg->node[i].feat, sg->nfeats);
-      else
-        weight = opf_DistanceValue[sgtrain->node[l].position][sg->node[i].position];
+      weight = opf_NodeDistance(&sgtrain->node[l], &sg->node[i], sg->nfeats);
       tmp = MAX(sgtrain->node[l].pathval, weight);
       if (tmp < minCost)
       {
@@ -139,6 +562,93 @@ void opf_OPFClassifying(Subgraph *sgtrain, Subgraph *sg)
   }
 }
 
+// It returns the wall-clock time in seconds
+static double opf_WallTime(void)
+{
+#ifdef _OPENMP
+  return omp_get_wtime();
+#else
+  timer t;
+
+  gettimeofday(&t, NULL);
+  return t.tv_sec + t.tv_usec * 1e-6;
+#endif
+}
+
+opf_ThreadStats *opf_CreateThreadStats(int nthreads)
+{
+  opf_ThreadStats *S = (opf_ThreadStats *)calloc(1, sizeof(opf_ThreadStats));
+
+  S->nthreads = MAX(nthreads, 1);
+  S->nsamples = AllocIntArray(S->nthreads);
+  S->time = (double *)calloc(S->nthreads, sizeof(double));
+
+  return S;
+}
+
+void opf_DestroyThreadStats(opf_ThreadStats **S)
+{
+  if (*S != NULL)
+  {
+    free((*S)->nsamples);
+    free((*S)->time);
+    free(*S);
+    *S = NULL;
+  }
+}
+
+//Classification function: it simply classifies samples from sg -----
+void opf_OPFClassifying(Subgraph *sgtrain, Subgraph *sg)
+{
+  opf_OPFClassifyingParallel(sgtrain, sg, opf_NumThreads, NULL);
+}
+
+/* Parallel classification function: the blocks of test samples are
+   shared among nthreads threads by dynamic scheduling, since the cost
+   of a sample depends on how soon its path cost cutoff is reached.
+   If stats is not NULL, it must have been created for nthreads
+   threads, and it receives the samples classified by each thread and
+   the time each thread spent. */
+void opf_OPFClassifyingParallel(Subgraph *sgtrain, Subgraph *sg, int nthreads, opf_ThreadStats *stats)
+{
+  opf_OrderedTrain *T = NULL;
+  int nblocks = (sg->nnodes + opf_CLASSIFY_BLOCK - 1) / opf_CLASSIFY_BLOCK;
+
+  nthreads = MAX(nthreads, 1);
+  if (!opf_PrecomputedDistance && (opf_DistanceCache == NULL))
+    T = opf_CreateOrderedTrain(sgtrain);
+
+#pragma omp parallel if (nthreads > 1) num_threads(nthreads)
+  {
+    int tid = 0, b, first, last, nsamples = 0;
+    double start = opf_WallTime();
+
+#ifdef _OPENMP
+    tid = omp_get_thread_num();
+#endif
+
+#pragma omp for schedule(dynamic, 1)
+    for (b = 0; b < nblocks; b++)
+    {
+      first = b * opf_CLASSIFY_BLOCK;
+      last = MIN(first + opf_CLASSIFY_BLOCK, sg->nnodes);
+      if (T != NULL)
+        opf_ClassifyBlock(T, sg, first, last);
+      else
+        opf_ClassifyBlockScan(sgtrain, sg, first, last);
+      nsamples += last - first;
+    }
+
+    if ((stats != NULL) && (tid < stats->nthreads))
+    {
+      stats->nsamples[tid] = nsamples;
+      stats->time[tid] = opf_WallTime() - start;
+    }
+  }
+
+  opf_DestroyOrderedTrain(&T);
+}
+
 /*Classification function: it classifies samples from sg and it marks as relevant
 all training samples (and the whole path until the prototype) that were used in any classification process ----- */
 void opf_OPFClassifyingAndMarkNodes(Subgraph *sgtrain, Subgraph *sg)
@@ -150,10 +660,7 @@ void opf_OPFClassifyingAndMarkNodes(Subgraph *sgtrain, Subgraph *sg)
   {
     j = 0;
     k = sgtrain->ordered_list_of_nodes[j];
-    if (!opf_PrecomputedDistance)
-      weight = opf_ArcWeight(sgtrain->node[k].feat, sg->node[i].feat, sg->nfeats);
-    else
-      weight = opf_DistanceValue[sgtrain->node[k].position][sg->node[i].position];
+    weight = opf_NodeDistance(&sgtrain->node[k], &sg->node[i], sg->nfeats);
 
     minCost = MAX(sgtrain->node[k].pathval, weight);
     label = sgtrain->node[k].label;
@@ -164,10 +671,7 @@ void opf_OPFClassifyingAndMarkNodes(Subgraph *sgtrain, Subgraph *sg)
 
       l = sgtrain->ordered_list_of_nodes[j + 1];
 
-      if (!opf_PrecomputedDistance)
-        weight = opf_ArcWeight(sgtrain->node[l].feat, sg->node[i].feat, sg->nfeats);
-      else
-        weight = opf_DistanceValue[sgtrain->node[l].position][sg->node[i].position];
+      weight = opf_NodeDistance(&sgtrain->node[l], &sg->node[i], sg->nfeats);
       tmp = MAX(sgtrain->node[l].pathval, weight);
       if (tmp < minCost)
       {
@@ -253,10 +757,7 @@ Subgraph *opf_OPFSemiLearning(Subgraph *sg, Subgraph *nonsg, Subgraph *sgeval)
       {
         if (pathval[p] < pathval[q])
         {
-          if (!opf_PrecomputedDistance)
-            weight = opf_ArcWeight(merged->node[p].feat, merged->node[q].feat, merged->nfeats);
-          else
-            weight = opf_DistanceValue[merged->node[p].position][merged->node[q].position];
+          weight = opf_NodeDistance(&merged->node[p], &merged->node[q], merged->nfeats);
           tmp = MAX(pathval[p], weight);
           if (tmp < pathval[q])
           {
@@ -330,6 +831,14 @@ void opf_OPFAgglomerativeLearning(Subgraph **sgtrain, Subgraph **sgeval)
   } while (n);
 }
 
+static void opf_KnnLists(Subgraph *sg, int knn, float *D, int *NN);
+static void opf_SetKnnArcs(Subgraph *sg, int kmax, float *D, int *NN, int knn);
+static void opf_KnnTrainSearch(Subgraph *Train, KnnIndex *T, KnnBoundFun bound, Subgraph *Test, int i, int knn,
+                               float *d, int *nn);
+static void opf_KnnClassifySample(Subgraph *Train, Subgraph *Test, int i, int knn, float *d, int *nn);
+static KnnIndex *opf_KnnClassifierIndex(Subgraph *Train, int knn, KnnBoundFun *bound);
+static int opf_KnnMetricFuns(int metric, KnnBoundFun *bound, KnnMetricFun *fun);
+
 void opf_OPFknnTraining(Subgraph *Train, Subgraph *Eval, int kmax)
 {
   Train->bestk = opf_OPFknnLearning(Train, Eval, kmax);
@@ -337,24 +846,37 @@ void opf_OPFknnTraining(Subgraph *Train, Subgraph *Eval, int kmax)
   opf_PDF(Train);
   opf_OPFClustering4SupervisedLearningForceOnePrototypePerClass(Train);
   opf_DestroyArcs(Train);
+  opf_CreateKnnClassifierIndex(Train);
 }
 
 int opf_OPFknnLearning(Subgraph *Train, Subgraph *Eval, int kmax)
 {
-  int k, bestk = 1;
+  int i, k, bestk = 1;
   float MaxAcc = -FLT_MAX, Acc = 0.0;
   Subgraph *Train_cpy = CopySubgraph(Train), *Eval_cpy = CopySubgraph(Eval);
+  KnnBoundFun bound = NULL;
+  KnnIndex *T = NULL;
+  /* the knn graph of every k and the k-nearest training nodes of the
+     evaluation samples are the first k entries of the kmax lists */
+  float *d = AllocFloatArray(MAX(Train->nnodes * kmax, 1)), *evald = AllocFloatArray(MAX(Eval->nnodes * kmax, 1) + 1);
+  int *nn = AllocIntArray(MAX(Train->nnodes * kmax, 1)), *evalnn = AllocIntArray(MAX(Eval->nnodes * kmax, 1) + 1);
+
+  opf_KnnLists(Train_cpy, kmax, d, nn);
+  T = opf_KnnClassifierIndex(Train_cpy, kmax, &bound);
+  for (i = 0; i < Eval_cpy->nnodes; i++) // the row of i has room for the extra entry of the search, overwritten by the next row
+    opf_KnnTrainSearch(Train_cpy, T, bound, Eval_cpy, i, kmax, &evald[(size_t)i * kmax], &evalnn[(size_t)i * kmax]);
 
   for (k = 1; k <= kmax; k++)
   {
     fprintf(stderr, "\nEvaluating k = %d ... ", k);
     Train_cpy->bestk = k;
 
-    opf_CreateArcs(Train_cpy, k);
+    opf_SetKnnArcs(Train_cpy, kmax, d, nn, k);
     opf_PDF(Train_cpy);
     opf_OPFClustering4SupervisedLearning(Train_cpy);
 
-    opf_OPFknnClassify(Train_cpy, Eval_cpy);
+    for (i = 0; i < Eval_cpy->nnodes; i++)
+      opf_KnnClassifySample(Train_cpy, Eval_cpy, i, k, &evald[(size_t)i * kmax], &evalnn[(size_t)i * kmax]);
     Acc = opf_Accuracy(Eval_cpy);
     fprintf(stderr, " %.2f%%", Acc * 100);
 
@@ -367,6 +889,10 @@ int opf_OPFknnLearning(Subgraph *Train, Subgraph *Eval, int kmax)
     opf_DestroyArcs(Train_cpy);
   }
 
+  free(d);
+  free(nn);
+  free(evald);
+  free(evalnn);
   DestroySubgraph(&Train_cpy);
   DestroySubgraph(&Eval_cpy);
   fprintf(stderr, "\n	-> best k: %d", bestk);
@@ -374,125 +900,405 @@ int opf_OPFknnLearning(Subgraph *Train, Subgraph *Eval, int kmax)
   return bestk;
 }
 
+/* It finds the knn-nearest training nodes of the test sample i, from
+   the nearest to the farthest, in nn[0..knn-1] with their arc weights
+   in d[0..knn-1] (d and nn have room for knn+1 entries). The search
+   goes down the index T of the training nodes, or scans them if T is
+   NULL; both rank the nodes by weight and then by index. The scan reads
+   the precomputed or cached distances, if any. */
+static void opf_KnnTrainSearch(Subgraph *Train, KnnIndex *T, KnnBoundFun bound, Subgraph *Test, int i, int knn,
+                               float *d, int *nn)
+{
+  int j, k, l;
+  float dist;
+  opf_BoundedArcWeightFun arcweight = opf_BoundedArcWeight(opf_ArcWeight);
+
+  if (T != NULL)
+  {
+    KnnIndexSearch(T, Test->node[i].feat, NIL, knn, arcweight, bound, d, nn);
+    return;
+  }
+
+  for (l = 0; l < knn; l++)
+    d[l] = FLT_MAX;
+
+  for (j = 0; j < Train->nnodes; j++)
+  {
+    if (!opf_PrecomputedDistance && (opf_DistanceCache == NULL)) // only a distance below the k-th one matters
+      d[knn] = arcweight(Test->node[i].feat, Train->node[j].feat, Train->nfeats, d[knn - 1]);
+    else
+      d[knn] = opf_NodeDistance(&Test->node[i], &Train->node[j], Train->nfeats);
+    nn[knn] = j;
+    k = knn;
+    while ((k > 0) && (d[k] < d[k - 1]))
+    {
+      dist = d[k];
+      l = nn[k];
+      d[k] = d[k - 1];
+      nn[k] = nn[k - 1];
+      d[k - 1] = dist;
+      nn[k - 1] = l;
+      k--;
+    }
+  }
+}
+
+// It labels the test sample i from its knn-nearest training nodes, found by opf_KnnTrainSearch
+static void opf_KnnClassifySample(Subgraph *Train, Subgraph *Test, int i, int knn, float *d, int *nn)
+{
+  int l;
+  float tmp, cost = -FLT_MAX, dens;
+
+  /* computing the density of testing sample i */
+  dens = DistKernels.expsum(d, knn, Train->K) / knn;
+
+  /* scaling density */
+  dens = ((float)(opf_MAXDENS - 1) * (dens - Train->mindens) / (float)(Train->maxdens - Train->mindens)) + 1.0;
+
+  for (l = 0; l < knn; l++)
+  {
+    if (d[l] != INT_MAX)
+    {
+      tmp = MIN(Train->node[nn[l]].pathval, dens);
+      if (tmp > cost)
+      {
+        cost = tmp;
+        Test->node[i].label = Train->node[nn[l]].label;
+      }
+    }
+  }
+}
+
 // OPFknn Classification function
 void opf_OPFknnClassify(Subgraph *Train, Subgraph *Test)
 {
-  int i, j, k, l, knn = Train->bestk, *nn = AllocIntArray(knn + 1);
-  float dist = -1.0, *d = AllocFloatArray(Train->bestk + 1), tmp, cost, dens;
+  opf_OPFknnClassifyParallel(Train, Test, opf_NumThreads, NULL);
+}
+
+/* Parallel OPFknn classification function: the blocks of test samples
+   are shared among nthreads threads as in opf_OPFClassifyingParallel.
+   The k-nearest training nodes come from the knn index of the model,
+   which is created first if the model has none. */
+void opf_OPFknnClassifyParallel(Subgraph *Train, Subgraph *Test, int nthreads, opf_ThreadStats *stats)
+{
+  int knn = Train->bestk, nblocks = (Test->nnodes + opf_CLASSIFY_BLOCK - 1) / opf_CLASSIFY_BLOCK;
+  KnnBoundFun bound = NULL;
+  KnnIndex *T = opf_KnnClassifierIndex(Train, knn, &bound);
 
-  for (i = 0; i < Test->nnodes; i++)
+  nthreads = MAX(nthreads, 1);
+
+#pragma omp parallel if (nthreads > 1) num_threads(nthreads)
   {
-    cost = -FLT_MAX;
+    int tid = 0, b, i, first, last, nsamples = 0, *nn = AllocIntArray(knn + 1);
+    float *d = AllocFloatArray(knn + 1);
+    double start = opf_WallTime();
 
-    /* it computes the k-nearest neighbours of test sample i */
-    for (l = 0; l < knn; l++)
-      d[l] = FLT_MAX;
+#ifdef _OPENMP
+    tid = omp_get_thread_num();
+#endif
 
-    for (j = 0; j < Train->nnodes; j++)
+#pragma omp for schedule(dynamic, 1)
+    for (b = 0; b < nblocks; b++)
     {
-      if (j != i)
+      first = b * opf_CLASSIFY_BLOCK;
+      last = MIN(first + opf_CLASSIFY_BLOCK, Test->nnodes);
+      for (i = first; i < last; i++)
       {
-        if (!opf_PrecomputedDistance)
-          d[knn] = opf_ArcWeight(Test->node[i].feat, Train->node[j].feat, Train->nfeats);
-        else
-          d[knn] = opf_DistanceValue[Test->node[i].position][Train->node[j].position];
-        nn[knn] = j;
-        k = knn;
-        while ((k > 0) && (d[k] < d[k - 1]))
-        {
-          dist = d[k];
-          l = nn[k];
-          d[k] = d[k - 1];
-          nn[k] = nn[k - 1];
-          d[k - 1] = dist;
-          nn[k - 1] = l;
-          k--;
-        }
+        /* it computes the k-nearest neighbours of test sample i */
+        opf_KnnTrainSearch(Train, T, bound, Test, i, knn, d, nn);
+        opf_KnnClassifySample(Train, Test, i, knn, d, nn);
       }
+      nsamples += last - first;
     }
 
-    /* computing the density of testing sample i */
-    dens = 0;
-    for (l = 0; l < knn; l++){
-      dens += exp(-d[l] / Train->K);
+    if ((stats != NULL) && (tid < stats->nthreads))
+    {
+      stats->nsamples[tid] = nsamples;
+      stats->time[tid] = opf_WallTime() - start;
     }
-    dens /= knn;
-    
-    /* scaling density */
-    dens = ((float)(opf_MAXDENS - 1) * (dens - Train->mindens) / (float)(Train->maxdens - Train->mindens)) + 1.0;
-    
-    for (l = 0; l < knn; l++)
+    free(d);
+    free(nn);
+  }
+}
+
+/* It returns the weight of the arc (j,i) mirroring the arc (i,j) of
+   weight w. The arc weights and the triangular distance files are
+   symmetric, but a full distance matrix may not be, so (j,i) is read
+   from it. */
+static float opf_MirroredArcWeight(Subgraph *sg, int i, int j, float w)
+{
+  if (opf_PrecomputedDistance && !opf_DistanceTriangular)
+    return opf_Distance(sg->node[j].position, sg->node[i].position);
+
+  return w;
+}
+
+// It returns 1 if i is among the first maxarcs arcs of j (overflow arcs first)
+static char opf_IsAmongArcs(Subgraph *sg, int j, int i, int maxarcs)
+{
+  int e, a, k = 0;
+
+  for (e = sg->ovfhead[j]; (e != NIL) && (k < maxarcs); e = sg->ovfnext[e], k++)
+    if (sg->ovfnode[e] == i)
+      return 1;
+  for (a = sg->arcoffset[j]; (a < sg->arcoffset[j + 1]) && (k < maxarcs); a++, k++)
+    if (sg->arcnode[a] == i)
+      return 1;
+
+  return 0;
+}
+
+/* It adds arcs to guarantee symmetry on plateaus among the first kmax
+   arcs of each node: for every such arc (i,j) with dens(i) = dens(j),
+   it inserts (j,i) in front of the arcs of j if i is not among the first
+   kmax arcs of j, counting it in nplatadj. The arcs inserted during the
+   pass are seen by the nodes visited after them and take window slots,
+   so the pass is sequential. (j,i) takes the weight of (i,j) unless the
+   distances are asymmetric (opf_MirroredArcWeight). */
+static void opf_SymmetrizePlateausToKmax(Subgraph *sg, int kmax)
+{
+  int i, j, e, a, k;
+  float w;
+
+  for (i = 0; i < sg->nnodes; i++)
+  {
+    for (k = 0, e = sg->ovfhead[i], a = sg->arcoffset[i]; k < kmax; k++)
     {
-      if (d[l] != INT_MAX)
+      if (e != NIL)
       {
-        tmp = MIN(Train->node[nn[l]].pathval, dens);
-        if (tmp > cost)
-        {
-          cost = tmp;
-          Test->node[i].label = Train->node[nn[l]].label;
-        }
+        j = sg->ovfnode[e];
+        w = sg->ovfweight[e];
+        e = sg->ovfnext[e];
+      }
+      else if (a < sg->arcoffset[i + 1])
+      {
+        j = sg->arcnode[a];
+        w = sg->arcweight[a];
+        a++;
+      }
+      else
+        break;
+      if ((sg->node[i].dens == sg->node[j].dens) && !opf_IsAmongArcs(sg, j, i, kmax))
+      {
+        InsertSgOverflowArc(sg, j, i, opf_MirroredArcWeight(sg, i, j, w));
+        sg->node[j].nplatadj++;
       }
     }
   }
+  MergeSgArcs(sg);
+}
+
+/* It adds arcs to guarantee symmetry on plateaus: for every arc (i,j)
+   with dens(i) = dens(j), it inserts (j,i) in front of the arcs of j if
+   j has no arc to i. The plateau arcs are first grouped by their
+   destination j, and then each j marks its own arcs and tests the nodes
+   of its group against the marks, in parallel over the nodes, which
+   takes O(1) per arc. The missing arcs are inserted in the order of a
+   node by node scan (the arcs of j inserted by i come before those
+   inserted by nodes lower than i). (j,i) takes the weight of (i,j)
+   unless the distances are asymmetric (opf_MirroredArcWeight). */
+void opf_SymmetrizePlateaus(Subgraph *sg)
+{
+  int i, j, a, *inoffset = NULL, *inarc = NULL, *innode = NULL, *pos = NULL;
+  char *missing = NULL;
+
+  MergeSgArcs(sg);
+
+  // inarc[inoffset[j]..inoffset[j+1]-1]: plateau arcs (i,j), in increasing order of i
+  inoffset = AllocIntArray(sg->nnodes + 1);
+  for (i = 0; i < sg->nnodes; i++)
+    for (a = sg->arcoffset[i]; a < sg->arcoffset[i + 1]; a++)
+      if (sg->node[i].dens == sg->node[sg->arcnode[a]].dens)
+        inoffset[sg->arcnode[a] + 1]++;
+  for (j = 0; j < sg->nnodes; j++)
+    inoffset[j + 1] += inoffset[j];
+  if (inoffset[sg->nnodes] == 0)
+  {
+    free(inoffset);
+    return;
+  }
+
+  inarc = AllocIntArray(inoffset[sg->nnodes]);
+  innode = AllocIntArray(inoffset[sg->nnodes]);
+  pos = AllocIntArray(sg->nnodes);
+  memcpy(pos, inoffset, sg->nnodes * sizeof(int));
+  for (i = 0; i < sg->nnodes; i++)
+    for (a = sg->arcoffset[i]; a < sg->arcoffset[i + 1]; a++)
+      if (sg->node[i].dens == sg->node[sg->arcnode[a]].dens)
+      {
+        j = sg->arcnode[a];
+        inarc[pos[j]] = a;
+        innode[pos[j]++] = i;
+      }
+  free(pos);
+
+  missing = (char *)calloc(sg->arcoffset[sg->nnodes], sizeof(char));
+#pragma omp parallel if (opf_NumThreads > 1) num_threads(opf_NumThreads) private(i, a)
+  {
+    int *mark = AllocIntArray(sg->nnodes), e;
+
+    for (i = 0; i < sg->nnodes; i++)
+      mark[i] = NIL;
+#pragma omp for schedule(static)
+    for (j = 0; j < sg->nnodes; j++)
+    {
+      if (inoffset[j] == inoffset[j + 1])
+        continue;
+      for (a = sg->arcoffset[j]; a < sg->arcoffset[j + 1]; a++)
+        mark[sg->arcnode[a]] = j;
+      for (e = inoffset[j]; e < inoffset[j + 1]; e++)
+        if (mark[innode[e]] != j)
+          missing[inarc[e]] = 1;
+    }
+    free(mark);
+  }
+
+  for (i = 0; i < sg->nnodes; i++)
+    for (a = sg->arcoffset[i]; a < sg->arcoffset[i + 1]; a++)
+      if (missing[a])
+        InsertSgOverflowArc(sg, sg->arcnode[a], i, opf_MirroredArcWeight(sg, i, sg->arcnode[a], sg->arcweight[a]));
+  MergeSgArcs(sg);
+
+  free(inoffset);
+  free(inarc);
+  free(innode);
+  free(missing);
+}
+
+/*--------- Priority queue of the clustering IFTs ------------------*/
+/* The clustering IFTs remove the node of maximum path value from a
+   RealHeap or, with opf_QUEUE_BUCKET, from a bucket queue (GQueue) of
+   integer path values, where an update takes O(1). opf_PDF then rounds
+   the densities, so that every path value is an integer. Nodes of equal
+   path value leave the bucket queue in FIFO order and the heap in its
+   own order, so the roots and labels on plateaus may differ between the
+   queues (tools/opf_queuecheck reports it); the path values do not. */
+
+#define opf_MAXBUCKETS (1 << 20) //largest path value of the bucket queue (the heap is used above it)
+
+typedef struct _opfpathqueue {
+  RealHeap *H;    //heap of the path values (NULL with buckets)
+  GQueue *G;      //bucket queue of value (NULL with the heap)
+  float *pathval;
+  int *value;     //path values, which are integers, for G
+} opf_PathQueue;
+
+/* It creates the queue of the clustering IFT of sg and inserts every
+   node with its path value pathval[p]. The bucket queue is used with
+   opf_QUEUE_BUCKET if the path values and densities round into a range
+   of at most opf_MAXBUCKETS nonnegative integers, and the values are
+   rounded */
+static opf_PathQueue *opf_CreatePathQueue(Subgraph *sg, float *pathval)
+{
+  opf_PathQueue *Q = (opf_PathQueue *)calloc(1, sizeof(opf_PathQueue));
+  float maxval = 0.0;
+  int p, bucket = (opf_ClusteringQueue == opf_QUEUE_BUCKET);
+
+  Q->pathval = pathval;
+  for (p = 0; (p < sg->nnodes) && bucket; p++)
+  {
+    if ((pathval[p] < 0) || (sg->node[p].dens < 0))
+      bucket = 0;
+    maxval = MAX(maxval, MAX(pathval[p], sg->node[p].dens));
+  }
+  if (maxval > opf_MAXBUCKETS)
+    bucket = 0;
+
+  if (bucket)
+  {
+    Q->value = AllocIntArray(MAX(sg->nnodes, 1));
+    Q->G = CreateGQueue((int)rintf(maxval) + 1, sg->nnodes, Q->value);
+    SetRemovalPolicy(Q->G, MAXVALUE);
+    for (p = 0; p < sg->nnodes; p++)
+    {
+      pathval[p] = rintf(pathval[p]);
+      Q->value[p] = (int)pathval[p];
+      InsertGQueue(&Q->G, p);
+    }
+  }
+  else
+  {
+    Q->H = CreateRealHeap(sg->nnodes, pathval);
+    SetRemovalPolicyRealHeap(Q->H, MAXVALUE);
+    for (p = 0; p < sg->nnodes; p++)
+      InsertRealHeap(Q->H, p);
+  }
 
-  free(d);
-  free(nn);
+  return Q;
+}
+
+static void opf_DestroyPathQueue(opf_PathQueue **Q)
+{
+  if (*Q != NULL)
+  {
+    DestroyRealHeap(&(*Q)->H);
+    DestroyGQueue(&(*Q)->G);
+    free((*Q)->value);
+    free(*Q);
+    *Q = NULL;
+  }
+}
+
+static char opf_IsEmptyPathQueue(opf_PathQueue *Q)
+{
+  if (Q->G != NULL)
+    return EmptyGQueue(Q->G);
+  return IsEmptyRealHeap(Q->H);
+}
+
+static int opf_RemovePathQueue(opf_PathQueue *Q)
+{
+  int p;
+
+  if (Q->G != NULL)
+    return RemoveGQueue(Q->G);
+  RemoveRealHeap(Q->H, &p);
+  return p;
+}
+
+// It returns 1 if p has left the queue
+static char opf_IsRemovedPathQueue(opf_PathQueue *Q, int p)
+{
+  if (Q->G != NULL)
+    return (Q->G->L.elem[p].color == BLACK);
+  return (Q->H->color[p] == BLACK);
+}
+
+// It raises the path value of p, still in the queue, to value
+static void opf_UpdatePathQueue(opf_PathQueue *Q, int p, float value)
+{
+  if (Q->G != NULL)
+  {
+    Q->pathval[p] = value;
+    UpdateGQueue(&Q->G, p, (int)value);
+  }
+  else
+    UpdateRealHeap(Q->H, p, value);
 }
 
 void opf_OPFClustering4SupervisedLearning(Subgraph *sg)
 {
-  Set *adj_i, *adj_j;
-  char insert_i;
-  int i, j;
+  int i, a;
   int p, q;
   float tmp, *pathval = NULL;
-  RealHeap *Q = NULL;
-  Set *Saux = NULL;
+  opf_PathQueue *Q = NULL;
 
   //   Add arcs to guarantee symmetry on plateaus
-  for (i = 0; i < sg->nnodes; i++)
-  {
-    adj_i = sg->node[i].adj;
-    while (adj_i != NULL)
-    {
-      j = adj_i->elem;
-      if (sg->node[i].dens == sg->node[j].dens)
-      {
-        // insert i in the adjacency of j if it is not there.
-        adj_j = sg->node[j].adj;
-        insert_i = 1;
-        while (adj_j != NULL)
-        {
-          if (i == adj_j->elem)
-          {
-            insert_i = 0;
-            break;
-          }
-          adj_j = adj_j->next;
-        }
-        if (insert_i)
-          InsertSet(&(sg->node[j].adj), i);
-      }
-      adj_i = adj_i->next;
-    }
-  }
+  opf_SymmetrizePlateaus(sg);
 
   pathval = AllocFloatArray(sg->nnodes);
-  Q = CreateRealHeap(sg->nnodes, pathval);
-  SetRemovalPolicyRealHeap(Q, MAXVALUE);
-
   for (p = 0; p < sg->nnodes; p++)
   {
     pathval[p] = sg->node[p].pathval;
     sg->node[p].pred = NIL;
     sg->node[p].root = p;
-    InsertRealHeap(Q, p);
   }
+  Q = opf_CreatePathQueue(sg, pathval);
 
   i = 0;
-  while (!IsEmptyRealHeap(Q))
+  while (!opf_IsEmptyPathQueue(Q))
   {
-    RemoveRealHeap(Q, &p);
+    p = opf_RemovePathQueue(Q);
     sg->ordered_list_of_nodes[i] = p;
     i++;
 
@@ -503,15 +1309,15 @@ void opf_OPFClustering4SupervisedLearning(Subgraph *sg)
     }
 
     sg->node[p].pathval = pathval[p];
-    for (Saux = sg->node[p].adj; Saux != NULL; Saux = Saux->next)
+    for (a = sg->arcoffset[p]; a < sg->arcoffset[p + 1]; a++)
     {
-      q = Saux->elem;
-      if (Q->color[q] != BLACK)
+      q = sg->arcnode[a];
+      if (!opf_IsRemovedPathQueue(Q, q))
       {
         tmp = MIN(pathval[p], sg->node[q].dens);
         if (tmp > pathval[q])
         {
-          UpdateRealHeap(Q, q, tmp);
+          opf_UpdatePathQueue(Q, q, tmp);
           sg->node[q].pred = p;
           sg->node[q].root = sg->node[p].root;
           sg->node[q].label = sg->node[p].label;
@@ -520,64 +1326,33 @@ void opf_OPFClustering4SupervisedLearning(Subgraph *sg)
     }
   }
 
-  DestroyRealHeap(&Q);
+  opf_DestroyPathQueue(&Q);
   free(pathval);
 }
 
 void opf_OPFClustering4SupervisedLearningForceOnePrototypePerClass(Subgraph *sg)
 {
-  Set *adj_i, *adj_j;
-  char insert_i;
-  int i, j;
+  int i, a;
   int p, q;
   float tmp, *pathval = NULL;
-  RealHeap *Q = NULL;
-  Set *Saux = NULL;
+  opf_PathQueue *Q = NULL;
 
   //   Add arcs to guarantee symmetry on plateaus
-  for (i = 0; i < sg->nnodes; i++)
-  {
-    adj_i = sg->node[i].adj;
-    while (adj_i != NULL)
-    {
-      j = adj_i->elem;
-      if (sg->node[i].dens == sg->node[j].dens)
-      {
-        // insert i in the adjacency of j if it is not there.
-        adj_j = sg->node[j].adj;
-        insert_i = 1;
-        while (adj_j != NULL)
-        {
-          if (i == adj_j->elem)
-          {
-            insert_i = 0;
-            break;
-          }
-          adj_j = adj_j->next;
-        }
-        if (insert_i)
-          InsertSet(&(sg->node[j].adj), i);
-      }
-      adj_i = adj_i->next;
-    }
-  }
+  opf_SymmetrizePlateaus(sg);
 
   pathval = AllocFloatArray(sg->nnodes);
-  Q = CreateRealHeap(sg->nnodes, pathval);
-  SetRemovalPolicyRealHeap(Q, MAXVALUE);
-
   for (p = 0; p < sg->nnodes; p++)
   {
     pathval[p] = sg->node[p].pathval;
     sg->node[p].pred = NIL;
     sg->node[p].root = p;
-    InsertRealHeap(Q, p);
   }
+  Q = opf_CreatePathQueue(sg, pathval);
 
   i = 0;
-  while (!IsEmptyRealHeap(Q))
+  while (!opf_IsEmptyPathQueue(Q))
   {
-    RemoveRealHeap(Q, &p);
+    p = opf_RemovePathQueue(Q);
     sg->ordered_list_of_nodes[i] = p;
     i++;
 
@@ -588,17 +1363,17 @@ void opf_OPFClustering4SupervisedLearningForceOnePrototypePerClass(Subgraph *sg)
     }
 
     sg->node[p].pathval = pathval[p];
-    for (Saux = sg->node[p].adj; Saux != NULL; Saux = Saux->next)
+    for (a = sg->arcoffset[p]; a < sg->arcoffset[p + 1]; a++)
     {
-      q = Saux->elem;
-      if (Q->color[q] != BLACK)
+      q = sg->arcnode[a];
+      if (!opf_IsRemovedPathQueue(Q, q))
       {
         tmp = MIN(pathval[p], sg->node[q].dens);
         if (sg->node[p].truelabel != sg->node[q].truelabel)
           tmp = -FLT_MAX;
         if (tmp > pathval[q])
         {
-          UpdateRealHeap(Q, q, tmp);
+          opf_UpdatePathQueue(Q, q, tmp);
           sg->node[q].pred = p;
           sg->node[q].root = sg->node[p].root;
           sg->node[q].label = sg->node[p].label;
@@ -607,7 +1382,7 @@ void opf_OPFClustering4SupervisedLearningForceOnePrototypePerClass(Subgraph *sg)
     }
   }
 
-  DestroyRealHeap(&Q);
+  opf_DestroyPathQueue(&Q);
   free(pathval);
 }
 
@@ -617,61 +1392,30 @@ void opf_OPFClustering4SupervisedLearningForceOnePrototypePerClass(Subgraph *sg)
 
 void opf_OPFClustering(Subgraph *sg)
 {
-  Set *adj_i, *adj_j;
-  char insert_i;
-  int i, j;
+  int i, a;
   int p, q, l;
   float tmp, *pathval = NULL;
-  RealHeap *Q = NULL;
-  Set *Saux = NULL;
+  opf_PathQueue *Q = NULL;
 
   //   Add arcs to guarantee symmetry on plateaus
-  for (i = 0; i < sg->nnodes; i++)
-  {
-    adj_i = sg->node[i].adj;
-    while (adj_i != NULL)
-    {
-      j = adj_i->elem;
-      if (sg->node[i].dens == sg->node[j].dens)
-      {
-        // insert i in the adjacency of j if it is not there.
-        adj_j = sg->node[j].adj;
-        insert_i = 1;
-        while (adj_j != NULL)
-        {
-          if (i == adj_j->elem)
-          {
-            insert_i = 0;
-            break;
-          }
-          adj_j = adj_j->next;
-        }
-        if (insert_i)
-          InsertSet(&(sg->node[j].adj), i);
-      }
-      adj_i = adj_i->next;
-    }
-  }
+  opf_SymmetrizePlateaus(sg);
 
   // Compute clustering
 
   pathval = AllocFloatArray(sg->nnodes);
-  Q = CreateRealHeap(sg->nnodes, pathval);
-  SetRemovalPolicyRealHeap(Q, MAXVALUE);
-
   for (p = 0; p < sg->nnodes; p++)
   {
     pathval[p] = sg->node[p].pathval;
     sg->node[p].pred = NIL;
     sg->node[p].root = p;
-    InsertRealHeap(Q, p);
   }
+  Q = opf_CreatePathQueue(sg, pathval);
 
   l = 0;
   i = 0;
-  while (!IsEmptyRealHeap(Q))
+  while (!opf_IsEmptyPathQueue(Q))
   {
-    RemoveRealHeap(Q, &p);
+    p = opf_RemovePathQueue(Q);
     sg->ordered_list_of_nodes[i] = p;
     i++;
 
@@ -683,15 +1427,15 @@ void opf_OPFClustering(Subgraph *sg)
     }
 
     sg->node[p].pathval = pathval[p];
-    for (Saux = sg->node[p].adj; Saux != NULL; Saux = Saux->next)
+    for (a = sg->arcoffset[p]; a < sg->arcoffset[p + 1]; a++)
     {
-      q = Saux->elem;
-      if (Q->color[q] != BLACK)
+      q = sg->arcnode[a];
+      if (!opf_IsRemovedPathQueue(Q, q))
       {
         tmp = MIN(pathval[p], sg->node[q].dens);
         if (tmp > pathval[q])
         {
-          UpdateRealHeap(Q, q, tmp);
+          opf_UpdatePathQueue(Q, q, tmp);
           sg->node[q].pred = p;
           sg->node[q].root = sg->node[p].root;
           sg->node[q].label = sg->node[p].label;
@@ -702,7 +1446,7 @@ void opf_OPFClustering(Subgraph *sg)
 
   sg->nlabels = l;
 
-  DestroyRealHeap(&Q);
+  opf_DestroyPathQueue(&Q);
   free(pathval);
 }
 
@@ -711,61 +1455,31 @@ void opf_OPFClustering(Subgraph *sg)
 
 Set *opf_OPFClustering4ANN(Subgraph *sg)
 {
-  Set *adj_i, *adj_j, *prototypes = NULL;
-  char insert_i;
-  int i, j;
+  Set *prototypes = NULL;
+  int i, a;
   int p, q, l;
   float tmp, *pathval = NULL;
-  RealHeap *Q = NULL;
-  Set *Saux = NULL;
+  opf_PathQueue *Q = NULL;
 
   //   Add arcs to guarantee symmetry on plateaus
-  for (i = 0; i < sg->nnodes; i++)
-  {
-    adj_i = sg->node[i].adj;
-    while (adj_i != NULL)
-    {
-      j = adj_i->elem;
-      if (sg->node[i].dens == sg->node[j].dens)
-      {
-        // insert i in the adjacency of j if it is not there.
-        adj_j = sg->node[j].adj;
-        insert_i = 1;
-        while (adj_j != NULL)
-        {
-          if (i == adj_j->elem)
-          {
-            insert_i = 0;
-            break;
-          }
-          adj_j = adj_j->next;
-        }
-        if (insert_i)
-          InsertSet(&(sg->node[j].adj), i);
-      }
-      adj_i = adj_i->next;
-    }
-  }
+  opf_SymmetrizePlateaus(sg);
 
   // Compute clustering
 
   pathval = AllocFloatArray(sg->nnodes);
-  Q = CreateRealHeap(sg->nnodes, pathval);
-  SetRemovalPolicyRealHeap(Q, MAXVALUE);
-
   for (p = 0; p < sg->nnodes; p++)
   {
     pathval[p] = sg->node[p].pathval;
     sg->node[p].pred = NIL;
     sg->node[p].root = p;
-    InsertRealHeap(Q, p);
   }
+  Q = opf_CreatePathQueue(sg, pathval);
 
   l = 0;
   i = 0;
-  while (!IsEmptyRealHeap(Q))
+  while (!opf_IsEmptyPathQueue(Q))
   {
-    RemoveRealHeap(Q, &p);
+    p = opf_RemovePathQueue(Q);
     sg->ordered_list_of_nodes[i] = p;
     i++;
 
@@ -778,15 +1492,15 @@ Set *opf_OPFClustering4ANN(Subgraph *sg)
     }
 
     sg->node[p].pathval = pathval[p];
-    for (Saux = sg->node[p].adj; Saux != NULL; Saux = Saux->next)
+    for (a = sg->arcoffset[p]; a < sg->arcoffset[p + 1]; a++)
     {
-      q = Saux->elem;
-      if (Q->color[q] != BLACK)
+      q = sg->arcnode[a];
+      if (!opf_IsRemovedPathQueue(Q, q))
       {
         tmp = MIN(pathval[p], sg->node[q].dens);
         if (tmp > pathval[q])
         {
-          UpdateRealHeap(Q, q, tmp);
+          opf_UpdatePathQueue(Q, q, tmp);
           sg->node[q].pred = p;
           sg->node[q].root = sg->node[p].root;
           sg->node[q].label = sg->node[p].label;
@@ -797,7 +1511,7 @@ Set *opf_OPFClustering4ANN(Subgraph *sg)
 
   sg->nlabels = l;
 
-  DestroyRealHeap(&Q);
+  opf_DestroyPathQueue(&Q);
   free(pathval);
 
   return prototypes;
@@ -844,7 +1558,7 @@ void opf_SwapErrorsbyNonPrototypes(Subgraph **sgtrain, Subgraph **sgeval)
         j = RandomInteger(0, (*sgtrain)->nnodes - 1);
         if ((*sgtrain)->node[j].pred != NIL)
         {
-          SwapSNode(&((*sgtrain)->node[j]), &((*sgeval)->node[i]));
+          ExchangeSNode(&((*sgtrain)->node[j]), &((*sgeval)->node[i]), (*sgtrain)->nfeats);
           (*sgtrain)->node[j].pred = NIL;
           nonprototypes--;
           nerrors--;
@@ -883,7 +1597,7 @@ void opf_RemoveIrrelevantNodes(Subgraph **sg)
   if (num_of_irrelevants > 0)
   {
     newsg = CreateSubgraph((*sg)->nnodes - num_of_irrelevants);
-    newsg->nfeats = (*sg)->nfeats;
+    AllocSubgraphFeats(newsg, (*sg)->nfeats);
     //    for (i=0; i < newsg->nnodes; i++)
     //      newsg->node[i].feat = AllocFloatArray(newsg->nfeats);
 
@@ -920,8 +1634,8 @@ void opf_MoveIrrelevantNodes(Subgraph **src, Subgraph **dst)
     newsrc = CreateSubgraph((*src)->nnodes - num_of_irrelevants);
     newdst = CreateSubgraph((*dst)->nnodes + num_of_irrelevants);
 
-    newsrc->nfeats = (*src)->nfeats;
-    newdst->nfeats = (*dst)->nfeats;
+    AllocSubgraphFeats(newsrc, (*src)->nfeats);
+    AllocSubgraphFeats(newdst, (*dst)->nfeats);
     newsrc->nlabels = (*src)->nlabels;
     newdst->nlabels = (*dst)->nlabels;
 
@@ -968,8 +1682,8 @@ void opf_MoveMisclassifiedNodes(Subgraph **src, Subgraph **dst, int *p)
     newsrc = CreateSubgraph((*src)->nnodes - num_of_misclassified);
     newdst = CreateSubgraph((*dst)->nnodes + num_of_misclassified);
 
-    newsrc->nfeats = (*src)->nfeats;
-    newdst->nfeats = (*dst)->nfeats;
+    AllocSubgraphFeats(newsrc, (*src)->nfeats);
+    AllocSubgraphFeats(newdst, (*dst)->nfeats);
     newsrc->nlabels = (*src)->nlabels;
     newdst->nlabels = (*dst)->nlabels;
 
@@ -1030,6 +1744,26 @@ void opf_WriteModelFile(Subgraph *g, char *file)
   for (i = 0; i < g->nnodes; i++)
     fwrite(&g->ordered_list_of_nodes[i], sizeof(int), 1, fp);
 
+  /* optional pivot index, after the fields read by older versions */
+  if (g->npivots > 0)
+  {
+    j = opf_PIVOT_MAGIC;
+    fwrite(&j, sizeof(int), 1, fp);
+    fwrite(&g->npivots, sizeof(int), 1, fp);
+    fwrite(&g->pivotmetric, sizeof(int), 1, fp);
+    fwrite(g->pivot, sizeof(int), g->npivots, fp);
+    fwrite(g->pivotdist, sizeof(float), (size_t)g->nnodes * g->npivots, fp);
+  }
+
+  /* optional knn index */
+  if (g->knnindex != NULL)
+  {
+    j = opf_KNNINDEX_MAGIC;
+    fwrite(&j, sizeof(int), 1, fp);
+    fwrite(&g->knnmetric, sizeof(int), 1, fp);
+    WriteKnnIndex(g->knnindex, fp);
+  }
+
   fclose(fp);
 }
 
@@ -1038,8 +1772,10 @@ Subgraph *opf_ReadModelFile(char *file)
 {
   Subgraph *g = NULL;
   FILE *fp = NULL;
-  int nnodes, i, j;
+  int nnodes, nfeats, i, magic;
   char msg[256];
+  KnnBoundFun bound;
+  KnnMetricFun fun;
 
   if ((fp = fopen(file, "rb")) == NULL)
   {
@@ -1047,6 +1783,14 @@ Subgraph *opf_ReadModelFile(char *file)
     Error(msg, "ReadSubGraph");
   }
 
+  /* models in the mapped format start with its magic */
+  if ((fread(msg, 1, 4, fp) == 4) && (memcmp(msg, opf_MAPPED_MAGIC, 4) == 0))
+  {
+    fclose(fp);
+    return opf_ReadMappedModelFile(file);
+  }
+  rewind(fp);
+
   /*reading # of nodes, classes and feats*/
   if (fread(&nnodes, sizeof(int), 1, fp) != 1)
     Error("Could not read number of nodes", "opf_ReadModelFile");
@@ -1054,8 +1798,9 @@ Subgraph *opf_ReadModelFile(char *file)
   g = CreateSubgraph(nnodes);
   if (fread(&g->nlabels, sizeof(int), 1, fp) != 1)
     Error("Could not read number of labels", "opf_ReadModelFile");
-  if (fread(&g->nfeats, sizeof(int), 1, fp) != 1)
+  if (fread(&nfeats, sizeof(int), 1, fp) != 1)
     Error("Could not read number of features", "opf_ReadModelFile");
+  AllocSubgraphFeats(g, nfeats);
 
   /* for supervised opf by pdf */
   if (fread(&g->df, sizeof(float), 1, fp) != 1)
@@ -1072,7 +1817,6 @@ Subgraph *opf_ReadModelFile(char *file)
   /* reading nodes' information */
   for (i = 0; i < g->nnodes; i++)
   {
-    g->node[i].feat = (float *)malloc(g->nfeats * sizeof(float));
     if (fread(&g->node[i].position, sizeof(int), 1, fp) != 1)
       Error("Could not read node position", "opf_ReadModelFile");
     if (fread(&g->node[i].truelabel, sizeof(int), 1, fp) != 1)
@@ -1088,17 +1832,291 @@ Subgraph *opf_ReadModelFile(char *file)
     if (fread(&g->node[i].dens, sizeof(float), 1, fp) != 1)
       Error("Could not read node density value", "opf_ReadModelFile");
 
-    for (j = 0; j < g->nfeats; j++)
-      if (fread(&g->node[i].feat[j], sizeof(float), 1, fp) != 1)
-        Error("Could not read node features", "opf_ReadModelFile");
+    if (fread(g->node[i].feat, sizeof(float), g->nfeats, fp) != g->nfeats)
+      Error("Could not read node features", "opf_ReadModelFile");
   }
 
   for (i = 0; i < g->nnodes; i++)
     if (fread(&g->ordered_list_of_nodes[i], sizeof(int), 1, fp) != 1)
       Error("Could not read ordered list of nodes", "opf_ReadModelFile");
 
+  /* optional pivot index and knn index */
+  while ((fread(&magic, sizeof(int), 1, fp) == 1) && ((magic == opf_PIVOT_MAGIC) || (magic == opf_KNNINDEX_MAGIC)))
+  {
+    if (magic == opf_KNNINDEX_MAGIC)
+    {
+      if ((fread(&g->knnmetric, sizeof(int), 1, fp) != 1) || (g->knnmetric < opf_PIVOT_EUCLLOG) ||
+          (g->knnmetric > opf_PIVOT_MANHATTAN))
+        Error("Could not read metric of the knn index", "opf_ReadModelFile");
+      opf_KnnMetricFuns(g->knnmetric, &bound, &fun);
+      DestroyKnnIndex(&g->knnindex);
+      g->knnindex = ReadKnnIndex(g, fp, fun);
+      continue;
+    }
+    if ((fread(&g->npivots, sizeof(int), 1, fp) != 1) || (g->npivots <= 0) || (g->npivots > g->nnodes))
+      Error("Could not read number of pivots", "opf_ReadModelFile");
+    if (fread(&g->pivotmetric, sizeof(int), 1, fp) != 1)
+      Error("Could not read pivot metric", "opf_ReadModelFile");
+    g->pivot = AllocIntArray(g->npivots);
+    g->pivotdist = AllocFloatArray(g->nnodes * g->npivots);
+    if (fread(g->pivot, sizeof(int), g->npivots, fp) != g->npivots)
+      Error("Could not read pivots", "opf_ReadModelFile");
+    if (fread(g->pivotdist, sizeof(float), (size_t)g->nnodes * g->npivots, fp) != (size_t)g->nnodes * g->npivots)
+      Error("Could not read pivot distances", "opf_ReadModelFile");
+  }
+
+  fclose(fp);
+
+  return g;
+}
+
+/*--------- Mapped model files -------------------------------------*/
+/* A mapped model file is made of a header and of sections aligned to
+   SG_ALIGNMENT bytes: one array per node field, the ordered list, the
+   pivot index and the feature matrix, whose rows are padded to
+   featstride floats as in memory. opf_ReadMappedModelFile maps the
+   file and points the feature vectors to the mapped matrix, so
+   features are neither read nor allocated, and pages are loaded only
+   when the classification touches them. The mapping is private, so
+   changing the features in memory does not change the file. */
+enum
+{
+  opf_SEC_POSITION,
+  opf_SEC_TRUELABEL,
+  opf_SEC_PRED,
+  opf_SEC_LABEL,
+  opf_SEC_PATHVAL,
+  opf_SEC_RADIUS,
+  opf_SEC_DENS,
+  opf_SEC_ORDERED,
+  opf_SEC_PIVOT,
+  opf_SEC_PIVOTDIST,
+  opf_SEC_FEATS,
+  opf_NSECTIONS
+};
+
+typedef struct _opfmappedheader {
+  char magic[4];  //opf_MAPPED_MAGIC
+  int version;    //opf_MAPPED_VERSION
+  int byteorder;  //0x01020304 as written by the machine that created the file
+  int nnodes, nlabels, nfeats, featstride;
+  int bestk;
+  float df, K, mindens, maxdens;
+  int npivots, pivotmetric;
+  int reserved;                    //zero, it aligns the offsets
+  long long offset[opf_NSECTIONS]; //offset in bytes of each section
+} opf_MappedHeader;
+
+#define opf_MAPPED_VERSION 1
+#define opf_MappedAlign(x) ((((x) + SG_ALIGNMENT - 1) / SG_ALIGNMENT) * SG_ALIGNMENT)
+
+// It writes size bytes of data at offset, filling the gap from the current position with zeros
+static void opf_WriteMappedSection(FILE *fp, long long offset, void *data, size_t size)
+{
+  static const char zeros[SG_ALIGNMENT] = {0};
+  long long pos = ftell(fp);
+
+  if (pos > offset)
+    Error("Sections out of order", "opf_WriteMappedModelFile");
+  fwrite(zeros, 1, offset - pos, fp);
+  if (size > 0)
+    fwrite(data, 1, size, fp);
+}
+
+//write model file in the mapped format
+void opf_WriteMappedModelFile(Subgraph *g, char *file)
+{
+  opf_MappedHeader h;
+  FILE *fp = NULL;
+  size_t n = g->nnodes, size[opf_NSECTIONS];
+  void *data[opf_NSECTIONS];
+  float *feats = NULL, *pathval = NULL, *radius = NULL, *dens = NULL;
+  int *position = NULL, *truelabel = NULL, *pred = NULL, *label = NULL;
+  int i, k;
+  long long offset;
+  char msg[256];
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, opf_MAPPED_MAGIC, 4);
+  h.version = opf_MAPPED_VERSION;
+  h.byteorder = 0x01020304;
+  h.nnodes = g->nnodes;
+  h.nlabels = g->nlabels;
+  h.nfeats = g->nfeats;
+  h.featstride = SgFeatStride(g->nfeats);
+  h.bestk = g->bestk;
+  h.df = g->df;
+  h.K = g->K;
+  h.mindens = g->mindens;
+  h.maxdens = g->maxdens;
+  h.npivots = g->npivots;
+  h.pivotmetric = g->pivotmetric;
+
+  position = AllocIntArray(n);
+  truelabel = AllocIntArray(n);
+  pred = AllocIntArray(n);
+  label = AllocIntArray(n);
+  pathval = AllocFloatArray(n);
+  radius = AllocFloatArray(n);
+  dens = AllocFloatArray(n);
+  for (i = 0; i < g->nnodes; i++)
+  {
+    position[i] = g->node[i].position;
+    truelabel[i] = g->node[i].truelabel;
+    pred[i] = g->node[i].pred;
+    label[i] = g->node[i].label;
+    pathval[i] = g->node[i].pathval;
+    radius[i] = g->node[i].radius;
+    dens[i] = g->node[i].dens;
+  }
+
+  /* the feature matrix is written as it is in memory when the subgraph has one */
+  if ((g->featmatrix != NULL) && (g->featstride == h.featstride))
+    feats = g->featmatrix;
+  else
+  {
+    feats = AllocFloatArray(n * h.featstride);
+    for (i = 0; i < g->nnodes; i++)
+      memcpy(&feats[(size_t)i * h.featstride], g->node[i].feat, g->nfeats * sizeof(float));
+  }
+
+  data[opf_SEC_POSITION] = position, size[opf_SEC_POSITION] = n * sizeof(int);
+  data[opf_SEC_TRUELABEL] = truelabel, size[opf_SEC_TRUELABEL] = n * sizeof(int);
+  data[opf_SEC_PRED] = pred, size[opf_SEC_PRED] = n * sizeof(int);
+  data[opf_SEC_LABEL] = label, size[opf_SEC_LABEL] = n * sizeof(int);
+  data[opf_SEC_PATHVAL] = pathval, size[opf_SEC_PATHVAL] = n * sizeof(float);
+  data[opf_SEC_RADIUS] = radius, size[opf_SEC_RADIUS] = n * sizeof(float);
+  data[opf_SEC_DENS] = dens, size[opf_SEC_DENS] = n * sizeof(float);
+  data[opf_SEC_ORDERED] = g->ordered_list_of_nodes, size[opf_SEC_ORDERED] = n * sizeof(int);
+  data[opf_SEC_PIVOT] = g->pivot, size[opf_SEC_PIVOT] = g->npivots * sizeof(int);
+  data[opf_SEC_PIVOTDIST] = g->pivotdist, size[opf_SEC_PIVOTDIST] = n * g->npivots * sizeof(float);
+  data[opf_SEC_FEATS] = feats, size[opf_SEC_FEATS] = n * h.featstride * sizeof(float);
+
+  offset = opf_MappedAlign((long long)sizeof(h));
+  for (k = 0; k < opf_NSECTIONS; k++)
+  {
+    h.offset[k] = offset;
+    offset = opf_MappedAlign(offset + (long long)size[k]);
+  }
+
+  if ((fp = fopen(file, "wb")) == NULL)
+  {
+    sprintf(msg, "%s%s", "Unable to open file ", file);
+    Error(msg, "opf_WriteMappedModelFile");
+  }
+  fwrite(&h, sizeof(h), 1, fp);
+  for (k = 0; k < opf_NSECTIONS; k++)
+    opf_WriteMappedSection(fp, h.offset[k], data[k], size[k]);
   fclose(fp);
 
+  if (feats != g->featmatrix)
+    free(feats);
+  free(position);
+  free(truelabel);
+  free(pred);
+  free(label);
+  free(pathval);
+  free(radius);
+  free(dens);
+}
+
+//read model file in the mapped format, mapping its feature matrix into memory
+Subgraph *opf_ReadMappedModelFile(char *file)
+{
+  Subgraph *g = NULL;
+  opf_MappedHeader *h = NULL;
+  struct stat st;
+  char *base = NULL, msg[256];
+  int fd, i, k;
+  int *position, *truelabel, *pred, *label;
+  float *pathval, *radius, *dens;
+  long long n, need[opf_NSECTIONS];
+
+  if ((fd = open(file, O_RDONLY)) < 0)
+  {
+    sprintf(msg, "%s%s", "Unable to open file ", file);
+    Error(msg, "opf_ReadMappedModelFile");
+  }
+  if ((fstat(fd, &st) != 0) || (st.st_size < (off_t)sizeof(opf_MappedHeader)))
+    Error("Could not read header", "opf_ReadMappedModelFile");
+  base = (char *)mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED)
+    Error("Could not map the model file", "opf_ReadMappedModelFile");
+
+  /* checking the header */
+  h = (opf_MappedHeader *)base;
+  if (memcmp(h->magic, opf_MAPPED_MAGIC, 4) != 0)
+    Error("Not a mapped model file", "opf_ReadMappedModelFile");
+  if (h->byteorder != 0x01020304)
+    Error("The model file was written with another byte order", "opf_ReadMappedModelFile");
+  if (h->version != opf_MAPPED_VERSION)
+    Error("Unsupported version of the mapped model format", "opf_ReadMappedModelFile");
+  if ((h->nnodes < 0) || (h->nfeats < 0) || (h->featstride < h->nfeats) ||
+      (h->npivots < 0) || (h->npivots > h->nnodes))
+    Error("Invalid header", "opf_ReadMappedModelFile");
+
+  n = h->nnodes;
+  for (k = opf_SEC_POSITION; k <= opf_SEC_ORDERED; k++)
+    need[k] = n * 4;
+  need[opf_SEC_PIVOT] = (long long)h->npivots * sizeof(int);
+  need[opf_SEC_PIVOTDIST] = n * h->npivots * sizeof(float);
+  need[opf_SEC_FEATS] = n * h->featstride * sizeof(float);
+  for (k = 0; k < opf_NSECTIONS; k++)
+    if ((h->offset[k] % SG_ALIGNMENT != 0) || (h->offset[k] < (long long)sizeof(opf_MappedHeader)) ||
+        (h->offset[k] + need[k] > (long long)st.st_size))
+      Error("Truncated or corrupted model file", "opf_ReadMappedModelFile");
+
+  g = CreateSubgraph(h->nnodes);
+  g->nlabels = h->nlabels;
+  g->nfeats = h->nfeats;
+  g->featstride = h->featstride;
+  g->bestk = h->bestk;
+  g->df = h->df;
+  g->K = h->K;
+  g->mindens = h->mindens;
+  g->maxdens = h->maxdens;
+
+  position = (int *)(base + h->offset[opf_SEC_POSITION]);
+  truelabel = (int *)(base + h->offset[opf_SEC_TRUELABEL]);
+  pred = (int *)(base + h->offset[opf_SEC_PRED]);
+  label = (int *)(base + h->offset[opf_SEC_LABEL]);
+  pathval = (float *)(base + h->offset[opf_SEC_PATHVAL]);
+  radius = (float *)(base + h->offset[opf_SEC_RADIUS]);
+  dens = (float *)(base + h->offset[opf_SEC_DENS]);
+  g->featmatrix = (float *)(base + h->offset[opf_SEC_FEATS]);
+  g->mapping = base;
+  g->mappingsize = st.st_size;
+
+  for (i = 0; i < g->nnodes; i++)
+  {
+    g->node[i].position = position[i];
+    g->node[i].truelabel = truelabel[i];
+    g->node[i].pred = pred[i];
+    g->node[i].label = label[i];
+    g->node[i].pathval = pathval[i];
+    g->node[i].radius = radius[i];
+    g->node[i].dens = dens[i];
+    g->node[i].feat = SgFeatRow(g, i);
+  }
+  memcpy(g->ordered_list_of_nodes, base + h->offset[opf_SEC_ORDERED], n * sizeof(int));
+  for (i = 0; i < g->nnodes; i++)
+    if ((g->ordered_list_of_nodes[i] < 0) || (g->ordered_list_of_nodes[i] >= g->nnodes))
+      Error("Invalid ordered list of nodes", "opf_ReadMappedModelFile");
+
+  if (h->npivots > 0)
+  {
+    g->npivots = h->npivots;
+    g->pivotmetric = h->pivotmetric;
+    g->pivot = AllocIntArray(g->npivots);
+    g->pivotdist = AllocFloatArray(n * g->npivots);
+    memcpy(g->pivot, base + h->offset[opf_SEC_PIVOT], g->npivots * sizeof(int));
+    memcpy(g->pivotdist, base + h->offset[opf_SEC_PIVOTDIST], n * g->npivots * sizeof(float));
+    for (i = 0; i < g->npivots; i++)
+      if ((g->pivot[i] < 0) || (g->pivot[i] >= g->nnodes))
+        Error("Invalid pivots", "opf_ReadMappedModelFile");
+  }
+
   return g;
 }
 
@@ -1131,17 +2149,23 @@ void opf_NormalizeFeatures(Subgraph *sg)
 
 // Find prototypes by the MST approach
 void opf_MSTPrototypes(Subgraph *sg)
+{
+  opf_MSTPrototypesBuffered(sg, NULL);
+}
+
+// Find prototypes by the MST approach, storing the computed distances in B (if not NULL)
+static void opf_MSTPrototypesBuffered(Subgraph *sg, opf_PairBuffer *B)
 {
   int p, q;
-  float weight;
-  RealHeap *Q = NULL;
+  float weight, *entry;
   float *pathval = NULL;
+  char *done = NULL;
   int pred;
   float nproto;
 
   // initialization
   pathval = AllocFloatArray(sg->nnodes);
-  Q = CreateRealHeap(sg->nnodes, pathval);
+  done = (char *)calloc(sg->nnodes, sizeof(char));
 
   for (p = 0; p < sg->nnodes; p++)
   {
@@ -1151,14 +2175,13 @@ void opf_MSTPrototypes(Subgraph *sg)
 
   pathval[0] = 0;
   sg->node[0].pred = NIL;
-  InsertRealHeap(Q, 0);
 
   nproto = 0.0;
 
   // Prim's algorithm for Minimum Spanning Tree
-  while (!IsEmptyRealHeap(Q))
+  while ((p = opf_DenseArgMin(pathval, done, sg->nnodes)) != NIL)
   {
-    RemoveRealHeap(Q, &p);
+    done[p] = 1;
     sg->node[p].pathval = pathval[p];
 
     pred = sg->node[p].pred;
@@ -1177,27 +2200,24 @@ void opf_MSTPrototypes(Subgraph *sg)
         }
       }
 
+#pragma omp parallel for if (opf_NumThreads > 1) num_threads(opf_NumThreads) private(weight, entry) schedule(static)
     for (q = 0; q < sg->nnodes; q++)
     {
-      if (Q->color[q] != BLACK)
+      if (!done[q])
       {
-        if (p != q)
+        weight = opf_NodeDistance(&sg->node[p], &sg->node[q], sg->nfeats);
+        if ((entry = opf_PairBufferEntry(B, p, q)) != NULL)
+          *entry = weight;
+        if (weight < pathval[q])
         {
-          if (!opf_PrecomputedDistance)
-            weight = opf_ArcWeight(sg->node[p].feat, sg->node[q].feat, sg->nfeats);
-          else
-            weight = opf_DistanceValue[sg->node[p].position][sg->node[q].position];
-          if (weight < pathval[q])
-          {
-            sg->node[q].pred = p;
-            UpdateRealHeap(Q, q, weight);
-          }
+          sg->node[q].pred = p;
+          pathval[q] = weight;
         }
       }
     }
   }
-  DestroyRealHeap(&Q);
   free(pathval);
+  free(done);
 }
 
 //It creates k folds for cross validation
@@ -1238,10 +2258,8 @@ Subgraph **kFoldSubgraph(Subgraph *sg, int k)
   for (i = 0; i < k - 1; i++)
   {
     out[i] = CreateSubgraph(foldsize);
-    out[i]->nfeats = sg->nfeats;
+    AllocSubgraphFeats(out[i], sg->nfeats);
     out[i]->nlabels = sg->nlabels;
-    for (j = 0; j < foldsize; j++)
-      out[i]->node[j].feat = (float *)malloc(sg->nfeats * sizeof(float));
   }
 
   totelems = 0;
@@ -1249,12 +2267,9 @@ Subgraph **kFoldSubgraph(Subgraph *sg, int k)
     totelems += resto[j];
 
   out[i] = CreateSubgraph(foldsize + totelems);
-  out[i]->nfeats = sg->nfeats;
+  AllocSubgraphFeats(out[i], sg->nfeats);
   out[i]->nlabels = sg->nlabels;
 
-  for (j = 0; j < foldsize + totelems; j++)
-    out[i]->node[j].feat = (float *)malloc(sg->nfeats * sizeof(float));
-
   for (i = 0; i < k; i++)
   {
     totelems = 0;
@@ -1345,10 +2360,8 @@ Subgraph **opf_kFoldSubgraph(Subgraph *sg, int k)
   for (i = 0; i < k - 1; i++)
   {
     out[i] = CreateSubgraph(foldsize);
-    out[i]->nfeats = sg->nfeats;
+    AllocSubgraphFeats(out[i], sg->nfeats);
     out[i]->nlabels = sg->nlabels;
-    for (j = 0; j < foldsize; j++)
-      out[i]->node[j].feat = (float *)malloc(sg->nfeats * sizeof(float));
   }
 
   totelems = 0;
@@ -1356,12 +2369,9 @@ Subgraph **opf_kFoldSubgraph(Subgraph *sg, int k)
     totelems += resto[j];
 
   out[i] = CreateSubgraph(foldsize + totelems);
-  out[i]->nfeats = sg->nfeats;
+  AllocSubgraphFeats(out[i], sg->nfeats);
   out[i]->nlabels = sg->nlabels;
 
-  for (j = 0; j < foldsize + totelems; j++)
-    out[i]->node[j].feat = (float *)malloc(sg->nfeats * sizeof(float));
-
   for (i = 0; i < k; i++)
   {
     totelems = 0;
@@ -1452,13 +2462,8 @@ void opf_SplitSubgraph(Subgraph *sg, Subgraph **sg1, Subgraph **sg2, float perc1
 
   *sg1 = CreateSubgraph(totelems);
   *sg2 = CreateSubgraph(sg->nnodes - totelems);
-  (*sg1)->nfeats = sg->nfeats;
-  (*sg2)->nfeats = sg->nfeats;
-
-  for (i1 = 0; i1 < (*sg1)->nnodes; i1++)
-    (*sg1)->node[i1].feat = AllocFloatArray((*sg1)->nfeats);
-  for (i2 = 0; i2 < (*sg2)->nnodes; i2++)
-    (*sg2)->node[i2].feat = AllocFloatArray((*sg2)->nfeats);
+  AllocSubgraphFeats(*sg1, sg->nfeats);
+  AllocSubgraphFeats(*sg2, sg->nfeats);
 
   (*sg1)->nlabels = sg->nlabels;
   (*sg2)->nlabels = sg->nlabels;
@@ -1512,7 +2517,7 @@ Subgraph *opf_MergeSubgraph(Subgraph *sg1, Subgraph *sg2)
     out->nlabels = sg1->nlabels;
   else
     out->nlabels = sg2->nlabels;
-  out->nfeats = sg1->nfeats;
+  AllocSubgraphFeats(out, sg1->nfeats);
 
   for (i = 0; i < sg1->nnodes; i++)
     CopySNode(&out->node[i], &sg1->node[i], out->nfeats);
@@ -1647,75 +2652,373 @@ float *opf_Accuracy4Label(Subgraph *sg)
       error[i] /= (float)nclass[i];
   }
 
-  Acc = (float *)calloc(sg->nlabels + 1, sizeof(float));
+  Acc = (float *)calloc(sg->nlabels + 1, sizeof(float));
+
+  for (i = 1; i <= sg->nlabels; i++)
+  {
+    if (nclass[i] != 0)
+      Acc[i] = 1 - error[i];
+  }
+
+  free(error);
+  free(nclass);
+
+  return Acc;
+}
+
+// Compute the confusion matrix
+int **opf_ConfusionMatrix(Subgraph *sg)
+{
+  int **opf_ConfusionMatrix = NULL, i;
+
+  opf_ConfusionMatrix = (int **)calloc((sg->nlabels + 1), sizeof(int *));
+  for (i = 1; i <= sg->nlabels; i++)
+    opf_ConfusionMatrix[i] = (int *)calloc((sg->nlabels + 1), sizeof(int));
+
+  for (i = 0; i < sg->nnodes; i++)
+    opf_ConfusionMatrix[sg->node[i].truelabel][sg->node[i].label]++;
+
+  return opf_ConfusionMatrix;
+}
+
+// It returns the size in bytes of a distance of type (opf_DIST_*)
+static size_t opf_DistanceTypeSize(int type)
+{
+  switch (type)
+  {
+  case opf_DIST_FLOAT16:
+  case opf_DIST_UINT16:
+    return 2;
+  case opf_DIST_UINT8:
+    return 1;
+  default:
+    return sizeof(float);
+  }
+}
+
+/* It returns the rows of the n x n distance matrix stored at M0, with
+   distances of size bytes, either in full or as its upper triangle. The
+   rows of the upper triangle are offset so that element j of row i is
+   the distance (i,j) for i <= j */
+static void **opf_DistanceRows(char *M0, int n, size_t size, char triangular)
+{
+  void **M = (void **)malloc(MAX(n, 1) * sizeof(void *));
+  int i;
+
+  if (M == NULL)
+    Error(MSG1, "opf_DistanceRows");
+  M[0] = M0;
+  for (i = 1; i < n; i++)
+  {
+    if (triangular) // row i starts after the rows of length n, n-1, ..., n-i+1
+      M[i] = M0 + ((size_t)i * n - (size_t)i * (i - 1) / 2 - i) * size;
+    else
+      M[i] = M0 + (size_t)i * n * size;
+  }
+
+  return M;
+}
+
+/* read distances from precomputed distances file, either the full
+   matrix of floats (a file without header) or a file with header. The
+   file is mapped read-only and shared, so that its pages are loaded on
+   demand and shared by the processes that read the same file, and the
+   rows point into the mapping (see opf_DistanceRows).
+   opf_DistanceTriangular, opf_DistanceType and opf_DistanceScale
+   describe the rows, which opf_Distance reads */
+void **opf_ReadDistances(char *fileName, int *n)
+{
+  int nsamples, fd;
+  struct stat st;
+  char *base = NULL, msg[256];
+  opf_DistancesHeader h;
+  size_t headersize = sizeof(int), size;
+
+  if ((fd = open(fileName, O_RDONLY)) < 0)
+  {
+    sprintf(msg, "%s%s", "Unable to open file ", fileName);
+    Error(msg, "opf_ReadDistances");
+  }
+
+  memset(&h, 0, sizeof(h));
+  if ((fstat(fd, &st) != 0) || (st.st_size < (off_t)sizeof(int)) ||
+      (read(fd, &h, MIN(sizeof(h), (size_t)st.st_size)) < (ssize_t)sizeof(int)))
+    Error("Could not read number of samples", "opf_ReadDistances");
+  if (memcmp(h.magic, opf_DISTANCES_MAGIC, 4) == 0)
+  {
+    if (st.st_size < (off_t)sizeof(h))
+      Error("Could not read header", "opf_ReadDistances");
+    if (h.byteorder != 0x01020304)
+      Error("The distances file was written with another byte order", "opf_ReadDistances");
+    if ((h.version < 1) || (h.version > opf_DISTANCES_VERSION) || (h.flags & ~opf_DIST_TRIANGULAR) ||
+        (h.type < opf_DIST_FLOAT32) || (h.type > opf_DIST_UINT8))
+      Error("Unsupported version of the distances file format", "opf_ReadDistances");
+    nsamples = h.nsamples;
+    opf_DistanceTriangular = (h.flags & opf_DIST_TRIANGULAR) ? 1 : 0;
+    opf_DistanceType = h.type;
+    opf_DistanceScale = (h.version == 1) ? 1.0 : h.scale;
+    headersize = sizeof(h);
+  }
+  else
+  {
+    memcpy(&nsamples, &h, sizeof(int));
+    opf_DistanceTriangular = 0;
+    opf_DistanceType = opf_DIST_FLOAT32;
+    opf_DistanceScale = 1.0;
+  }
+  if (nsamples < 0)
+    Error("Could not read number of samples", "opf_ReadDistances");
+
+  size = headersize + (opf_DistanceTriangular ? (size_t)nsamples * (nsamples + 1) / 2 : (size_t)nsamples * nsamples) *
+                          opf_DistanceTypeSize(opf_DistanceType);
+  if ((size_t)st.st_size < size)
+    Error("Could not read samples", "opf_ReadDistances");
+
+  base = (char *)mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED)
+    Error("Could not map the distances file", "opf_ReadDistances");
+  opf_DistanceMapping = base;
+  opf_DistanceMappingSize = size;
+
+  *n = nsamples;
+
+  return opf_DistanceRows(base + headersize, nsamples, opf_DistanceTypeSize(opf_DistanceType), opf_DistanceTriangular);
+}
+
+/* create a distances file of n samples that holds the upper triangle of
+   the matrix, with distances of type (opf_DIST_*) and scale, mapped for
+   writing, and return its rows as opf_ReadDistances. The file is
+   complete once opf_DestroyDistances unmaps it */
+void **opf_CreateDistances(char *fileName, int n, int type, float scale)
+{
+  opf_DistancesHeader h;
+  size_t size = sizeof(h) + (size_t)n * (n + 1) / 2 * opf_DistanceTypeSize(type);
+  char *base = NULL, msg[256];
+  int fd;
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, opf_DISTANCES_MAGIC, 4);
+  h.byteorder = 0x01020304;
+  h.version = opf_DISTANCES_VERSION;
+  h.nsamples = n;
+  h.flags = opf_DIST_TRIANGULAR;
+  h.type = type;
+  h.scale = scale;
+
+  if ((fd = open(fileName, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0)
+  {
+    sprintf(msg, "%s%s", "Unable to create file ", fileName);
+    Error(msg, "opf_CreateDistances");
+  }
+  if ((write(fd, &h, sizeof(h)) != sizeof(h)) || (ftruncate(fd, size) != 0))
+    Error("Could not write the distances file", "opf_CreateDistances");
+  base = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED)
+    Error("Could not map the distances file", "opf_CreateDistances");
+  opf_DistanceMapping = base;
+  opf_DistanceMappingSize = size;
+  opf_DistanceTriangular = 1;
+  opf_DistanceType = type;
+  opf_DistanceScale = scale;
+
+  return opf_DistanceRows(base + sizeof(h), n, opf_DistanceTypeSize(type), 1);
+}
+
+/* change the type and scale of the float32 distances file of
+   opf_CreateDistances, whose distances were converted in place to type,
+   from the start of the triangle and in its order, and cut the file to
+   its new size. *M is replaced by the rows of the new type */
+void opf_RetypeDistances(char *fileName, void ***M, int n, int type, float scale)
+{
+  opf_DistancesHeader *h = (opf_DistancesHeader *)opf_DistanceMapping;
+  size_t size = sizeof(*h) + (size_t)n * (n + 1) / 2 * opf_DistanceTypeSize(type);
+
+  h->type = type;
+  h->scale = scale;
+  if (truncate(fileName, size) != 0) // the mapping keeps its size until it is unmapped
+    Error("Could not cut the distances file", "opf_RetypeDistances");
+  opf_DistanceType = type;
+  opf_DistanceScale = scale;
+  free(*M);
+  *M = opf_DistanceRows((char *)opf_DistanceMapping + sizeof(*h), n, opf_DistanceTypeSize(type), 1);
+}
+
+//unmap the distances of opf_ReadDistances or opf_CreateDistances
+void opf_DestroyDistances(void ***M, int n)
+{
+  if (*M != NULL)
+  {
+    munmap(opf_DistanceMapping, opf_DistanceMappingSize);
+    opf_DistanceMapping = NULL;
+    opf_DistanceMappingSize = 0;
+    free(*M);
+    *M = NULL;
+  }
+}
+
+/* The distance is computed from the node of lower position to the
+   other, so that it does not depend on which pair was looked up first */
+float opf_CachedDistance(SNode *a, SNode *b, int nfeats)
+{
+  float d;
+
+  if (!DistCacheGet(opf_DistanceCache, a->position, b->position, &d))
+  {
+    if (a->position <= b->position)
+      d = opf_ArcWeight(a->feat, b->feat, nfeats);
+    else
+      d = opf_ArcWeight(b->feat, a->feat, nfeats);
+    DistCachePut(opf_DistanceCache, a->position, b->position, d);
+  }
+
+  return d;
+}
 
-  for (i = 1; i <= sg->nlabels; i++)
+// It reads and removes the option "<option> <value>" from the command line, returning its value or NULL
+static char *opf_ReadOption(int *argc, char **argv, char *option)
+{
+  char *value;
+  int i, j;
+
+  for (i = 1; i < *argc - 1; i++)
   {
-    if (nclass[i] != 0)
-      Acc[i] = 1 - error[i];
+    if (strcmp(argv[i], option) == 0)
+    {
+      value = argv[i + 1];
+      for (j = i + 2; j <= *argc; j++) // argv[argc] is NULL
+        argv[j - 2] = argv[j];
+      *argc -= 2;
+      return value;
+    }
   }
 
-  free(error);
-  free(nclass);
+  return NULL;
+}
 
-  return Acc;
+// It reads and removes the option "<option> <value>" from the command line, returning 1 if it was there
+static int opf_ReadIntOption(int *argc, char **argv, char *option, int *value)
+{
+  char *str = opf_ReadOption(argc, argv, option);
+
+  if (str == NULL)
+    return 0;
+  *value = atoi(str);
+
+  return 1;
 }
 
-// Compute the confusion matrix
-int **opf_ConfusionMatrix(Subgraph *sg)
+//it reads and removes the option "-t <nthreads>" from the command line
+void opf_ReadThreadsOption(int *argc, char **argv)
 {
-  int **opf_ConfusionMatrix = NULL, i;
+  if (opf_ReadIntOption(argc, argv, "-t", &opf_NumThreads) && (opf_NumThreads < 1))
+    Error("Invalid number of threads", "opf_ReadThreadsOption");
+}
 
-  opf_ConfusionMatrix = (int **)calloc((sg->nlabels + 1), sizeof(int *));
-  for (i = 1; i <= sg->nlabels; i++)
-    opf_ConfusionMatrix[i] = (int *)calloc((sg->nlabels + 1), sizeof(int));
+//it reads and removes the option "-p <npivots>" from the command line
+void opf_ReadPivotsOption(int *argc, char **argv)
+{
+  if (opf_ReadIntOption(argc, argv, "-p", &opf_NumPivots) && (opf_NumPivots < 0))
+    Error("Invalid number of pivots", "opf_ReadPivotsOption");
+}
 
-  for (i = 0; i < sg->nnodes; i++)
-    opf_ConfusionMatrix[sg->node[i].truelabel][sg->node[i].label]++;
+//it reads and removes the options "-a <brute|kdtree|vptree|index|approx>" and "-r <recall>" from the command line
+void opf_ReadKnnOption(int *argc, char **argv)
+{
+  char *method = opf_ReadOption(argc, argv, "-a"), *recall = opf_ReadOption(argc, argv, "-r");
+
+  if (recall != NULL)
+  {
+    opf_KnnRecall = atof(recall);
+    if ((opf_KnnRecall <= 0) || (opf_KnnRecall > 1))
+      Error("Invalid recall target", "opf_ReadKnnOption");
+  }
+  if (method == NULL)
+    return;
+  if (strcmp(method, "brute") == 0)
+    opf_KnnMethod = opf_KNN_BRUTE;
+  else if (strcmp(method, "kdtree") == 0)
+    opf_KnnMethod = opf_KNN_KDTREE;
+  else if (strcmp(method, "vptree") == 0)
+    opf_KnnMethod = opf_KNN_VPTREE;
+  else if (strcmp(method, "index") == 0)
+    opf_KnnMethod = opf_KNN_INDEX;
+  else if (strcmp(method, "approx") == 0)
+    opf_KnnMethod = opf_KNN_APPROX;
+  else
+    Error("Invalid knn graph method", "opf_ReadKnnOption");
+}
 
-  return opf_ConfusionMatrix;
+//it reads and removes the option "-q <heap|bucket>" from the command line
+void opf_ReadQueueOption(int *argc, char **argv)
+{
+  char *queue = opf_ReadOption(argc, argv, "-q");
+
+  if (queue == NULL)
+    return;
+  if (strcmp(queue, "heap") == 0)
+    opf_ClusteringQueue = opf_QUEUE_HEAP;
+  else if (strcmp(queue, "bucket") == 0)
+    opf_ClusteringQueue = opf_QUEUE_BUCKET;
+  else
+    Error("Invalid queue", "opf_ReadQueueOption");
 }
 
-//read distances from precomputed distances file
-float **opf_ReadDistances(char *fileName, int *n)
+//it reads and removes the option "-f <float32|float16|uint16|uint8>" from the command line and returns the opf_DIST_* type (float32 without it)
+int opf_ReadDistanceTypeOption(int *argc, char **argv)
 {
-  int nsamples, i;
-  FILE *fp = NULL;
-  float **M = NULL;
-  char msg[256];
+  char *name[4] = {"float32", "float16", "uint16", "uint8"}, *type = opf_ReadOption(argc, argv, "-f");
+  int i;
 
-  fp = fopen(fileName, "rb");
+  if (type == NULL)
+    return opf_DIST_FLOAT32;
+  for (i = opf_DIST_FLOAT32; i <= opf_DIST_UINT8; i++)
+    if (strcmp(type, name[i]) == 0)
+      return i;
+  Error("Invalid distance type", "opf_ReadDistanceTypeOption");
 
-  if (fp == NULL)
-  {
-    sprintf(msg, "%s%s", "Unable to open file ", fileName);
-    Error(msg, "opf_ReadDistances");
-  }
+  return opf_DIST_FLOAT32;
+}
 
-  if (fread(&nsamples, sizeof(int), 1, fp) != 1)
-    Error("Could not read number of samples", "opf_ReadDistances");
+//it reads and removes the option "-c <megabytes>" from the command line, the size of the cache of opf_CreateDistanceCache
+void opf_ReadDistanceCacheOption(int *argc, char **argv)
+{
+  if (opf_ReadIntOption(argc, argv, "-c", &opf_DistanceCacheSize) && (opf_DistanceCacheSize < 1))
+    Error("Invalid size of the distance cache", "opf_ReadDistanceCacheOption");
+}
 
-  *n = nsamples;
-  M = (float **)malloc(nsamples * sizeof(float *));
+//it creates opf_DistanceCache for the positions of the nodes of sg1 and sg2 (which may be NULL), if its size was given
+void opf_CreateDistanceCache(Subgraph *sg1, Subgraph *sg2)
+{
+  int i, nsamples = 0;
 
-  for (i = 0; i < nsamples; i++)
-  {
-    M[i] = (float *)malloc(nsamples * sizeof(float));
-    if (fread(M[i], sizeof(float), nsamples, fp) != nsamples)
-    {
-      Error("Could not read samples", "opf_ReadDistances");
-    }
-  }
-  fclose(fp);
+  if (opf_DistanceCacheSize <= 0)
+    return;
+  for (i = 0; i < sg1->nnodes; i++)
+    nsamples = MAX(nsamples, sg1->node[i].position + 1);
+  for (i = 0; (sg2 != NULL) && (i < sg2->nnodes); i++)
+    nsamples = MAX(nsamples, sg2->node[i].position + 1);
+  DestroyDistCache(&opf_DistanceCache);
+  opf_DistanceCache = CreateDistCache(nsamples, (size_t)opf_DistanceCacheSize << 20);
+}
 
-  return M;
+//it writes the hits and misses of opf_DistanceCache, if any
+void opf_WriteDistanceCacheStats(FILE *fp)
+{
+  long long hits, misses;
+
+  if (opf_DistanceCache == NULL)
+    return;
+  DistCacheStats(opf_DistanceCache, &hits, &misses);
+  fprintf(fp, "\nDistance cache: %lld hits, %lld misses (%.2f%% hits)", hits, misses,
+          (hits + misses > 0) ? 100.0 * hits / (hits + misses) : 0.0);
 }
 
 // Normalized cut
 float opf_NormalizedCut(Subgraph *sg)
 {
-  int l, p, q;
-  Set *Saux;
+  int l, p, q, a;
   float ncut, dist;
   float *acumIC; //acumulate weights inside each class
   float *acumEC; //acumulate weights between the class and a distinct one
@@ -1726,13 +3029,10 @@ float opf_NormalizedCut(Subgraph *sg)
 
   for (p = 0; p < sg->nnodes; p++)
   {
-    for (Saux = sg->node[p].adj; Saux != NULL; Saux = Saux->next)
+    for (a = sg->arcoffset[p]; a < sg->arcoffset[p + 1]; a++)
     {
-      q = Saux->elem;
-      if (!opf_PrecomputedDistance)
-        dist = opf_ArcWeight(sg->node[p].feat, sg->node[q].feat, sg->nfeats);
-      else
-        dist = opf_DistanceValue[sg->node[p].position][sg->node[q].position];
+      q = sg->arcnode[a];
+      dist = sg->arcweight[a];
       if (dist > 0.0)
       {
         if (sg->node[p].label == sg->node[q].label)
@@ -1757,32 +3057,127 @@ float opf_NormalizedCut(Subgraph *sg)
   return (ncut);
 }
 
+/* opf_BestkMinCut tries the values of k in batches of up to
+   opf_NumThreads, each one on its own copy of the nodes over the arcs
+   of the kmax graph. The plateau arcs that a try inserts are kept for
+   the next values of k, as the serial sweep does, so the tries of a
+   batch after the first one that inserts arcs are discarded, its arcs
+   are adopted and the next batch starts from them. The chosen k does
+   not depend on the number of threads. To waste few tries when most
+   values of k insert arcs, as with the integer densities of
+   opf_QUEUE_BUCKET, a batch cut short makes the next one as large as
+   the tries it used, and a batch with no inserted arcs doubles it. */
+
+// It creates a try of opf_BestkMinCut for k, sharing the arcs of sg
+static Subgraph *opf_CreateMinCutTry(Subgraph *sg, int k, float df)
+{
+  Subgraph *t = (Subgraph *)calloc(1, sizeof(Subgraph));
+  int i;
+
+  if (t == NULL)
+    Error(MSG1, "opf_CreateMinCutTry");
+  *t = *sg;
+  t->node = (SNode *)calloc(sg->nnodes, sizeof(SNode));
+  if (t->node == NULL)
+    Error(MSG1, "opf_CreateMinCutTry");
+  memcpy(t->node, sg->node, sg->nnodes * sizeof(SNode));
+  t->ordered_list_of_nodes = AllocIntArray(sg->nnodes);
+  t->arcsshared = 1;
+  t->ovfhead = AllocIntArray(sg->nnodes);
+  for (i = 0; i < sg->nnodes; i++)
+    t->ovfhead[i] = NIL;
+  t->ovfnode = t->ovfnext = NULL;
+  t->ovfweight = NULL;
+  t->novf = t->ovfsize = 0;
+  t->df = df;
+  t->bestk = k;
+
+  return t;
+}
+
+static void opf_DestroyMinCutTry(Subgraph **t)
+{
+  if (*t != NULL)
+  {
+    DestroySgArcs(*t);
+    free((*t)->node);
+    free((*t)->ordered_list_of_nodes);
+    free(*t);
+    *t = NULL;
+  }
+}
+
+// It moves the arcs and the plateau counts of the try t to sg
+static void opf_AdoptMinCutTry(Subgraph *sg, Subgraph *t)
+{
+  int i;
+
+  DestroySgArcs(sg);
+  sg->arcoffset = t->arcoffset;
+  sg->arcnode = t->arcnode;
+  sg->arcweight = t->arcweight;
+  sg->ovfhead = t->ovfhead;
+  sg->ovfnode = t->ovfnode;
+  sg->ovfnext = t->ovfnext;
+  sg->ovfweight = t->ovfweight;
+  sg->novf = t->novf;
+  sg->ovfsize = t->ovfsize;
+  t->arcoffset = t->arcnode = t->ovfhead = t->ovfnode = t->ovfnext = NULL;
+  t->arcweight = t->ovfweight = NULL;
+  t->novf = t->ovfsize = 0;
+  for (i = 0; i < sg->nnodes; i++)
+    sg->node[i].nplatadj = t->node[i].nplatadj;
+}
+
 // Estimate the best k by minimum cut
 void opf_BestkMinCut(Subgraph *sg, int kmin, int kmax)
 {
-  int k, bestk = kmax;
-  float mincut = FLT_MAX, nc;
+  int k, b, nbatch, bestk = kmax, adopted;
+  int nthreads = MAX(opf_NumThreads, 1), maxbatch = nthreads;
+  float mincut = FLT_MAX;
+  float *nc = AllocFloatArray(nthreads);
+  Subgraph **T = (Subgraph **)calloc(nthreads, sizeof(Subgraph *));
 
   float *maxdists = opf_CreateArcs2(sg, kmax); // stores the maximum distances for every k=1,2,...,kmax
 
   // Find the best k
-  for (k = kmin; (k <= kmax) && (mincut != 0.0); k++)
+  k = kmin;
+  while ((k <= kmax) && (mincut != 0.0))
   {
-    sg->df = maxdists[k - 1];
-    sg->bestk = k;
-
-    opf_PDFtoKmax(sg);
+    nbatch = MIN(maxbatch, kmax - k + 1);
 
-    opf_OPFClusteringToKmax(sg);
-
-    nc = opf_NormalizedCutToKmax(sg);
+#pragma omp parallel for if (nbatch > 1) num_threads(nbatch) schedule(dynamic, 1)
+    for (b = 0; b < nbatch; b++)
+    {
+      T[b] = opf_CreateMinCutTry(sg, k + b, maxdists[k + b - 1]);
+      opf_PDFtoKmax(T[b]);
+      opf_OPFClusteringToKmax(T[b]);
+      nc[b] = opf_NormalizedCutToKmax(T[b]);
+    }
 
-    if (nc < mincut)
+    // the tries are taken in the order of k, up to the first one that inserted plateau arcs
+    adopted = 0;
+    for (b = 0; (b < nbatch) && (mincut != 0.0) && !adopted; b++)
     {
-      mincut = nc;
-      bestk = k;
+      if (nc[b] < mincut)
+      {
+        mincut = nc[b];
+        bestk = k + b;
+      }
+      if (!T[b]->arcsshared)
+      {
+        opf_AdoptMinCutTry(sg, T[b]);
+        adopted = 1;
+      }
     }
+    k += b;
+    maxbatch = adopted ? b : MIN(2 * maxbatch, nthreads);
+
+    for (b = 0; b < nbatch; b++)
+      opf_DestroyMinCutTry(&T[b]);
   }
+  free(T);
+  free(nc);
   free(maxdists);
   opf_DestroyArcs(sg);
 
@@ -1794,29 +3189,157 @@ void opf_BestkMinCut(Subgraph *sg, int kmin, int kmax)
   fprintf(stderr, "Best k: %d ", sg->bestk);
 }
 
-// Create adjacent list in subgraph: a knn graph
-void opf_CreateArcs(Subgraph *sg, int knn)
+/*--------- Spatial index for the knn graph ------------------------*/
+/* opf_CreateArcs and opf_CreateArcs2 may find the k-nearest neighbors
+   of each node with an exact k-d tree or VP-tree (util/knnindex.c)
+   instead of scanning all the nodes. The index prunes with the metric
+   of the arc weight and the loosened thresholds of the pivot index, so
+   it returns the same neighbors, in the same order, as the scan. The
+   approximate graph (opf_KNN_APPROX) works with any arc weight and
+   trades a few neighbors for a build time close to linear. */
+
+static float opf_KnnBoundEuclLog(float w)
+{
+  return opf_PivotThreshold(opf_PIVOT_EUCLLOG, w);
+}
+
+static float opf_KnnBoundEucl(float w)
+{
+  return opf_PivotThreshold(opf_PIVOT_EUCL, w);
+}
+
+static float opf_KnnBoundManhattan(float w)
+{
+  return opf_PivotThreshold(opf_PIVOT_MANHATTAN, w);
+}
+
+static float opf_KnnEuclMetric(float *f1, float *f2, int n)
+{
+  return sqrtf(DistKernels.eucl(f1, f2, n, FLT_MAX));
+}
+
+// It returns the norm of a metric (opf_PIVOT_*) for the k-d tree, and its bound and function for the VP-tree
+static int opf_KnnMetricFuns(int metric, KnnBoundFun *bound, KnnMetricFun *fun)
+{
+  switch (metric)
+  {
+  case opf_PIVOT_EUCLLOG:
+    *bound = opf_KnnBoundEuclLog;
+    *fun = opf_KnnEuclMetric;
+    return KNN_L2;
+  case opf_PIVOT_EUCL:
+    *bound = opf_KnnBoundEucl;
+    *fun = opf_KnnEuclMetric;
+    return KNN_L2;
+  default:
+    *bound = opf_KnnBoundManhattan;
+    *fun = opf_ManhattanDist;
+    return KNN_L1;
+  }
+}
+
+/* It creates the index chosen by opf_KnnMethod for the arc weight, or
+   returns NULL for the scan, which also serves the precomputed and
+   cached distances */
+static KnnIndex *opf_CreateKnnIndex(Subgraph *sg, int knn, KnnBoundFun *bound)
+{
+  int metric = opf_PivotMetricOfArcWeight(), method = opf_KnnMethod;
+  KnnMetricFun fun;
+  KnnIndex *T = NULL;
+  int norm;
+
+  // the scan fills the lists of nodes with less than knn neighbors in its own way
+  if ((method == opf_KNN_BRUTE) || opf_PrecomputedDistance || (opf_DistanceCache != NULL) || (sg->nnodes <= knn))
+    return NULL;
+
+  if (method == opf_KNN_APPROX)
+  {
+    // a few more neighbors than needed give the descent enough candidates for small k
+    T = CreateKnnGraph(sg, MIN(MAX(knn, opf_KNN_APPROX_MINK), sg->nnodes - 1), opf_BoundedArcWeight(opf_ArcWeight),
+                       opf_KnnRecall);
+    opf_KnnMeasuredRecall = T->recall;
+    return T;
+  }
+  if (metric == opf_PIVOT_NONE)
+    return NULL;
+
+  norm = opf_KnnMetricFuns(metric, bound, &fun);
+  if (method == opf_KNN_INDEX)
+    method = (sg->nfeats <= opf_KNN_KDTREE_MAXFEATS) ? opf_KNN_KDTREE : opf_KNN_VPTREE;
+  if (method == opf_KNN_KDTREE)
+    return CreateKdTree(sg, norm);
+
+  return CreateVpTree(sg, fun);
+}
+
+/* The knn index of a kNN-OPF model serves opf_OPFknnClassify and is
+   kept in the model file. It is a k-d tree or a VP-tree as chosen by
+   opf_KnnMethod, and as opf_KNN_INDEX for the other methods. */
+void opf_CreateKnnClassifierIndex(Subgraph *sg)
+{
+  int metric = opf_PivotMetricOfArcWeight(), method = opf_KnnMethod, norm;
+  KnnBoundFun bound = NULL;
+  KnnMetricFun fun;
+
+  DestroyKnnIndex(&sg->knnindex);
+  if (opf_PrecomputedDistance || (metric == opf_PIVOT_NONE) || (sg->nnodes == 0))
+    return;
+
+  norm = opf_KnnMetricFuns(metric, &bound, &fun);
+  if ((method != opf_KNN_KDTREE) && (method != opf_KNN_VPTREE))
+    method = (sg->nfeats <= opf_KNN_KDTREE_MAXFEATS) ? opf_KNN_KDTREE : opf_KNN_VPTREE;
+  if (method == opf_KNN_KDTREE)
+    sg->knnindex = CreateKdTree(sg, norm);
+  else
+    sg->knnindex = CreateVpTree(sg, fun);
+  sg->knnmetric = metric;
+}
+
+/* It returns the knn index of the model Train for searches of knn
+   nodes, created again if it was built for another metric, or NULL
+   for the scan (precomputed or cached distances) */
+static KnnIndex *opf_KnnClassifierIndex(Subgraph *Train, int knn, KnnBoundFun *bound)
+{
+  int metric = opf_PivotMetricOfArcWeight(), norm;
+  KnnMetricFun fun;
+  KnnIndex *T = Train->knnindex;
+
+  // the scan fills the lists with less than knn nodes in its own way
+  if (opf_PrecomputedDistance || (opf_DistanceCache != NULL) || (metric == opf_PIVOT_NONE) || (Train->nnodes <= knn))
+    return NULL;
+
+  norm = opf_KnnMetricFuns(metric, bound, &fun);
+  if ((T == NULL) || ((T->type == KNN_KDTREE) ? (T->norm != norm) : (T->metric != fun)))
+    opf_CreateKnnClassifierIndex(Train);
+
+  return Train->knnindex;
+}
+
+/* It finds the knn-nearest neighbors of every node of sg and stores
+   them, from the nearest to the farthest, in nn[i*knn..(i+1)*knn-1]
+   with their arc weights in d */
+static void opf_KnnLists(Subgraph *sg, int knn, float *D, int *NN)
 {
   int i, j, l, k;
   float dist;
   int *nn = AllocIntArray(knn + 1);
   float *d = AllocFloatArray(knn + 1);
+  KnnBoundFun bound = NULL;
+  KnnIndex *T = opf_CreateKnnIndex(sg, knn, &bound);
+  opf_BoundedArcWeightFun arcweight = opf_BoundedArcWeight(opf_ArcWeight);
 
-  /* Create graph with the knn-nearest neighbors */
-
-  sg->df = 0.0;
   for (i = 0; i < sg->nnodes; i++)
   {
-    for (l = 0; l < knn; l++)
-      d[l] = FLT_MAX;
-    for (j = 0; j < sg->nnodes; j++)
+    if (T != NULL)
+      KnnIndexNodeSearch(T, i, knn, arcweight, bound, d, nn);
+    else
+      for (l = 0; l < knn; l++)
+        d[l] = FLT_MAX;
+    for (j = 0; (T == NULL) && (j < sg->nnodes); j++)
     {
       if (j != i)
       {
-        if (!opf_PrecomputedDistance)
-          d[knn] = opf_ArcWeight(sg->node[i].feat, sg->node[j].feat, sg->nfeats);
-        else
-          d[knn] = opf_DistanceValue[sg->node[i].position][sg->node[j].position];
+        d[knn] = opf_NodeDistance(&sg->node[i], &sg->node[j], sg->nfeats);
         nn[knn] = j;
         k = knn;
         while ((k > 0) && (d[k] < d[k - 1]))
@@ -1831,7 +3354,34 @@ void opf_CreateArcs(Subgraph *sg, int knn)
         }
       }
     }
+    memcpy(&D[(size_t)i * knn], d, knn * sizeof(float));
+    memcpy(&NN[(size_t)i * knn], nn, knn * sizeof(int));
+  }
+  free(d);
+  free(nn);
+  DestroyKnnIndex(&T);
+}
+
+/* It creates the knn graph of sg from the first knn entries of the
+   kmax-nearest neighbor lists of opf_KnnLists, as opf_CreateArcs */
+static void opf_SetKnnArcs(Subgraph *sg, int kmax, float *D, int *NN, int knn)
+{
+  int i, l, a;
+  float *d;
+  int *nn;
 
+  AllocSgArcs(sg, sg->nnodes * knn);
+  sg->df = 0.0;
+  for (i = 0; i < sg->nnodes; i++)
+  {
+    d = &D[(size_t)i * kmax];
+    nn = &NN[(size_t)i * kmax];
+
+    // the arcs are stored from the farthest to the nearest neighbor
+    for (l = 0, a = sg->arcoffset[i]; l < knn; l++)
+      if (d[l] != INT_MAX)
+        a++;
+    sg->arcoffset[i + 1] = a;
     for (l = 0; l < knn; l++)
     {
       if (d[l] != INT_MAX)
@@ -1840,63 +3390,57 @@ void opf_CreateArcs(Subgraph *sg, int knn)
           sg->df = d[l];
         //if (d[l] > sg->node[i].radius)
         sg->node[i].radius = d[l];
-        InsertSet(&(sg->node[i].adj), nn[l]);
+        a--;
+        sg->arcnode[a] = nn[l];
+        sg->arcweight[a] = d[l];
       }
     }
   }
-  free(d);
-  free(nn);
 
   if (sg->df < 0.00001)
     sg->df = 1.0;
 }
 
+// Create adjacent list in subgraph: a knn graph
+void opf_CreateArcs(Subgraph *sg, int knn)
+{
+  float *d = AllocFloatArray(MAX(sg->nnodes * knn, 1));
+  int *nn = AllocIntArray(MAX(sg->nnodes * knn, 1));
+
+  opf_KnnLists(sg, knn, d, nn);
+  opf_SetKnnArcs(sg, knn, d, nn, knn);
+  free(d);
+  free(nn);
+}
+
 // Destroy Arcs
 void opf_DestroyArcs(Subgraph *sg)
 {
   int i;
 
   for (i = 0; i < sg->nnodes; i++)
-  {
     sg->node[i].nplatadj = 0;
-    DestroySet(&(sg->node[i].adj));
-  }
+  DestroySgArcs(sg);
 }
 
 // opf_PDF computation
 void opf_PDF(Subgraph *sg)
 {
-  int i, nelems;
-  float dist;
-  float *value = AllocFloatArray(sg->nnodes);
-  Set *adj = NULL;
+  int i;
+  float *value = AllocFloatArray(sg->nnodes), mindens = FLT_MAX, maxdens = -FLT_MAX;
 
   sg->K = (2.0 * (float)sg->df / 9.0);
-  sg->mindens = FLT_MAX;
-  sg->maxdens = -FLT_MAX;
+#pragma omp parallel for if (opf_NumThreads > 1) num_threads(opf_NumThreads) reduction(min : mindens) reduction(max : maxdens) schedule(static)
   for (i = 0; i < sg->nnodes; i++)
   {
-    adj = sg->node[i].adj;
-    value[i] = 0.0;
-    nelems = 1;
-    while (adj != NULL)
-    {
-      if (!opf_PrecomputedDistance)
-        dist = opf_ArcWeight(sg->node[i].feat, sg->node[adj->elem].feat, sg->nfeats);
-      else
-        dist = opf_DistanceValue[sg->node[i].position][sg->node[adj->elem].position];
-      value[i] += exp(-dist / sg->K);
-      adj = adj->next;
-      nelems++;
-    }
+    value[i] = DistKernels.expsum(&sg->arcweight[sg->arcoffset[i]], SgNumArcs(sg, i), sg->K);
+    value[i] = (value[i] / (float)(SgNumArcs(sg, i) + 1));
 
-    value[i] = (value[i] / (float)nelems);
-
-    if (value[i] < sg->mindens)
-      sg->mindens = value[i];
-    if (value[i] > sg->maxdens)
-      sg->maxdens = value[i];
+    mindens = MIN(mindens, value[i]);
+    maxdens = MAX(maxdens, value[i]);
   }
+  sg->mindens = mindens;
+  sg->maxdens = maxdens;
 
   //  printf("df=%f,K1=%f,K2=%f,mindens=%f, maxdens=%f\n",sg->df,sg->K1,sg->K2,sg->mindens,sg->maxdens);
 
@@ -1913,6 +3457,8 @@ void opf_PDF(Subgraph *sg)
     for (i = 0; i < sg->nnodes; i++)
     {
       sg->node[i].dens = ((float)(opf_MAXDENS - 1) * (value[i] - sg->mindens) / (float)(sg->maxdens - sg->mindens)) + 1.0;
+      if (opf_ClusteringQueue == opf_QUEUE_BUCKET) // integer densities for the bucket queue
+        sg->node[i].dens = rintf(sg->node[i].dens);
       sg->node[i].pathval = sg->node[i].dens - 1;
     }
   }
@@ -2090,133 +3636,151 @@ void kMeans(Subgraph *g, double **mean, int k)
 }
 
 /*------------ Distance functions ------------------------------ */
+/* They call the kernels in DistKernels (util/distance.c), which are
+   installed at startup for the best instruction set of the CPU. */
 
 // Compute Euclidean distance between feature vectors
 float opf_EuclDist(float *f1, float *f2, int n)
 {
-  int i;
-  float dist = 0.0f;
-
-  for (i = 0; i < n; i++)
-    dist += (f1[i] - f2[i]) * (f1[i] - f2[i]);
-
-  return (dist);
+  return (DistKernels.eucl(f1, f2, n, FLT_MAX));
 }
 
 // Discretizes original distance
 float opf_EuclDistLog(float *f1, float *f2, int n)
 {
-  return (((float)opf_MAXARCW * log(opf_EuclDist(f1, f2, n) + 1)));
+  return (((float)opf_MAXARCW * log(DistKernels.eucl(f1, f2, n, FLT_MAX) + 1)));
 }
 
 // Compute gaussian distance between feature vectors
 float opf_GaussDist(float *f1, float *f2, int n, float gamma)
 {
-  int i;
-  float dist = 0.0f;
-
-  for (i = 0; i < n; i++)
-    dist += (f1[i] - f2[i]) * (f1[i] - f2[i]);
-
-  dist = exp(-gamma * sqrtf(dist));
-
-  return (dist);
+  return (exp(-gamma * sqrtf(DistKernels.eucl(f1, f2, n, FLT_MAX))));
 }
 
 // Compute  chi-squared distance between feature vectors
 float opf_ChiSquaredDist(float *f1, float *f2, int n)
 {
-  int i;
-  float dist = 0.0f, sf1 = 0.0f, sf2 = 0.0f;
-
-  for (i = 0; i < n; i++)
-  {
-    sf1 += f1[i];
-    sf2 += f2[i];
-  }
-
-  for (i = 0; i < n; i++)
-    dist += 1 / (f1[i] + f2[i] + 0.000000001) * pow(f1[i] / sf1 - f2[i] / sf2, 2);
-
-  return (sqrtf(dist));
+  return (DistKernels.chisquared(f1, f2, n, FLT_MAX));
 }
 
 // Compute  Manhattan distance between feature vectors
 float opf_ManhattanDist(float *f1, float *f2, int n)
 {
-  int i;
-  float dist = 0.0f;
-
-  for (i = 0; i < n; i++)
-    dist += fabs(f1[i] - f2[i]);
-
-  return (dist);
+  return (DistKernels.manhattan(f1, f2, n, FLT_MAX));
 }
 
 // Compute  Camberra distance between feature vectors
 float opf_CanberraDist(float *f1, float *f2, int n)
 {
-  int i;
-  float dist = 0.0f, aux;
-
-  for (i = 0; i < n; i++)
-  {
-    aux = fabs(f1[i] + f2[i]);
-    if (aux > 0)
-      dist += (fabs(f1[i] - f2[i]) / aux);
-  }
-
-  return (dist);
+  return (DistKernels.canberra(f1, f2, n, FLT_MAX));
 }
 
 // Compute  Squared Chord distance between feature vectors
 float opf_SquaredChordDist(float *f1, float *f2, int n)
 {
-  int i;
-  float dist = 0.0f, aux1, aux2;
+  return (DistKernels.squaredchord(f1, f2, n, FLT_MAX));
+}
 
-  for (i = 0; i < n; i++)
-  {
-    aux1 = sqrtf(f1[i]);
-    aux2 = sqrtf(f2[i]);
+// Compute  Squared Chi-squared distance between feature vectors
+float opf_SquaredChiSquaredDist(float *f1, float *f2, int n)
+{
+  return (DistKernels.squaredchisquared(f1, f2, n, FLT_MAX));
+}
 
-    if ((aux1 >= 0) && (aux2 >= 0))
-      dist += pow(aux1 - aux2, 2);
-  }
+// Compute  Bray Curtis distance between feature vectors
+float opf_BrayCurtisDist(float *f1, float *f2, int n)
+{
+  return (DistKernels.braycurtis(f1, f2, n, FLT_MAX));
+}
 
-  return (dist);
+/*------------ Bounded distance functions ------------------------------ */
+/* They return the same value as the functions above when it is not
+   greater than bound. Otherwise they may stop before reading the whole
+   vectors and return any value greater than bound. They are used when
+   a distance above some cost is useless to the caller. */
+
+float opf_EuclDistBounded(float *f1, float *f2, int n, float bound)
+{
+  return (DistKernels.eucl(f1, f2, n, bound));
 }
 
-// Compute  Squared Chi-squared distance between feature vectors
-float opf_SquaredChiSquaredDist(float *f1, float *f2, int n)
+float opf_EuclDistLogBounded(float *f1, float *f2, int n, float bound)
 {
-  int i;
-  float dist = 0.0f, aux;
+  /* bound on the squared distance, loosened to absorb the rounding of
+     log(d + 1), so that no distance within bound is cut. Callers pass
+     the same bound many times in a row, so the last one is kept. */
+  static __thread float lastbound = -1.0f, sqbound;
+  float sq;
 
-  for (i = 0; i < n; i++)
+  if (bound != lastbound)
   {
-    aux = fabs(f1[i] + f2[i]);
-    if (aux > 0)
-      dist += (pow(f1[i] - f2[i], 2) / aux);
+    sqbound = (float)(expm1(bound / opf_MAXARCW) * (1.0 + 1e-5) + FLT_EPSILON);
+    lastbound = bound;
   }
 
-  return (dist);
+  sq = DistKernels.eucl(f1, f2, n, sqbound);
+  if (sq > sqbound) // any value above bound will do
+    return (nextafterf(bound, FLT_MAX));
+
+  return (((float)opf_MAXARCW * log(sq + 1)));
 }
 
-// Compute  Bray Curtis distance between feature vectors
-float opf_BrayCurtisDist(float *f1, float *f2, int n)
+float opf_ChiSquaredDistBounded(float *f1, float *f2, int n, float bound)
 {
-  int i;
-  float dist = 0.0f, aux;
+  return (DistKernels.chisquared(f1, f2, n, bound));
+}
 
-  for (i = 0; i < n; i++)
-  {
-    aux = f1[i] + f2[i];
-    if (aux > 0)
-      dist += (fabs(f1[i] - f2[i]) / aux);
-  }
+float opf_ManhattanDistBounded(float *f1, float *f2, int n, float bound)
+{
+  return (DistKernels.manhattan(f1, f2, n, bound));
+}
+
+float opf_CanberraDistBounded(float *f1, float *f2, int n, float bound)
+{
+  return (DistKernels.canberra(f1, f2, n, bound));
+}
+
+float opf_SquaredChordDistBounded(float *f1, float *f2, int n, float bound)
+{
+  return (DistKernels.squaredchord(f1, f2, n, bound));
+}
+
+float opf_SquaredChiSquaredDistBounded(float *f1, float *f2, int n, float bound)
+{
+  return (DistKernels.squaredchisquared(f1, f2, n, bound));
+}
+
+float opf_BrayCurtisDistBounded(float *f1, float *f2, int n, float bound)
+{
+  return (DistKernels.braycurtis(f1, f2, n, bound));
+}
+
+// Arc weight without early termination, for arc weights with no bounded version
+static float opf_ArcWeightUnbounded(float *f1, float *f2, int n, float bound)
+{
+  return (opf_ArcWeight(f1, f2, n));
+}
 
-  return (dist);
+// It returns the bounded version of an arc weight function
+opf_BoundedArcWeightFun opf_BoundedArcWeight(opf_ArcWeightFun f)
+{
+  if (f == opf_EuclDistLog)
+    return opf_EuclDistLogBounded;
+  if (f == opf_EuclDist)
+    return opf_EuclDistBounded;
+  if (f == opf_ChiSquaredDist)
+    return opf_ChiSquaredDistBounded;
+  if (f == opf_ManhattanDist)
+    return opf_ManhattanDistBounded;
+  if (f == opf_CanberraDist)
+    return opf_CanberraDistBounded;
+  if (f == opf_SquaredChordDist)
+    return opf_SquaredChordDistBounded;
+  if (f == opf_SquaredChiSquaredDist)
+    return opf_SquaredChiSquaredDistBounded;
+  if (f == opf_BrayCurtisDist)
+    return opf_BrayCurtisDistBounded;
+  return opf_ArcWeightUnbounded;
 }
 
 /* -------- Auxiliary functions to optimize BestkMinCut -------- */
@@ -2226,26 +3790,30 @@ float opf_BrayCurtisDist(float *f1, float *f2, int n)
 // for each k=1,2,...,kmax
 float *opf_CreateArcs2(Subgraph *sg, int kmax)
 {
-  int i, j, l, k;
+  int i, j, l, k, a;
   float dist;
   int *nn = AllocIntArray(kmax + 1);
   float *d = AllocFloatArray(kmax + 1);
   float *maxdists = AllocFloatArray(kmax);
+  KnnBoundFun bound = NULL;
+  KnnIndex *T = opf_CreateKnnIndex(sg, kmax, &bound);
+  opf_BoundedArcWeightFun arcweight = opf_BoundedArcWeight(opf_ArcWeight);
   /* Create graph with the knn-nearest neighbors */
 
+  AllocSgArcs(sg, sg->nnodes * kmax);
   sg->df = 0.0;
   for (i = 0; i < sg->nnodes; i++)
   {
-    for (l = 0; l < kmax; l++)
-      d[l] = FLT_MAX;
-    for (j = 0; j < sg->nnodes; j++)
+    if (T != NULL)
+      KnnIndexNodeSearch(T, i, kmax, arcweight, bound, d, nn);
+    else
+      for (l = 0; l < kmax; l++)
+        d[l] = FLT_MAX;
+    for (j = 0; (T == NULL) && (j < sg->nnodes); j++)
     {
       if (j != i)
       {
-        if (!opf_PrecomputedDistance)
-          d[kmax] = opf_ArcWeight(sg->node[i].feat, sg->node[j].feat, sg->nfeats);
-        else
-          d[kmax] = opf_DistanceValue[sg->node[i].position][sg->node[j].position];
+        d[kmax] = opf_NodeDistance(&sg->node[i], &sg->node[j], sg->nfeats);
         nn[kmax] = j;
         k = kmax;
         while ((k > 0) && (d[k] < d[k - 1]))
@@ -2263,7 +3831,8 @@ float *opf_CreateArcs2(Subgraph *sg, int kmax)
     sg->node[i].radius = 0.0;
     sg->node[i].nplatadj = 0; //zeroing amount of nodes on plateaus
     //making sure that the adjacent nodes be sorted in non-decreasing order
-    for (l = kmax - 1; l >= 0; l--)
+    a = sg->arcoffset[i];
+    for (l = 0; l < kmax; l++)
     {
       if (d[l] != FLT_MAX)
       {
@@ -2273,13 +3842,16 @@ float *opf_CreateArcs2(Subgraph *sg, int kmax)
           sg->node[i].radius = d[l];
         if (d[l] > maxdists[l])
           maxdists[l] = d[l];
-        //adding the current neighbor at the beginnig of the list
-        InsertSet(&(sg->node[i].adj), nn[l]);
+        sg->arcnode[a] = nn[l];
+        sg->arcweight[a] = d[l];
+        a++;
       }
     }
+    sg->arcoffset[i + 1] = a;
   }
   free(d);
   free(nn);
+  DestroyKnnIndex(&T);
 
   if (sg->df < 0.00001)
     sg->df = 1.0;
@@ -2290,71 +3862,32 @@ float *opf_CreateArcs2(Subgraph *sg, int kmax)
 // OPFClustering computation only for sg->bestk neighbors
 void opf_OPFClusteringToKmax(Subgraph *sg)
 {
-  Set *adj_i, *adj_j;
-  char insert_i;
-  int i, j;
-  int p, q, l, ki, kj;
+  int i, a;
+  int p, q, l;
   const int kmax = sg->bestk;
   float tmp, *pathval = NULL;
-  RealHeap *Q = NULL;
-  Set *Saux = NULL;
+  opf_PathQueue *Q = NULL;
 
-  //   Add arcs to guarantee symmetry on plateaus
-  for (i = 0; i < sg->nnodes; i++)
-  {
-    adj_i = sg->node[i].adj;
-    ki = 1;
-    while (ki <= kmax)
-    {
-      j = adj_i->elem;
-      if (sg->node[i].dens == sg->node[j].dens)
-      {
-        // insert i in the adjacency of j if it is not there.
-        adj_j = sg->node[j].adj;
-        insert_i = 1;
-        kj = 1;
-        while (kj <= kmax)
-        {
-          if (i == adj_j->elem)
-          {
-            insert_i = 0;
-            break;
-          }
-          adj_j = adj_j->next;
-          kj++;
-        }
-        if (insert_i)
-        {
-          InsertSet(&(sg->node[j].adj), i);
-          sg->node[j].nplatadj++; //number of adjacent nodes on
-                                  //plateaus (includes adjacent plateau
-                                  //nodes computed for previous kmax's)
-        }
-      }
-      adj_i = adj_i->next;
-      ki++;
-    }
-  }
+  //   Add arcs to guarantee symmetry on plateaus, counting them in
+  //   nplatadj (which includes the plateau arcs of previous kmax's)
+  opf_SymmetrizePlateausToKmax(sg, kmax);
 
   // Compute clustering
 
   pathval = AllocFloatArray(sg->nnodes);
-  Q = CreateRealHeap(sg->nnodes, pathval);
-  SetRemovalPolicyRealHeap(Q, MAXVALUE);
-
   for (p = 0; p < sg->nnodes; p++)
   {
     pathval[p] = sg->node[p].pathval;
     sg->node[p].pred = NIL;
     sg->node[p].root = p;
-    InsertRealHeap(Q, p);
   }
+  Q = opf_CreatePathQueue(sg, pathval);
 
   l = 0;
   i = 0;
-  while (!IsEmptyRealHeap(Q))
+  while (!opf_IsEmptyPathQueue(Q))
   {
-    RemoveRealHeap(Q, &p);
+    p = opf_RemovePathQueue(Q);
     sg->ordered_list_of_nodes[i] = p;
     i++;
 
@@ -2367,15 +3900,15 @@ void opf_OPFClusteringToKmax(Subgraph *sg)
 
     sg->node[p].pathval = pathval[p];
     const int nadj = sg->node[p].nplatadj + kmax; // total amount of neighbors
-    for (Saux = sg->node[p].adj, ki = 1; ki <= nadj; Saux = Saux->next, ki++)
+    for (a = sg->arcoffset[p]; a < MIN(sg->arcoffset[p] + nadj, sg->arcoffset[p + 1]); a++)
     {
-      q = Saux->elem;
-      if (Q->color[q] != BLACK)
+      q = sg->arcnode[a];
+      if (!opf_IsRemovedPathQueue(Q, q))
       {
         tmp = MIN(pathval[p], sg->node[q].dens);
         if (tmp > pathval[q])
         {
-          UpdateRealHeap(Q, q, tmp);
+          opf_UpdatePathQueue(Q, q, tmp);
           sg->node[q].pred = p;
           sg->node[q].root = sg->node[p].root;
           sg->node[q].label = sg->node[p].label;
@@ -2386,50 +3919,34 @@ void opf_OPFClusteringToKmax(Subgraph *sg)
 
   sg->nlabels = l;
 
-  DestroyRealHeap(&Q);
+  opf_DestroyPathQueue(&Q);
   free(pathval);
 }
 
 // PDF computation only for sg->bestk neighbors
 void opf_PDFtoKmax(Subgraph *sg)
 {
-  int i, nelems;
+  int i, narcs;
   const int kmax = sg->bestk;
-  float dist;
-  float *value = AllocFloatArray(sg->nnodes);
-  Set *adj = NULL;
+  float *value = AllocFloatArray(sg->nnodes), mindens = FLT_MAX, maxdens = -FLT_MAX;
 
   sg->K = (2.0 * (float)sg->df / 9.0);
 
-  sg->mindens = FLT_MAX;
-  sg->maxdens = -FLT_MAX;
+#pragma omp parallel for if (opf_NumThreads > 1) num_threads(opf_NumThreads) private(narcs) reduction(min : mindens) reduction(max : maxdens) schedule(static)
   for (i = 0; i < sg->nnodes; i++)
   {
-    adj = sg->node[i].adj;
-    value[i] = 0.0;
-    nelems = 1;
-    int k;
     //the PDF is computed only for the kmax adjacents
     //because it is assumed that there will be no plateau
     //neighbors yet, i.e. nplatadj = 0 for every node in sg
-    for (k = 1; k <= kmax; k++)
-    {
-      if (!opf_PrecomputedDistance)
-        dist = opf_ArcWeight(sg->node[i].feat, sg->node[adj->elem].feat, sg->nfeats);
-      else
-        dist = opf_DistanceValue[sg->node[i].position][sg->node[adj->elem].position];
-      value[i] += exp(-dist / sg->K);
-      adj = adj->next;
-      nelems++;
-    }
+    narcs = MIN(kmax, SgNumArcs(sg, i));
+    value[i] = DistKernels.expsum(&sg->arcweight[sg->arcoffset[i]], narcs, sg->K);
+    value[i] = (value[i] / (float)(narcs + 1));
 
-    value[i] = (value[i] / (float)nelems);
-
-    if (value[i] < sg->mindens)
-      sg->mindens = value[i];
-    if (value[i] > sg->maxdens)
-      sg->maxdens = value[i];
+    mindens = MIN(mindens, value[i]);
+    maxdens = MAX(maxdens, value[i]);
   }
+  sg->mindens = mindens;
+  sg->maxdens = maxdens;
 
   if (sg->mindens == sg->maxdens)
   {
@@ -2444,6 +3961,8 @@ void opf_PDFtoKmax(Subgraph *sg)
     for (i = 0; i < sg->nnodes; i++)
     {
       sg->node[i].dens = ((float)(opf_MAXDENS - 1) * (value[i] - sg->mindens) / (float)(sg->maxdens - sg->mindens)) + 1.0;
+      if (opf_ClusteringQueue == opf_QUEUE_BUCKET) // integer densities for the bucket queue
+        sg->node[i].dens = rintf(sg->node[i].dens);
       sg->node[i].pathval = sg->node[i].dens - 1;
     }
   }
@@ -2453,9 +3972,8 @@ void opf_PDFtoKmax(Subgraph *sg)
 // Normalized cut computed only for sg->bestk neighbors
 float opf_NormalizedCutToKmax(Subgraph *sg)
 {
-  int l, p, q, k;
+  int l, p, q, a;
   const int kmax = sg->bestk;
-  Set *Saux;
   float ncut, dist;
   float *acumIC; //acumulate weights inside each class
   float *acumEC; //acumulate weights between the class and a distinct one
@@ -2469,13 +3987,10 @@ float opf_NormalizedCutToKmax(Subgraph *sg)
     const int nadj = sg->node[p].nplatadj + kmax; //for plateaus the number of adjacent
                                                   //nodes will be greater than the current
                                                   //kmax, but they should be considered
-    for (Saux = sg->node[p].adj, k = 1; k <= nadj; Saux = Saux->next, k++)
+    for (a = sg->arcoffset[p]; a < MIN(sg->arcoffset[p] + nadj, sg->arcoffset[p + 1]); a++)
     {
-      q = Saux->elem;
-      if (!opf_PrecomputedDistance)
-        dist = opf_ArcWeight(sg->node[p].feat, sg->node[q].feat, sg->nfeats);
-      else
-        dist = opf_DistanceValue[sg->node[p].position][sg->node[q].position];
+      q = sg->arcnode[a];
+      dist = sg->arcweight[a];
       if (dist > 0.0)
       {
         if (sg->node[p].label == sg->node[q].label)
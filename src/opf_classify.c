@@ -11,19 +11,24 @@ int main(int argc, char **argv)
 	fprintf(stdout, "\n");
 	fflush(stdout);
 
+	opf_ReadThreadsOption(&argc, argv);
+
 	if ((argc != 3) && (argc != 2))
 	{
-		fprintf(stderr, "\nusage opf_classify <P1> <P2>");
+		fprintf(stderr, "\nusage opf_classify [-t <nthreads>] <P1> <P2>");
 		fprintf(stderr, "\nP1: test set in the OPF file format");
-		fprintf(stderr, "\nP2: precomputed distance file (leave it in blank if you are not using this resource\n");
+		fprintf(stderr, "\nP2: precomputed distance file (leave it in blank if you are not using this resource");
+		fprintf(stderr, "\n-t: number of threads used by the classification (optional, default 1)\n");
 		exit(-1);
 	}
 
 	int n, i;
-	float time;
+	float time, cputime;
 	char fileName[256];
 	FILE *f = NULL;
 	timer tic, toc;
+	clock_t cputic, cputoc;
+	opf_ThreadStats *stats = opf_CreateThreadStats(opf_NumThreads);
 
 	if (argc == 3)
 		opf_PrecomputedDistance = 1;
@@ -39,7 +44,9 @@ int main(int argc, char **argv)
 	fprintf(stdout, "\nClassifying test set ...");
 	fflush(stdout);
 	gettimeofday(&tic, NULL);
-	opf_OPFClassifying(gTrain, gTest);
+	cputic = clock();
+	opf_OPFClassifyingParallel(gTrain, gTest, opf_NumThreads, stats);
+	cputoc = clock();
 	gettimeofday(&toc, NULL);
 	fprintf(stdout, " OK");
 	fflush(stdout);
@@ -58,20 +65,21 @@ int main(int argc, char **argv)
 	DestroySubgraph(&gTrain);
 	DestroySubgraph(&gTest);
 	if (opf_PrecomputedDistance)
-	{
-		for (i = 0; i < n; i++)
-			free(opf_DistanceValue[i]);
-		free(opf_DistanceValue);
-	}
+		opf_DestroyDistances(&opf_DistanceValue, n);
 	fprintf(stdout, " OK\n");
 
 	time = ((toc.tv_sec - tic.tv_sec) * 1000.0 + (toc.tv_usec - tic.tv_usec) * 0.001) / 1000.0;
-	fprintf(stdout, "\nTesting time: %f seconds\n", time);
+	cputime = (float)(cputoc - cputic) / CLOCKS_PER_SEC;
+	fprintf(stdout, "\nTesting time: %f seconds (CPU time: %f seconds)\n", time, cputime);
+	if (stats->nthreads > 1)
+		for (i = 0; i < stats->nthreads; i++)
+			fprintf(stdout, "Thread %d: %d samples in %f seconds\n", i, stats->nsamples[i], stats->time[i]);
 	fflush(stdout);
+	opf_DestroyThreadStats(&stats);
 
 	sprintf(fileName, "%s.time", argv[1]);
 	f = fopen(fileName, "a");
-	fprintf(f, "%f\n", time);
+	fprintf(f, "%f %f\n", time, cputime);
 	fclose(f);
 
 	return 0;
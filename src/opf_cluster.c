@@ -14,14 +14,24 @@ int main(int argc, char **argv)
 	fprintf(stdout, "\nLibOPF version 2.0 (2009)\n");
 	fprintf(stdout, "\n");
 
+	opf_ReadThreadsOption(&argc, argv);
+	opf_ReadKnnOption(&argc, argv);
+	opf_ReadQueueOption(&argc, argv);
+	opf_ReadDistanceCacheOption(&argc, argv);
+
 	if ((argc != 6) && (argc != 5))
 	{
-		fprintf(stderr, "\nusage opf_cluster <P1> <P2> <P3> <P4> <P5> <P6>");
+		fprintf(stderr, "\nusage opf_cluster [-t <nthreads>] [-a <brute|kdtree|vptree|index|approx>] [-r <recall>] [-q <heap|bucket>] [-c <megabytes>] <P1> <P2> <P3> <P4> <P5>");
 		fprintf(stderr, "\nP1: unlabeled data set in the OPF file format");
 		fprintf(stderr, "\nP2: kmax(maximum degree for the knn graph)");
 		fprintf(stderr, "\nP3: P3 0 (height), 1(area) and 2(volume)");
 		fprintf(stderr, "\nP4: value of parameter P3 in (0-1)");
 		fprintf(stderr, "\nP5: precomputed distance file (leave it in blank if you are not using this resource");
+		fprintf(stderr, "\n-t: number of threads that try the values of k (optional, default 1; the values of k after one that adds plateau arcs, frequent with -q bucket, wait for it)");
+		fprintf(stderr, "\n-a: search of the knn graph (optional, default brute: scan of all the nodes; the exact k-d tree and VP-tree give the same graph, approx builds an approximate graph)");
+		fprintf(stderr, "\n-r: recall target of the approximate graph in (0-1] (optional, default 0.95)");
+		fprintf(stderr, "\n-q: priority queue of the clustering (optional, default heap; bucket rounds the densities to integers and updates in O(1))");
+		fprintf(stderr, "\n-c: size in megabytes of the cache of the computed distances (optional, default none; the positions of the samples must identify them in every set; the knn searches then scan the nodes whatever -a is)\n");
 		exit(-1);
 	}
 
@@ -34,10 +44,14 @@ int main(int argc, char **argv)
 	{
 		opf_DistanceValue = opf_ReadDistances(argv[5], &n);
 	}
+	else
+		opf_CreateDistanceCache(g, NULL);
 
 	op = atoi(argv[3]);
 
 	opf_BestkMinCut(g, 1, atoi(argv[2])); //default kmin = 1
+	if (opf_KnnMeasuredRecall >= 0)
+		fprintf(stdout, "\nRecall of the approximate knn graph on a sample: %.4f", opf_KnnMeasuredRecall);
 
 	value = atof(argv[4]);
 	if ((value < 1) && (value > 0))
@@ -119,14 +133,12 @@ int main(int argc, char **argv)
 	fprintf(stdout, " OK");
 	fflush(stdout);
 
+	opf_WriteDistanceCacheStats(stdout);
 	fprintf(stdout, "\n\nDeallocating memory ...\n");
 	DestroySubgraph(&g);
 	if (opf_PrecomputedDistance)
-	{
-		for (i = 0; i < n; i++)
-			free(opf_DistanceValue[i]);
-		free(opf_DistanceValue);
-	}
+		opf_DestroyDistances(&opf_DistanceValue, n);
+	DestroyDistCache(&opf_DistanceCache);
 
 	return 0;
 }
@@ -1,6 +1,66 @@
 #include "OPF.h"
 #include <stdio.h>
 
+#define BLOCK 64 //rows and columns of a tile of the distance matrix
+#define HALF_MAX 65504.0 //largest half precision number
+
+/* It computes the distances (p,q), p <= q, between the samples at
+   positions p and q (node[p] is the sample at position p), stores them
+   in the float rows D and returns the largest distance. The triangle is
+   computed in tiles: a thread takes a block of BLOCK rows and sweeps its
+   columns in tiles of BLOCK, so that the feature vectors of a tile stay
+   in cache. */
+static float SweepTriangle(Subgraph *sg, int *node, DistanceKernel kernel, void **D)
+{
+	int b, n = sg->nnodes, nblocks = (n + BLOCK - 1) / BLOCK;
+	float max = 0.0;
+
+#pragma omp parallel for if (opf_NumThreads > 1) num_threads(opf_NumThreads) reduction(max : max) schedule(dynamic, 1)
+	for (b = 0; b < nblocks; b++)
+	{
+		int r, q, q0, r0 = b * BLOCK, r1 = MIN(r0 + BLOCK, n);
+		float d;
+
+		for (q0 = r0; q0 < n; q0 += BLOCK)
+			for (r = r0; r < r1; r++)
+				for (q = MAX(q0, r); q < MIN(q0 + BLOCK, n); q++)
+				{
+					d = (q == r) ? 0.0 : kernel(sg->node[node[r]].feat, sg->node[node[q]].feat, sg->nfeats, FLT_MAX);
+					if (d > max)
+						max = d;
+					((float *)D[r])[q] = d;
+				}
+	}
+
+	return max;
+}
+
+/* It converts the float distances of the triangle D of n samples, in
+   its order, to distance * factor of type. They are stored from the
+   start of the triangle, so distance k is written over bytes of the
+   floats 0, ..., k, which are already read. */
+static void ReduceTriangle(void **D, int n, int type, float factor)
+{
+	float *f = (float *)D[0], v;
+	size_t k, size = (size_t)n * (n + 1) / 2;
+
+	for (k = 0; k < size; k++)
+	{
+		v = f[k] * factor;
+		switch (type)
+		{
+		case opf_DIST_FLOAT16:
+			((unsigned short *)f)[k] = FloatToHalf(MIN(v, HALF_MAX));
+			break;
+		case opf_DIST_UINT16:
+			((unsigned short *)f)[k] = (unsigned short)MIN(rintf(v), 65535.0);
+			break;
+		default:
+			((unsigned char *)f)[k] = (unsigned char)MIN(rintf(v), 255.0);
+		}
+	}
+}
+
 int main(int argc, char **argv)
 {
 	fflush(stdout);
@@ -12,9 +72,15 @@ int main(int argc, char **argv)
 	fprintf(stdout, "\n");
 	fflush(stdout);
 
+	opf_ReadThreadsOption(&argc, argv);
+	int type = opf_ReadDistanceTypeOption(&argc, argv);
+
 	if (argc != 4)
 	{
-		fprintf(stderr, "\nusage opf_distance <P1> <P2> <P3>");
+		fprintf(stderr, "\nusage opf_distance [-t <nthreads>] [-f <float32|float16|uint16|uint8>] <P1> <P2> <P3>");
+		fprintf(stderr, "\n-t: number of threads (default 1)");
+		fprintf(stderr, "\n-f: type of the distances in the file (default float32). The uint types");
+		fprintf(stderr, "\n    quantize the distances between 0 and the largest one");
 		fprintf(stderr, "\nP1: Dataset in the OPF file format");
 		fprintf(stderr, "\nP2: Distance ID\n");
 		fprintf(stderr, "\n	1 - Euclidean");
@@ -29,147 +95,80 @@ int main(int argc, char **argv)
 	}
 
 	Subgraph *sg = ReadSubgraph(argv[1]);
-	FILE *fp = fopen("distances.dat", "wb");
-	int i, j, distance = atoi(argv[2]), normalize = atoi(argv[3]);
-	float **Distances = NULL, max = -FLT_MAX;
+	DistanceKernel kernel[7] = {DistKernels.eucl, DistKernels.chisquared, DistKernels.manhattan, DistKernels.canberra,
+								DistKernels.squaredchord, DistKernels.squaredchisquared, DistKernels.braycurtis};
+	char *name[7] = {"euclidean", "chi-square", "Manhattan", "Canberra", "Squared Chord", "Squared Chi-squared", "Bray Curtis"};
+	int i, p, distance = atoi(argv[2]), normalize = atoi(argv[3]), n = sg->nnodes, *node = NULL;
+	float max, vmax, scale, factor;
+	void **Distances = NULL;
 
-	fwrite(&sg->nnodes, sizeof(int), 1, fp);
+	if ((distance < 1) || (distance > 7))
+	{
+		fprintf(stderr, "\nInvalid distance ID ...\n");
+		exit(-1);
+	}
 
-	Distances = (float **)malloc(sg->nnodes * sizeof(float *));
-	for (i = 0; i < sg->nnodes; i++)
-		Distances[i] = (float *)malloc(sg->nnodes * sizeof(int));
+	/* the matrix is indexed by the positions of the samples: node[p] is
+	   the sample at position p */
+	node = AllocIntArray(n);
+	for (p = 0; p < n; p++)
+		node[p] = NIL;
+	for (i = 0; i < n; i++)
+	{
+		p = sg->node[i].position;
+		if ((p < 0) || (p >= n) || (node[p] != NIL))
+			Error("The positions of the samples are not 0, ..., n-1", "opf_distance");
+		node[p] = i;
+	}
 
-	switch (distance)
+	/* The distances are written straight into the mapped file, which
+	   holds the upper triangle of the matrix: each pair is computed once,
+	   as a float. Float distances are normalized by a second pass over the
+	   file. The other types need the largest distance, so they are
+	   converted afterwards, in place, and the file is cut to their size */
+	fprintf(stdout, "\n	Computing %s distance ...", name[distance - 1]);
+	fflush(stdout);
+	Distances = opf_CreateDistances("distances.dat", n, opf_DIST_FLOAT32, 1.0);
+	max = SweepTriangle(sg, node, kernel[distance - 1], Distances);
+	if (type == opf_DIST_FLOAT32)
 	{
-	case 1:
-		fprintf(stdout, "\n	Computing euclidean distance ...");
-		for (i = 0; i < sg->nnodes; i++)
-		{
-			for (j = 0; j < sg->nnodes; j++)
-			{
-				if (i == j)
-					Distances[i][j] = 0.0;
-				else
-					Distances[sg->node[i].position][sg->node[j].position] = opf_EuclDist(sg->node[i].feat, sg->node[j].feat, sg->nfeats);
-				if (Distances[sg->node[i].position][sg->node[j].position] > max)
-					max = Distances[sg->node[i].position][sg->node[j].position];
-			}
-		}
-		break;
-	case 2:
-		fprintf(stdout, "\n	Computing chi-square distance ...\n");
-		for (i = 0; i < sg->nnodes; i++)
-		{
-			for (j = 0; j < sg->nnodes; j++)
-			{
-				if (i == j)
-					Distances[i][j] = 0.0;
-				else
-					Distances[sg->node[i].position][sg->node[j].position] = opf_ChiSquaredDist(sg->node[i].feat, sg->node[j].feat, sg->nfeats);
-				if (Distances[sg->node[i].position][sg->node[j].position] > max)
-					max = Distances[sg->node[i].position][sg->node[j].position];
-			}
-		}
-		break;
-	case 3:
-		fprintf(stdout, "\n	Computing Manhattan distance ...\n");
-		for (i = 0; i < sg->nnodes; i++)
-		{
-			for (j = 0; j < sg->nnodes; j++)
-			{
-				if (i == j)
-					Distances[i][j] = 0.0;
-				else
-					Distances[sg->node[i].position][sg->node[j].position] = opf_ManhattanDist(sg->node[i].feat, sg->node[j].feat, sg->nfeats);
-				if (Distances[sg->node[i].position][sg->node[j].position] > max)
-					max = Distances[sg->node[i].position][sg->node[j].position];
-			}
-		}
-		break;
-	case 4:
-		fprintf(stdout, "\n	Computing Canberra distance ...\n");
-		for (i = 0; i < sg->nnodes; i++)
-		{
-			for (j = 0; j < sg->nnodes; j++)
-			{
-				if (i == j)
-					Distances[i][j] = 0.0;
-				else
-					Distances[sg->node[i].position][sg->node[j].position] = opf_CanberraDist(sg->node[i].feat, sg->node[j].feat, sg->nfeats);
-				if (Distances[sg->node[i].position][sg->node[j].position] > max)
-					max = Distances[sg->node[i].position][sg->node[j].position];
-			}
-		}
-		break;
-	case 5:
-		fprintf(stdout, "\n	Computing Squared Chord distance ...\n");
-		for (i = 0; i < sg->nnodes; i++)
+		if (normalize)
 		{
-			for (j = 0; j < sg->nnodes; j++)
+#pragma omp parallel for if (opf_NumThreads > 1) num_threads(opf_NumThreads) schedule(dynamic, BLOCK)
+			for (p = 0; p < n; p++)
 			{
-				if (i == j)
-					Distances[i][j] = 0.0;
-				else
-					Distances[sg->node[i].position][sg->node[j].position] = opf_SquaredChordDist(sg->node[i].feat, sg->node[j].feat, sg->nfeats);
-				if (Distances[sg->node[i].position][sg->node[j].position] > max)
-					max = Distances[sg->node[i].position][sg->node[j].position];
-			}
-		}
-		break;
-	case 6:
-		fprintf(stdout, "\n	Computing Squared Chi-squared distance ...\n");
-		for (i = 0; i < sg->nnodes; i++)
-		{
-			for (j = 0; j < sg->nnodes; j++)
-			{
-				if (i == j)
-					Distances[i][j] = 0.0;
-				else
-					Distances[sg->node[i].position][sg->node[j].position] = opf_SquaredChiSquaredDist(sg->node[i].feat, sg->node[j].feat, sg->nfeats);
-				if (Distances[sg->node[i].position][sg->node[j].position] > max)
-					max = Distances[sg->node[i].position][sg->node[j].position];
-			}
-		}
-		break;
-	case 7:
-		fprintf(stdout, "\n	Computing Bray Curtis distance ...\n");
-		for (i = 0; i < sg->nnodes; i++)
-		{
-			for (j = 0; j < sg->nnodes; j++)
-			{
-				if (i == j)
-					Distances[i][j] = 0.0;
-				else
-					Distances[sg->node[i].position][sg->node[j].position] = opf_BrayCurtisDist(sg->node[i].feat, sg->node[j].feat, sg->nfeats);
-				if (Distances[sg->node[i].position][sg->node[j].position] > max)
-					max = Distances[sg->node[i].position][sg->node[j].position];
+				int q;
+
+				for (q = p; q < n; q++)
+					((float *)Distances[p])[q] /= max;
 			}
 		}
-		break;
-	default:
-		fprintf(stderr, "\nInvalid distance ID ...\n");
 	}
-
-	if (!normalize)
-		max = 1.0;
-	for (i = 0; i < sg->nnodes; i++)
+	else
 	{
-		for (j = 0; j < sg->nnodes; j++)
+		vmax = normalize ? 1.0 : max; // largest distance in the file
+		if (type == opf_DIST_FLOAT16)
+			scale = (vmax > HALF_MAX) ? vmax / HALF_MAX : 1.0;
+		else
+			scale = vmax / ((type == opf_DIST_UINT16) ? 65535.0 : 255.0);
+		factor = (vmax / max) / scale;
+		if ((max == 0.0) || (scale == 0.0)) // all the distances are 0
 		{
-			Distances[i][j] /= max;
-			fwrite(&Distances[i][j], sizeof(float), 1, fp);
+			factor = 0.0;
+			scale = 1.0;
 		}
+		ReduceTriangle(Distances, n, type, factor);
+		opf_RetypeDistances("distances.dat", &Distances, n, type, scale);
+		fprintf(stdout, "\n	Distances stored as %s, with scale %g", (type == opf_DIST_FLOAT16) ? "float16" : ((type == opf_DIST_UINT16) ? "uint16" : "uint8"), scale);
 	}
 
 	fprintf(stdout, "\n\nDistances generated ...\n");
 	fflush(stdout);
 	fprintf(stdout, "\n\nDeallocating memory ...\n");
-	for (i = 0; i < sg->nnodes; i++)
-		free(Distances[i]);
-	free(Distances);
+	opf_DestroyDistances(&Distances, n);
+	free(node);
 
 	DestroySubgraph(&sg);
-	fclose(fp);
 
 	return 0;
 }
@@ -11,18 +11,21 @@ int main(int argc, char **argv)
 	fprintf(stdout, "\n");
 	fflush(stdout);
 
+	opf_ReadDistanceCacheOption(&argc, argv);
+
 	if ((argc != 3) && (argc != 4))
 	{
-		fprintf(stderr, "\nusage opf_learn <P1> <P2> <P3>");
+		fprintf(stderr, "\nusage opf_learn [-c <megabytes>] <P1> <P2> <P3>");
 		fprintf(stderr, "\nP1: training set in the OPF file format");
 		fprintf(stderr, "\nP2: evaluation set in the OPF file format");
-		fprintf(stderr, "\nP3: precomputed distance file (leave it in blank if you are not using this resource\n");
+		fprintf(stderr, "\nP3: precomputed distance file (leave it in blank if you are not using this resource)");
+		fprintf(stderr, "\n-c: size in megabytes of the cache of the computed distances (optional, default none; the positions of the samples must identify them in every set)\n");
 		exit(-1);
 	}
 
 	float Acc, time;
 	char fileName[512];
-	int i, n;
+	int n;
 	timer tic, toc;
 	FILE *f = NULL;
 
@@ -36,6 +39,8 @@ int main(int argc, char **argv)
 
 	if (opf_PrecomputedDistance)
 		opf_DistanceValue = opf_ReadDistances(argv[3], &n);
+	else
+		opf_CreateDistanceCache(gTrain, gEval);
 
 	fprintf(stdout, "\nLearning from errors in the evaluation set...");
 	fflush(stdout);
@@ -48,6 +53,7 @@ int main(int argc, char **argv)
 	fflush(stdout);
 	Acc = opf_Accuracy(gEval);
 	fprintf(stdout, "\nFinal opf_Accuracy in the evaluation set: %.2f%%", Acc * 100);
+	opf_WriteDistanceCacheStats(stdout);
 	fflush(stdout);
 
 	fprintf(stdout, "\n\nWriting classifier's model file ...");
@@ -60,11 +66,8 @@ int main(int argc, char **argv)
 	DestroySubgraph(&gTrain);
 	DestroySubgraph(&gEval);
 	if (opf_PrecomputedDistance)
-	{
-		for (i = 0; i < n; i++)
-			free(opf_DistanceValue[i]);
-		free(opf_DistanceValue);
-	}
+		opf_DestroyDistances(&opf_DistanceValue, n);
+	DestroyDistCache(&opf_DistanceCache);
 	fprintf(stdout, " OK\n");
 	fflush(stdout);
 
@@ -11,17 +11,20 @@ int main(int argc, char **argv)
 	fprintf(stdout, "\n");
 	fflush(stdout);
 
+	opf_ReadDistanceCacheOption(&argc, argv);
+
 	if ((argc != 5) && (argc != 4))
 	{
-		fprintf(stderr, "\nusage opf_classify <P1> <P2>");
+		fprintf(stderr, "\nusage opf_pruning [-c <megabytes>] <P1> <P2> <P3> <P4>");
 		fprintf(stderr, "\nP1: training set in the OPF file format");
 		fprintf(stderr, "\nP2: evaluating set in the OPF file format");
 		fprintf(stderr, "\nP3: percentage of accuracy [0,1]");
-		fprintf(stderr, "\nP4: precomputed distance file (leave it in blank if you are not using this resource\n");
+		fprintf(stderr, "\nP4: precomputed distance file (leave it in blank if you are not using this resource)");
+		fprintf(stderr, "\n-c: size in megabytes of the cache of the computed distances (optional, default none; the positions of the samples must identify them in every set)\n");
 		exit(-1);
 	}
 
-	int n, i, isize, fsize;
+	int n, isize, fsize;
 	float time, desiredAcc = atof(argv[3]), prate;
 	char fileName[256];
 	FILE *f = NULL;
@@ -37,6 +40,8 @@ int main(int argc, char **argv)
 
 	if (opf_PrecomputedDistance)
 		opf_DistanceValue = opf_ReadDistances(argv[2], &n);
+	else
+		opf_CreateDistanceCache(gTrain, gEval);
 
 	isize = gTrain->nnodes;
 	fprintf(stdout, "\nPruning training set ...");
@@ -65,7 +70,9 @@ int main(int argc, char **argv)
 	fclose(f);
 
 	time = ((toc.tv_sec - tic.tv_sec) * 1000.0 + (toc.tv_usec - tic.tv_usec) * 0.001) / 1000.0;
-	fprintf(stdout, "\nPruning time: %f seconds\n", time);
+	fprintf(stdout, "\nPruning time: %f seconds", time);
+	opf_WriteDistanceCacheStats(stdout);
+	fprintf(stdout, "\n");
 	fflush(stdout);
 	sprintf(fileName, "%s.time", argv[1]);
 	f = fopen(fileName, "a");
@@ -76,11 +83,8 @@ int main(int argc, char **argv)
 	DestroySubgraph(&gTrain);
 	DestroySubgraph(&gEval);
 	if (opf_PrecomputedDistance)
-	{
-		for (i = 0; i < n; i++)
-			free(opf_DistanceValue[i]);
-		free(opf_DistanceValue);
-	}
+		opf_DestroyDistances(&opf_DistanceValue, n);
+	DestroyDistCache(&opf_DistanceCache);
 	fprintf(stdout, " OK\n");
 
 	return 0;
@@ -89,11 +89,7 @@ int main(int argc, char **argv)
   fflush(stdout);
   DestroySubgraph(&s);
   if (opf_PrecomputedDistance)
-  {
-    for (i = 0; i < n; i++)
-      free(opf_DistanceValue[i]);
-    free(opf_DistanceValue);
-  }
+    opf_DestroyDistances(&opf_DistanceValue, n);
   fprintf(stdout, " OK\n");
 
   time = ((toc.tv_sec - tic.tv_sec) * 1000.0 + (toc.tv_usec - tic.tv_usec) * 0.001) / 1000.0;
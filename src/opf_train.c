@@ -11,11 +11,16 @@ int main(int argc, char **argv)
 	fprintf(stdout, "\n");
 	fflush(stdout);
 
+	opf_ReadThreadsOption(&argc, argv);
+	opf_ReadPivotsOption(&argc, argv);
+
 	if ((argc != 3) && (argc != 2))
 	{
-		fprintf(stderr, "\nusage opf_train <P1> <P2>");
+		fprintf(stderr, "\nusage opf_train [-t <nthreads>] [-p <npivots>] <P1> <P2>");
 		fprintf(stderr, "\nP1: training set in the OPF file format");
-		fprintf(stderr, "\nP2: precomputed distance file (leave it in blank if you are not using this resource)\n");
+		fprintf(stderr, "\nP2: precomputed distance file (leave it in blank if you are not using this resource)");
+		fprintf(stderr, "\n-t: number of threads used by the training (optional, default 1)");
+		fprintf(stderr, "\n-p: number of pivots of the lower-bound index stored in the model to speed up opf_classify (optional, default 0: no index)\n");
 		exit(-1);
 	}
 
@@ -65,11 +70,7 @@ int main(int argc, char **argv)
 	fflush(stdout);
 	DestroySubgraph(&g);
 	if (opf_PrecomputedDistance)
-	{
-		for (i = 0; i < n; i++)
-			free(opf_DistanceValue[i]);
-		free(opf_DistanceValue);
-	}
+		opf_DestroyDistances(&opf_DistanceValue, n);
 	fprintf(stdout, " OK\n");
 
 	time = ((toc.tv_sec - tic.tv_sec) * 1000.0 + (toc.tv_usec - tic.tv_usec) * 0.001) / 1000.0;
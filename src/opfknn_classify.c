@@ -11,11 +11,14 @@ int main(int argc, char **argv)
 	fprintf(stdout, "\n");
 	fflush(stdout);
 
+	opf_ReadThreadsOption(&argc, argv);
+
 	if ((argc != 3) && (argc != 2))
 	{
-		fprintf(stderr, "\nusage opfknn_classify <P1> <P2>");
+		fprintf(stderr, "\nusage opfknn_classify [-t <nthreads>] <P1> <P2>");
 		fprintf(stderr, "\nP1: test set in the OPF file format");
-		fprintf(stderr, "\nP2: precomputed distance file (leave it in blank if you are not using this resource\n");
+		fprintf(stderr, "\nP2: precomputed distance file (leave it in blank if you are not using this resource");
+		fprintf(stderr, "\n-t: number of threads used by the classification (optional, default 1)\n");
 		exit(-1);
 	}
 
@@ -24,6 +27,7 @@ int main(int argc, char **argv)
 	char fileName[256];
 	FILE *f = NULL;
 	timer tic, toc;
+	opf_ThreadStats *stats = opf_CreateThreadStats(opf_NumThreads);
 
 	if (argc == 3)
 		opf_PrecomputedDistance = 1;
@@ -39,7 +43,7 @@ int main(int argc, char **argv)
 	fprintf(stdout, "\nClassifying test set ...");
 	fflush(stdout);
 	gettimeofday(&tic, NULL);
-	opf_OPFknnClassify(gTrain, gTest);
+	opf_OPFknnClassifyParallel(gTrain, gTest, opf_NumThreads, stats);
 	gettimeofday(&toc, NULL);
 	fprintf(stdout, " OK");
 	fflush(stdout);
@@ -58,16 +62,16 @@ int main(int argc, char **argv)
 	DestroySubgraph(&gTrain);
 	DestroySubgraph(&gTest);
 	if (opf_PrecomputedDistance)
-	{
-		for (i = 0; i < n; i++)
-			free(opf_DistanceValue[i]);
-		free(opf_DistanceValue);
-	}
+		opf_DestroyDistances(&opf_DistanceValue, n);
 	fprintf(stdout, " OK\n");
 
 	time = ((toc.tv_sec - tic.tv_sec) * 1000.0 + (toc.tv_usec - tic.tv_usec) * 0.001) / 1000.0;
 	fprintf(stdout, "\nTesting time: %f seconds\n", time);
+	if (stats->nthreads > 1)
+		for (i = 0; i < stats->nthreads; i++)
+			fprintf(stdout, "Thread %d: %d samples in %f seconds\n", i, stats->nsamples[i], stats->time[i]);
 	fflush(stdout);
+	opf_DestroyThreadStats(&stats);
 
 	sprintf(fileName, "%s.time", argv[1]);
 	f = fopen(fileName, "a");
@@ -11,13 +11,21 @@ int main(int argc, char **argv)
 	fprintf(stdout, "\n");
 	fflush(stdout);
 
+	opf_ReadKnnOption(&argc, argv);
+	opf_ReadQueueOption(&argc, argv);
+	opf_ReadDistanceCacheOption(&argc, argv);
+
 	if ((argc != 5) && (argc != 4))
 	{
-		fprintf(stderr, "\nusage opf_train <P1> <P2>");
+		fprintf(stderr, "\nusage opfknn_train [-a <brute|kdtree|vptree|index|approx>] [-r <recall>] [-q <heap|bucket>] [-c <megabytes>] <P1> <P2> <P3> <P4>");
 		fprintf(stderr, "\nP1: training set in the OPF file format");
 		fprintf(stderr, "\nP2: evaluating set in the OPF file format (used to learn k)");
 		fprintf(stderr, "\nP3: kmax");
-		fprintf(stderr, "\nP4: precomputed distance file (leave it in blank if you are not using this resource)\n");
+		fprintf(stderr, "\nP4: precomputed distance file (leave it in blank if you are not using this resource)");
+		fprintf(stderr, "\n-a: search of the knn graph (optional, default brute: scan of all the nodes; the exact k-d tree and VP-tree give the same graph, approx builds an approximate graph)");
+		fprintf(stderr, "\n-r: recall target of the approximate graph in (0-1] (optional, default 0.95)");
+		fprintf(stderr, "\n-q: priority queue of the clustering (optional, default heap; bucket rounds the densities to integers and updates in O(1))");
+		fprintf(stderr, "\n-c: size in megabytes of the cache of the computed distances (optional, default none; the positions of the samples must identify them in every set; the knn searches then scan the nodes whatever -a is)\n");
 		exit(-1);
 	}
 
@@ -39,6 +47,8 @@ int main(int argc, char **argv)
 
 	if (opf_PrecomputedDistance)
 		opf_DistanceValue = opf_ReadDistances(argv[4], &n);
+	else
+		opf_CreateDistanceCache(Train, Eval);
 
 	fprintf(stdout, "\nTraining OPF classifier ...");
 	fflush(stdout);
@@ -46,6 +56,8 @@ int main(int argc, char **argv)
 	opf_OPFknnTraining(Train, Eval, kmax);
 	gettimeofday(&toc, NULL);
 	fprintf(stdout, " OK");
+	if (opf_KnnMeasuredRecall >= 0)
+		fprintf(stdout, "\nRecall of the approximate knn graph on a sample: %.4f", opf_KnnMeasuredRecall);
 	fflush(stdout);
 
 	fprintf(stdout, "\nWriting classifier's model file ...");
@@ -64,16 +76,14 @@ int main(int argc, char **argv)
 	fprintf(stdout, " OK");
 	fflush(stdout);
 
+	opf_WriteDistanceCacheStats(stdout);
 	fprintf(stdout, "\nDeallocating memory ...");
 	fflush(stdout);
 	DestroySubgraph(&Train);
 	DestroySubgraph(&Eval);
 	if (opf_PrecomputedDistance)
-	{
-		for (i = 0; i < n; i++)
-			free(opf_DistanceValue[i]);
-		free(opf_DistanceValue);
-	}
+		opf_DestroyDistances(&opf_DistanceValue, n);
+	DestroyDistCache(&opf_DistanceCache);
 	fprintf(stdout, " OK\n");
 
 	time = ((toc.tv_sec - tic.tv_sec) * 1000.0 + (toc.tv_usec - tic.tv_usec) * 0.001) / 1000.0;
@@ -0,0 +1,1078 @@
+/*
+  Copyright (C) <2009> <Alexandre Xavier Falcão and João Paulo Papa>
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+  please see full copyright in COPYING file.
+  -------------------------------------------------------------------------
+
+  Distance kernels between feature vectors, and the sums of
+  exponentials of the densities, for the scalar, SSE4, AVX2
+  and AVX-512 instruction sets. The vector kernels are compiled with
+  target attributes, so the library does not need to be built for a
+  specific CPU: the kernels are chosen at startup by CPUID.
+
+  Every distance kernel but chi-squared adds non-negative terms, so its
+  partial sums never decrease. Every DIST_CHECKPOINT features the partial
+  sum is compared with the bound, and the kernel stops as soon as it is
+  above it. The checks do not change the order of the sums, so a
+  distance that is not above the bound is the same as without bound.
+  The chi-squared terms are negative where f1[i] + f2[i] < 0, as with
+  normalized features, so the chi-squared kernels ignore the bound. */
+
+#include "distance.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMD_X86
+#endif
+
+#define DIST_CHECKPOINT 64 //features between two comparisons with the bound (a power of 2)
+
+/* Exponential of the vector ExpSum kernels (Cephes expf): x = n ln2 + r,
+   with |r| <= ln2/2, and exp(r) by a polynomial of degree 7. Every
+   vector level evaluates it by the same float operations. Arguments
+   below EXP_MINARG (ln FLT_MIN) give 0 and arguments above EXP_MAXARG
+   are clamped. The scalar ExpSum kernel is the reference: it uses the
+   double precision exp and adds in the order of the former loops, so
+   the densities are the same as before the kernels existed. */
+#define EXP_LOG2E  1.44269504088896341f
+#define EXP_C1     0.693359375f
+#define EXP_C2     -2.12194440e-4f
+#define EXP_MINARG -87.3365447f
+#define EXP_MAXARG 88.0f
+#define EXP_P0     1.9875691500e-4f
+#define EXP_P1     1.3981999507e-3f
+#define EXP_P2     8.3334519073e-3f
+#define EXP_P3     4.1665795894e-2f
+#define EXP_P4     1.6666665459e-1f
+#define EXP_P5     5.0000001201e-1f
+
+/*------------ Scalar kernels ------------------------------ */
+
+static float EuclDistScalar(float *f1, float *f2, int n, float bound)
+{
+  int i;
+  float dist = 0.0f;
+
+  for (i = 0; i < n; i++)
+  {
+    dist += (f1[i] - f2[i]) * (f1[i] - f2[i]);
+    if ((((i + 1) & (DIST_CHECKPOINT - 1)) == 0) && (dist > bound))
+      return (dist);
+  }
+
+  return (dist);
+}
+
+static float ChiSquaredDistScalar(float *f1, float *f2, int n, float bound)
+{
+  int i;
+  float dist = 0.0f, sf1 = 0.0f, sf2 = 0.0f;
+
+  for (i = 0; i < n; i++)
+  {
+    sf1 += f1[i];
+    sf2 += f2[i];
+  }
+
+  for (i = 0; i < n; i++)
+    dist += 1 / (f1[i] + f2[i] + 0.000000001) * pow(f1[i] / sf1 - f2[i] / sf2, 2);
+
+  return (sqrtf(dist));
+}
+
+static float ManhattanDistScalar(float *f1, float *f2, int n, float bound)
+{
+  int i;
+  float dist = 0.0f;
+
+  for (i = 0; i < n; i++)
+  {
+    dist += fabs(f1[i] - f2[i]);
+    if ((((i + 1) & (DIST_CHECKPOINT - 1)) == 0) && (dist > bound))
+      return (dist);
+  }
+
+  return (dist);
+}
+
+static float CanberraDistScalar(float *f1, float *f2, int n, float bound)
+{
+  int i;
+  float dist = 0.0f, aux;
+
+  for (i = 0; i < n; i++)
+  {
+    aux = fabs(f1[i] + f2[i]);
+    if (aux > 0)
+      dist += (fabs(f1[i] - f2[i]) / aux);
+    if ((((i + 1) & (DIST_CHECKPOINT - 1)) == 0) && (dist > bound))
+      return (dist);
+  }
+
+  return (dist);
+}
+
+static float SquaredChordDistScalar(float *f1, float *f2, int n, float bound)
+{
+  int i;
+  float dist = 0.0f, aux1, aux2;
+
+  for (i = 0; i < n; i++)
+  {
+    aux1 = sqrtf(f1[i]);
+    aux2 = sqrtf(f2[i]);
+
+    if ((aux1 >= 0) && (aux2 >= 0))
+      dist += pow(aux1 - aux2, 2);
+    if ((((i + 1) & (DIST_CHECKPOINT - 1)) == 0) && (dist > bound))
+      return (dist);
+  }
+
+  return (dist);
+}
+
+static float SquaredChiSquaredDistScalar(float *f1, float *f2, int n, float bound)
+{
+  int i;
+  float dist = 0.0f, aux;
+
+  for (i = 0; i < n; i++)
+  {
+    aux = fabs(f1[i] + f2[i]);
+    if (aux > 0)
+      dist += (pow(f1[i] - f2[i], 2) / aux);
+    if ((((i + 1) & (DIST_CHECKPOINT - 1)) == 0) && (dist > bound))
+      return (dist);
+  }
+
+  return (dist);
+}
+
+static float BrayCurtisDistScalar(float *f1, float *f2, int n, float bound)
+{
+  int i;
+  float dist = 0.0f, aux;
+
+  for (i = 0; i < n; i++)
+  {
+    aux = f1[i] + f2[i];
+    if (aux > 0)
+      dist += (fabs(f1[i] - f2[i]) / aux);
+    if ((((i + 1) & (DIST_CHECKPOINT - 1)) == 0) && (dist > bound))
+      return (dist);
+  }
+
+  return (dist);
+}
+
+static float ExpScalar(float x)
+{
+  union { float f; int i; } e;
+  float n, r, p;
+  int k;
+
+  if (x < EXP_MINARG)
+    return 0.0f;
+  if (x > EXP_MAXARG)
+    x = EXP_MAXARG;
+  n = x * EXP_LOG2E + 0.5f;
+  k = (int)n; // floor of n, without calling floorf
+  if ((float)k > n)
+    k--;
+  n = (float)k;
+  r = x - n * EXP_C1;
+  r = r - n * EXP_C2;
+  p = EXP_P0;
+  p = p * r + EXP_P1;
+  p = p * r + EXP_P2;
+  p = p * r + EXP_P3;
+  p = p * r + EXP_P4;
+  p = p * r + EXP_P5;
+  p = p * (r * r) + r + 1.0f;
+  e.i = (k + 127) << 23;
+
+  return p * e.f;
+}
+
+static float ExpSumScalar(float *x, int n, float k)
+{
+  int i;
+  float sum = 0.0f;
+
+  for (i = 0; i < n; i++)
+    sum += exp(-x[i] / k);
+
+  return (sum);
+}
+
+#ifdef SIMD_X86
+
+/*------------ SSE4 kernels ------------------------------ */
+
+__attribute__((target("sse4.1"))) static inline float HSumSSE4(__m128 v)
+{
+  v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+  v = _mm_add_ss(v, _mm_shuffle_ps(v, v, 0x55));
+  return _mm_cvtss_f32(v);
+}
+
+__attribute__((target("sse4.1"))) static inline __m128 AbsSSE4(__m128 v)
+{
+  return _mm_andnot_ps(_mm_set1_ps(-0.0f), v);
+}
+
+__attribute__((target("sse4.1"))) static inline double HSumPdSSE4(__m128d v)
+{
+  return _mm_cvtsd_f64(_mm_add_sd(v, _mm_unpackhi_pd(v, v)));
+}
+
+// Chi-squared terms d^2 / (s + 1e-9) of the two low lanes, in double as in the scalar kernel
+__attribute__((target("sse4.1"))) static inline __m128d ChiSquaredTermsSSE4(__m128 d, __m128 s)
+{
+  __m128d dd = _mm_cvtps_pd(d);
+
+  return _mm_div_pd(_mm_mul_pd(dd, dd), _mm_add_pd(_mm_cvtps_pd(s), _mm_set1_pd(0.000000001)));
+}
+
+__attribute__((target("sse4.1"))) static float EuclDistSSE4(float *f1, float *f2, int n, float bound)
+{
+  __m128 acc = _mm_setzero_ps(), d;
+  float dist;
+  int i;
+
+  for (i = 0; i + 4 <= n; i += 4)
+  {
+    d = _mm_sub_ps(_mm_loadu_ps(f1 + i), _mm_loadu_ps(f2 + i));
+    acc = _mm_add_ps(acc, _mm_mul_ps(d, d));
+    if ((((i + 4) & (DIST_CHECKPOINT - 1)) == 0) && (HSumSSE4(acc) > bound))
+      return (HSumSSE4(acc));
+  }
+  dist = HSumSSE4(acc);
+  for (; i < n; i++)
+    dist += (f1[i] - f2[i]) * (f1[i] - f2[i]);
+
+  return (dist);
+}
+
+__attribute__((target("sse4.1"))) static float ChiSquaredDistSSE4(float *f1, float *f2, int n, float bound)
+{
+  __m128 s1 = _mm_setzero_ps(), s2 = _mm_setzero_ps(), a, b, d, s, v1, v2;
+  __m128d acc = _mm_setzero_pd();
+  double dist;
+  float sf1, sf2;
+  int i;
+
+  for (i = 0; i + 4 <= n; i += 4)
+  {
+    s1 = _mm_add_ps(s1, _mm_loadu_ps(f1 + i));
+    s2 = _mm_add_ps(s2, _mm_loadu_ps(f2 + i));
+  }
+  sf1 = HSumSSE4(s1);
+  sf2 = HSumSSE4(s2);
+  for (; i < n; i++)
+  {
+    sf1 += f1[i];
+    sf2 += f2[i];
+  }
+
+  v1 = _mm_set1_ps(sf1);
+  v2 = _mm_set1_ps(sf2);
+  for (i = 0; i + 4 <= n; i += 4)
+  {
+    a = _mm_loadu_ps(f1 + i);
+    b = _mm_loadu_ps(f2 + i);
+    d = _mm_sub_ps(_mm_div_ps(a, v1), _mm_div_ps(b, v2));
+    s = _mm_add_ps(a, b);
+    acc = _mm_add_pd(acc, ChiSquaredTermsSSE4(d, s));
+    acc = _mm_add_pd(acc, ChiSquaredTermsSSE4(_mm_movehl_ps(d, d), _mm_movehl_ps(s, s)));
+  }
+  dist = HSumPdSSE4(acc);
+  for (; i < n; i++)
+    dist += 1 / (f1[i] + f2[i] + 0.000000001) * pow(f1[i] / sf1 - f2[i] / sf2, 2);
+
+  return (sqrtf(dist));
+}
+
+__attribute__((target("sse4.1"))) static float ManhattanDistSSE4(float *f1, float *f2, int n, float bound)
+{
+  __m128 acc = _mm_setzero_ps();
+  float dist;
+  int i;
+
+  for (i = 0; i + 4 <= n; i += 4)
+  {
+    acc = _mm_add_ps(acc, AbsSSE4(_mm_sub_ps(_mm_loadu_ps(f1 + i), _mm_loadu_ps(f2 + i))));
+    if ((((i + 4) & (DIST_CHECKPOINT - 1)) == 0) && (HSumSSE4(acc) > bound))
+      return (HSumSSE4(acc));
+  }
+  dist = HSumSSE4(acc);
+  for (; i < n; i++)
+    dist += fabsf(f1[i] - f2[i]);
+
+  return (dist);
+}
+
+__attribute__((target("sse4.1"))) static float CanberraDistSSE4(float *f1, float *f2, int n, float bound)
+{
+  __m128 acc = _mm_setzero_ps(), a, b, aux, zero = _mm_setzero_ps();
+  float dist, s;
+  int i;
+
+  for (i = 0; i + 4 <= n; i += 4)
+  {
+    a = _mm_loadu_ps(f1 + i);
+    b = _mm_loadu_ps(f2 + i);
+    aux = AbsSSE4(_mm_add_ps(a, b));
+    acc = _mm_add_ps(acc, _mm_and_ps(_mm_cmpgt_ps(aux, zero),
+                                     _mm_div_ps(AbsSSE4(_mm_sub_ps(a, b)), aux)));
+    if ((((i + 4) & (DIST_CHECKPOINT - 1)) == 0) && (HSumSSE4(acc) > bound))
+      return (HSumSSE4(acc));
+  }
+  dist = HSumSSE4(acc);
+  for (; i < n; i++)
+  {
+    s = fabsf(f1[i] + f2[i]);
+    if (s > 0)
+      dist += fabsf(f1[i] - f2[i]) / s;
+  }
+
+  return (dist);
+}
+
+__attribute__((target("sse4.1"))) static float SquaredChordDistSSE4(float *f1, float *f2, int n, float bound)
+{
+  __m128 acc = _mm_setzero_ps(), a, b, d, zero = _mm_setzero_ps();
+  float dist, r1, r2;
+  int i;
+
+  for (i = 0; i + 4 <= n; i += 4)
+  {
+    a = _mm_loadu_ps(f1 + i);
+    b = _mm_loadu_ps(f2 + i);
+    d = _mm_sub_ps(_mm_sqrt_ps(a), _mm_sqrt_ps(b));
+    acc = _mm_add_ps(acc, _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(a, zero), _mm_cmpge_ps(b, zero)),
+                                     _mm_mul_ps(d, d)));
+    if ((((i + 4) & (DIST_CHECKPOINT - 1)) == 0) && (HSumSSE4(acc) > bound))
+      return (HSumSSE4(acc));
+  }
+  dist = HSumSSE4(acc);
+  for (; i < n; i++)
+  {
+    r1 = sqrtf(f1[i]);
+    r2 = sqrtf(f2[i]);
+    if ((r1 >= 0) && (r2 >= 0))
+      dist += (r1 - r2) * (r1 - r2);
+  }
+
+  return (dist);
+}
+
+__attribute__((target("sse4.1"))) static float SquaredChiSquaredDistSSE4(float *f1, float *f2, int n, float bound)
+{
+  __m128 acc = _mm_setzero_ps(), a, b, d, aux, zero = _mm_setzero_ps();
+  float dist, s;
+  int i;
+
+  for (i = 0; i + 4 <= n; i += 4)
+  {
+    a = _mm_loadu_ps(f1 + i);
+    b = _mm_loadu_ps(f2 + i);
+    d = _mm_sub_ps(a, b);
+    aux = AbsSSE4(_mm_add_ps(a, b));
+    acc = _mm_add_ps(acc, _mm_and_ps(_mm_cmpgt_ps(aux, zero), _mm_div_ps(_mm_mul_ps(d, d), aux)));
+    if ((((i + 4) & (DIST_CHECKPOINT - 1)) == 0) && (HSumSSE4(acc) > bound))
+      return (HSumSSE4(acc));
+  }
+  dist = HSumSSE4(acc);
+  for (; i < n; i++)
+  {
+    s = fabsf(f1[i] + f2[i]);
+    if (s > 0)
+      dist += (f1[i] - f2[i]) * (f1[i] - f2[i]) / s;
+  }
+
+  return (dist);
+}
+
+__attribute__((target("sse4.1"))) static float BrayCurtisDistSSE4(float *f1, float *f2, int n, float bound)
+{
+  __m128 acc = _mm_setzero_ps(), a, b, aux, zero = _mm_setzero_ps();
+  float dist, s;
+  int i;
+
+  for (i = 0; i + 4 <= n; i += 4)
+  {
+    a = _mm_loadu_ps(f1 + i);
+    b = _mm_loadu_ps(f2 + i);
+    aux = _mm_add_ps(a, b);
+    acc = _mm_add_ps(acc, _mm_and_ps(_mm_cmpgt_ps(aux, zero),
+                                     _mm_div_ps(AbsSSE4(_mm_sub_ps(a, b)), aux)));
+    if ((((i + 4) & (DIST_CHECKPOINT - 1)) == 0) && (HSumSSE4(acc) > bound))
+      return (HSumSSE4(acc));
+  }
+  dist = HSumSSE4(acc);
+  for (; i < n; i++)
+  {
+    s = f1[i] + f2[i];
+    if (s > 0)
+      dist += fabsf(f1[i] - f2[i]) / s;
+  }
+
+  return (dist);
+}
+
+__attribute__((target("sse4.1"))) static inline __m128 ExpSSE4(__m128 x)
+{
+  __m128 n, r, p, valid = _mm_cmpge_ps(x, _mm_set1_ps(EXP_MINARG));
+  __m128i e;
+
+  x = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(EXP_MINARG)), _mm_set1_ps(EXP_MAXARG));
+  n = _mm_floor_ps(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(EXP_LOG2E)), _mm_set1_ps(0.5f)));
+  r = _mm_sub_ps(x, _mm_mul_ps(n, _mm_set1_ps(EXP_C1)));
+  r = _mm_sub_ps(r, _mm_mul_ps(n, _mm_set1_ps(EXP_C2)));
+  p = _mm_set1_ps(EXP_P0);
+  p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(EXP_P1));
+  p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(EXP_P2));
+  p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(EXP_P3));
+  p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(EXP_P4));
+  p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(EXP_P5));
+  p = _mm_add_ps(_mm_add_ps(_mm_mul_ps(p, _mm_mul_ps(r, r)), r), _mm_set1_ps(1.0f));
+  e = _mm_slli_epi32(_mm_add_epi32(_mm_cvtps_epi32(n), _mm_set1_epi32(127)), 23);
+
+  return _mm_and_ps(_mm_mul_ps(p, _mm_castsi128_ps(e)), valid);
+}
+
+__attribute__((target("sse4.1"))) static float ExpSumSSE4(float *x, int n, float k)
+{
+  float scale = 1.0f / k, sum;
+  __m128 acc = _mm_setzero_ps(), s = _mm_set1_ps(-scale);
+  int i;
+
+  for (i = 0; i + 4 <= n; i += 4)
+    acc = _mm_add_ps(acc, ExpSSE4(_mm_mul_ps(s, _mm_loadu_ps(x + i))));
+  sum = HSumSSE4(acc);
+  for (; i < n; i++)
+    sum += ExpScalar(-scale * x[i]);
+
+  return (sum);
+}
+
+/*------------ AVX2 kernels ------------------------------ */
+
+__attribute__((target("avx2"))) static inline float HSumAVX2(__m256 v)
+{
+  __m128 h = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+  h = _mm_add_ps(h, _mm_movehl_ps(h, h));
+  h = _mm_add_ss(h, _mm_shuffle_ps(h, h, 0x55));
+  return _mm_cvtss_f32(h);
+}
+
+__attribute__((target("avx2"))) static inline __m256 AbsAVX2(__m256 v)
+{
+  return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), v);
+}
+
+__attribute__((target("avx2"))) static inline double HSumPdAVX2(__m256d v)
+{
+  __m128d h = _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+  return _mm_cvtsd_f64(_mm_add_sd(h, _mm_unpackhi_pd(h, h)));
+}
+
+// Chi-squared terms d^2 / (s + 1e-9) of four lanes, in double as in the scalar kernel
+__attribute__((target("avx2"))) static inline __m256d ChiSquaredTermsAVX2(__m128 d, __m128 s)
+{
+  __m256d dd = _mm256_cvtps_pd(d);
+
+  return _mm256_div_pd(_mm256_mul_pd(dd, dd), _mm256_add_pd(_mm256_cvtps_pd(s), _mm256_set1_pd(0.000000001)));
+}
+
+__attribute__((target("avx2"))) static float EuclDistAVX2(float *f1, float *f2, int n, float bound)
+{
+  __m256 acc = _mm256_setzero_ps(), d;
+  float dist;
+  int i;
+
+  for (i = 0; i + 8 <= n; i += 8)
+  {
+    d = _mm256_sub_ps(_mm256_loadu_ps(f1 + i), _mm256_loadu_ps(f2 + i));
+    acc = _mm256_add_ps(acc, _mm256_mul_ps(d, d));
+    if ((((i + 8) & (DIST_CHECKPOINT - 1)) == 0) && (HSumAVX2(acc) > bound))
+      return (HSumAVX2(acc));
+  }
+  dist = HSumAVX2(acc);
+  for (; i < n; i++)
+    dist += (f1[i] - f2[i]) * (f1[i] - f2[i]);
+
+  return (dist);
+}
+
+__attribute__((target("avx2"))) static float ChiSquaredDistAVX2(float *f1, float *f2, int n, float bound)
+{
+  __m256 s1 = _mm256_setzero_ps(), s2 = _mm256_setzero_ps(), a, b, d, s, v1, v2;
+  __m256d acc = _mm256_setzero_pd();
+  double dist;
+  float sf1, sf2;
+  int i;
+
+  for (i = 0; i + 8 <= n; i += 8)
+  {
+    s1 = _mm256_add_ps(s1, _mm256_loadu_ps(f1 + i));
+    s2 = _mm256_add_ps(s2, _mm256_loadu_ps(f2 + i));
+  }
+  sf1 = HSumAVX2(s1);
+  sf2 = HSumAVX2(s2);
+  for (; i < n; i++)
+  {
+    sf1 += f1[i];
+    sf2 += f2[i];
+  }
+
+  v1 = _mm256_set1_ps(sf1);
+  v2 = _mm256_set1_ps(sf2);
+  for (i = 0; i + 8 <= n; i += 8)
+  {
+    a = _mm256_loadu_ps(f1 + i);
+    b = _mm256_loadu_ps(f2 + i);
+    d = _mm256_sub_ps(_mm256_div_ps(a, v1), _mm256_div_ps(b, v2));
+    s = _mm256_add_ps(a, b);
+    acc = _mm256_add_pd(acc, ChiSquaredTermsAVX2(_mm256_castps256_ps128(d), _mm256_castps256_ps128(s)));
+    acc = _mm256_add_pd(acc, ChiSquaredTermsAVX2(_mm256_extractf128_ps(d, 1), _mm256_extractf128_ps(s, 1)));
+  }
+  dist = HSumPdAVX2(acc);
+  for (; i < n; i++)
+    dist += 1 / (f1[i] + f2[i] + 0.000000001) * pow(f1[i] / sf1 - f2[i] / sf2, 2);
+
+  return (sqrtf(dist));
+}
+
+__attribute__((target("avx2"))) static float ManhattanDistAVX2(float *f1, float *f2, int n, float bound)
+{
+  __m256 acc = _mm256_setzero_ps();
+  float dist;
+  int i;
+
+  for (i = 0; i + 8 <= n; i += 8)
+  {
+    acc = _mm256_add_ps(acc, AbsAVX2(_mm256_sub_ps(_mm256_loadu_ps(f1 + i), _mm256_loadu_ps(f2 + i))));
+    if ((((i + 8) & (DIST_CHECKPOINT - 1)) == 0) && (HSumAVX2(acc) > bound))
+      return (HSumAVX2(acc));
+  }
+  dist = HSumAVX2(acc);
+  for (; i < n; i++)
+    dist += fabsf(f1[i] - f2[i]);
+
+  return (dist);
+}
+
+__attribute__((target("avx2"))) static float CanberraDistAVX2(float *f1, float *f2, int n, float bound)
+{
+  __m256 acc = _mm256_setzero_ps(), a, b, aux, zero = _mm256_setzero_ps();
+  float dist, s;
+  int i;
+
+  for (i = 0; i + 8 <= n; i += 8)
+  {
+    a = _mm256_loadu_ps(f1 + i);
+    b = _mm256_loadu_ps(f2 + i);
+    aux = AbsAVX2(_mm256_add_ps(a, b));
+    acc = _mm256_add_ps(acc, _mm256_and_ps(_mm256_cmp_ps(aux, zero, _CMP_GT_OQ),
+                                           _mm256_div_ps(AbsAVX2(_mm256_sub_ps(a, b)), aux)));
+    if ((((i + 8) & (DIST_CHECKPOINT - 1)) == 0) && (HSumAVX2(acc) > bound))
+      return (HSumAVX2(acc));
+  }
+  dist = HSumAVX2(acc);
+  for (; i < n; i++)
+  {
+    s = fabsf(f1[i] + f2[i]);
+    if (s > 0)
+      dist += fabsf(f1[i] - f2[i]) / s;
+  }
+
+  return (dist);
+}
+
+__attribute__((target("avx2"))) static float SquaredChordDistAVX2(float *f1, float *f2, int n, float bound)
+{
+  __m256 acc = _mm256_setzero_ps(), a, b, d, zero = _mm256_setzero_ps();
+  float dist, r1, r2;
+  int i;
+
+  for (i = 0; i + 8 <= n; i += 8)
+  {
+    a = _mm256_loadu_ps(f1 + i);
+    b = _mm256_loadu_ps(f2 + i);
+    d = _mm256_sub_ps(_mm256_sqrt_ps(a), _mm256_sqrt_ps(b));
+    acc = _mm256_add_ps(acc, _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(a, zero, _CMP_GE_OQ),
+                                                         _mm256_cmp_ps(b, zero, _CMP_GE_OQ)),
+                                           _mm256_mul_ps(d, d)));
+    if ((((i + 8) & (DIST_CHECKPOINT - 1)) == 0) && (HSumAVX2(acc) > bound))
+      return (HSumAVX2(acc));
+  }
+  dist = HSumAVX2(acc);
+  for (; i < n; i++)
+  {
+    r1 = sqrtf(f1[i]);
+    r2 = sqrtf(f2[i]);
+    if ((r1 >= 0) && (r2 >= 0))
+      dist += (r1 - r2) * (r1 - r2);
+  }
+
+  return (dist);
+}
+
+__attribute__((target("avx2"))) static float SquaredChiSquaredDistAVX2(float *f1, float *f2, int n, float bound)
+{
+  __m256 acc = _mm256_setzero_ps(), a, b, d, aux, zero = _mm256_setzero_ps();
+  float dist, s;
+  int i;
+
+  for (i = 0; i + 8 <= n; i += 8)
+  {
+    a = _mm256_loadu_ps(f1 + i);
+    b = _mm256_loadu_ps(f2 + i);
+    d = _mm256_sub_ps(a, b);
+    aux = AbsAVX2(_mm256_add_ps(a, b));
+    acc = _mm256_add_ps(acc, _mm256_and_ps(_mm256_cmp_ps(aux, zero, _CMP_GT_OQ),
+                                           _mm256_div_ps(_mm256_mul_ps(d, d), aux)));
+    if ((((i + 8) & (DIST_CHECKPOINT - 1)) == 0) && (HSumAVX2(acc) > bound))
+      return (HSumAVX2(acc));
+  }
+  dist = HSumAVX2(acc);
+  for (; i < n; i++)
+  {
+    s = fabsf(f1[i] + f2[i]);
+    if (s > 0)
+      dist += (f1[i] - f2[i]) * (f1[i] - f2[i]) / s;
+  }
+
+  return (dist);
+}
+
+__attribute__((target("avx2"))) static float BrayCurtisDistAVX2(float *f1, float *f2, int n, float bound)
+{
+  __m256 acc = _mm256_setzero_ps(), a, b, aux, zero = _mm256_setzero_ps();
+  float dist, s;
+  int i;
+
+  for (i = 0; i + 8 <= n; i += 8)
+  {
+    a = _mm256_loadu_ps(f1 + i);
+    b = _mm256_loadu_ps(f2 + i);
+    aux = _mm256_add_ps(a, b);
+    acc = _mm256_add_ps(acc, _mm256_and_ps(_mm256_cmp_ps(aux, zero, _CMP_GT_OQ),
+                                           _mm256_div_ps(AbsAVX2(_mm256_sub_ps(a, b)), aux)));
+    if ((((i + 8) & (DIST_CHECKPOINT - 1)) == 0) && (HSumAVX2(acc) > bound))
+      return (HSumAVX2(acc));
+  }
+  dist = HSumAVX2(acc);
+  for (; i < n; i++)
+  {
+    s = f1[i] + f2[i];
+    if (s > 0)
+      dist += fabsf(f1[i] - f2[i]) / s;
+  }
+
+  return (dist);
+}
+
+__attribute__((target("avx2"))) static inline __m256 ExpAVX2(__m256 x)
+{
+  __m256 n, r, p, valid = _mm256_cmp_ps(x, _mm256_set1_ps(EXP_MINARG), _CMP_GE_OQ);
+  __m256i e;
+
+  x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(EXP_MINARG)), _mm256_set1_ps(EXP_MAXARG));
+  n = _mm256_floor_ps(_mm256_add_ps(_mm256_mul_ps(x, _mm256_set1_ps(EXP_LOG2E)), _mm256_set1_ps(0.5f)));
+  r = _mm256_sub_ps(x, _mm256_mul_ps(n, _mm256_set1_ps(EXP_C1)));
+  r = _mm256_sub_ps(r, _mm256_mul_ps(n, _mm256_set1_ps(EXP_C2)));
+  p = _mm256_set1_ps(EXP_P0);
+  p = _mm256_add_ps(_mm256_mul_ps(p, r), _mm256_set1_ps(EXP_P1));
+  p = _mm256_add_ps(_mm256_mul_ps(p, r), _mm256_set1_ps(EXP_P2));
+  p = _mm256_add_ps(_mm256_mul_ps(p, r), _mm256_set1_ps(EXP_P3));
+  p = _mm256_add_ps(_mm256_mul_ps(p, r), _mm256_set1_ps(EXP_P4));
+  p = _mm256_add_ps(_mm256_mul_ps(p, r), _mm256_set1_ps(EXP_P5));
+  p = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(p, _mm256_mul_ps(r, r)), r), _mm256_set1_ps(1.0f));
+  e = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+
+  return _mm256_and_ps(_mm256_mul_ps(p, _mm256_castsi256_ps(e)), valid);
+}
+
+__attribute__((target("avx2"))) static float ExpSumAVX2(float *x, int n, float k)
+{
+  float scale = 1.0f / k, sum;
+  __m256 acc = _mm256_setzero_ps(), s = _mm256_set1_ps(-scale);
+  int i;
+
+  for (i = 0; i + 8 <= n; i += 8)
+    acc = _mm256_add_ps(acc, ExpAVX2(_mm256_mul_ps(s, _mm256_loadu_ps(x + i))));
+  sum = HSumAVX2(acc);
+  for (; i < n; i++)
+    sum += ExpScalar(-scale * x[i]);
+
+  return (sum);
+}
+
+/*------------ AVX-512 kernels ------------------------------ */
+/* The last n % 16 features are read with masked loads, whose
+   inactive lanes are zero and add nothing to any of the sums. */
+
+__attribute__((target("avx512f"))) static inline __m512 AbsAVX512(__m512 v)
+{
+  return _mm512_castsi512_ps(_mm512_and_si512(_mm512_castps_si512(v), _mm512_set1_epi32(0x7fffffff)));
+}
+
+__attribute__((target("avx512f"))) static inline __mmask16 TailMaskAVX512(int n, int i)
+{
+  return (n - i >= 16) ? (__mmask16)0xFFFF : (__mmask16)((1u << (n - i)) - 1);
+}
+
+// Chi-squared terms d^2 / (s + 1e-9) of eight lanes, in double as in the scalar kernel
+__attribute__((target("avx512f"))) static inline __m512d ChiSquaredTermsAVX512(__m256 d, __m256 s)
+{
+  __m512d dd = _mm512_cvtps_pd(d);
+
+  return _mm512_div_pd(_mm512_mul_pd(dd, dd), _mm512_add_pd(_mm512_cvtps_pd(s), _mm512_set1_pd(0.000000001)));
+}
+
+__attribute__((target("avx512f"))) static inline __m256 HighHalfAVX512(__m512 v)
+{
+  return _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(v), 1));
+}
+
+__attribute__((target("avx512f"))) static float EuclDistAVX512(float *f1, float *f2, int n, float bound)
+{
+  __m512 acc = _mm512_setzero_ps(), d;
+  __mmask16 m;
+  int i;
+
+  for (i = 0; i < n; i += 16)
+  {
+    m = TailMaskAVX512(n, i);
+    d = _mm512_sub_ps(_mm512_maskz_loadu_ps(m, f1 + i), _mm512_maskz_loadu_ps(m, f2 + i));
+    acc = _mm512_add_ps(acc, _mm512_mul_ps(d, d));
+    if ((((i + 16) & (DIST_CHECKPOINT - 1)) == 0) && (_mm512_reduce_add_ps(acc) > bound))
+      return (_mm512_reduce_add_ps(acc));
+  }
+
+  return (_mm512_reduce_add_ps(acc));
+}
+
+__attribute__((target("avx512f"))) static float ChiSquaredDistAVX512(float *f1, float *f2, int n, float bound)
+{
+  __m512 s1 = _mm512_setzero_ps(), s2 = _mm512_setzero_ps(), a, b, d, s, v1, v2;
+  __m512d acc = _mm512_setzero_pd();
+  __mmask16 m;
+  int i;
+
+  for (i = 0; i < n; i += 16)
+  {
+    m = TailMaskAVX512(n, i);
+    s1 = _mm512_add_ps(s1, _mm512_maskz_loadu_ps(m, f1 + i));
+    s2 = _mm512_add_ps(s2, _mm512_maskz_loadu_ps(m, f2 + i));
+  }
+
+  v1 = _mm512_set1_ps(_mm512_reduce_add_ps(s1));
+  v2 = _mm512_set1_ps(_mm512_reduce_add_ps(s2));
+  for (i = 0; i < n; i += 16)
+  {
+    m = TailMaskAVX512(n, i);
+    a = _mm512_maskz_loadu_ps(m, f1 + i);
+    b = _mm512_maskz_loadu_ps(m, f2 + i);
+    d = _mm512_sub_ps(_mm512_div_ps(a, v1), _mm512_div_ps(b, v2));
+    s = _mm512_add_ps(a, b);
+    acc = _mm512_add_pd(acc, ChiSquaredTermsAVX512(_mm512_castps512_ps256(d), _mm512_castps512_ps256(s)));
+    acc = _mm512_add_pd(acc, ChiSquaredTermsAVX512(HighHalfAVX512(d), HighHalfAVX512(s)));
+  }
+
+  return (sqrtf(_mm512_reduce_add_pd(acc)));
+}
+
+__attribute__((target("avx512f"))) static float ManhattanDistAVX512(float *f1, float *f2, int n, float bound)
+{
+  __m512 acc = _mm512_setzero_ps();
+  __mmask16 m;
+  int i;
+
+  for (i = 0; i < n; i += 16)
+  {
+    m = TailMaskAVX512(n, i);
+    acc = _mm512_add_ps(acc, AbsAVX512(_mm512_sub_ps(_mm512_maskz_loadu_ps(m, f1 + i),
+                                                     _mm512_maskz_loadu_ps(m, f2 + i))));
+    if ((((i + 16) & (DIST_CHECKPOINT - 1)) == 0) && (_mm512_reduce_add_ps(acc) > bound))
+      return (_mm512_reduce_add_ps(acc));
+  }
+
+  return (_mm512_reduce_add_ps(acc));
+}
+
+__attribute__((target("avx512f"))) static float CanberraDistAVX512(float *f1, float *f2, int n, float bound)
+{
+  __m512 acc = _mm512_setzero_ps(), a, b, aux;
+  __mmask16 m;
+  int i;
+
+  for (i = 0; i < n; i += 16)
+  {
+    m = TailMaskAVX512(n, i);
+    a = _mm512_maskz_loadu_ps(m, f1 + i);
+    b = _mm512_maskz_loadu_ps(m, f2 + i);
+    aux = AbsAVX512(_mm512_add_ps(a, b));
+    m = _mm512_cmp_ps_mask(aux, _mm512_setzero_ps(), _CMP_GT_OQ);
+    acc = _mm512_mask_add_ps(acc, m, acc, _mm512_maskz_div_ps(m, AbsAVX512(_mm512_sub_ps(a, b)), aux));
+    if ((((i + 16) & (DIST_CHECKPOINT - 1)) == 0) && (_mm512_reduce_add_ps(acc) > bound))
+      return (_mm512_reduce_add_ps(acc));
+  }
+
+  return (_mm512_reduce_add_ps(acc));
+}
+
+__attribute__((target("avx512f"))) static float SquaredChordDistAVX512(float *f1, float *f2, int n, float bound)
+{
+  __m512 acc = _mm512_setzero_ps(), a, b, d, zero = _mm512_setzero_ps();
+  __mmask16 m;
+  int i;
+
+  for (i = 0; i < n; i += 16)
+  {
+    m = TailMaskAVX512(n, i);
+    a = _mm512_maskz_loadu_ps(m, f1 + i);
+    b = _mm512_maskz_loadu_ps(m, f2 + i);
+    m = _mm512_cmp_ps_mask(a, zero, _CMP_GE_OQ) & _mm512_cmp_ps_mask(b, zero, _CMP_GE_OQ);
+    d = _mm512_sub_ps(_mm512_sqrt_ps(a), _mm512_sqrt_ps(b));
+    acc = _mm512_mask_add_ps(acc, m, acc, _mm512_mul_ps(d, d));
+    if ((((i + 16) & (DIST_CHECKPOINT - 1)) == 0) && (_mm512_reduce_add_ps(acc) > bound))
+      return (_mm512_reduce_add_ps(acc));
+  }
+
+  return (_mm512_reduce_add_ps(acc));
+}
+
+__attribute__((target("avx512f"))) static float SquaredChiSquaredDistAVX512(float *f1, float *f2, int n, float bound)
+{
+  __m512 acc = _mm512_setzero_ps(), a, b, d, aux;
+  __mmask16 m;
+  int i;
+
+  for (i = 0; i < n; i += 16)
+  {
+    m = TailMaskAVX512(n, i);
+    a = _mm512_maskz_loadu_ps(m, f1 + i);
+    b = _mm512_maskz_loadu_ps(m, f2 + i);
+    d = _mm512_sub_ps(a, b);
+    aux = AbsAVX512(_mm512_add_ps(a, b));
+    m = _mm512_cmp_ps_mask(aux, _mm512_setzero_ps(), _CMP_GT_OQ);
+    acc = _mm512_mask_add_ps(acc, m, acc, _mm512_maskz_div_ps(m, _mm512_mul_ps(d, d), aux));
+    if ((((i + 16) & (DIST_CHECKPOINT - 1)) == 0) && (_mm512_reduce_add_ps(acc) > bound))
+      return (_mm512_reduce_add_ps(acc));
+  }
+
+  return (_mm512_reduce_add_ps(acc));
+}
+
+__attribute__((target("avx512f"))) static float BrayCurtisDistAVX512(float *f1, float *f2, int n, float bound)
+{
+  __m512 acc = _mm512_setzero_ps(), a, b, aux;
+  __mmask16 m;
+  int i;
+
+  for (i = 0; i < n; i += 16)
+  {
+    m = TailMaskAVX512(n, i);
+    a = _mm512_maskz_loadu_ps(m, f1 + i);
+    b = _mm512_maskz_loadu_ps(m, f2 + i);
+    aux = _mm512_add_ps(a, b);
+    m = _mm512_cmp_ps_mask(aux, _mm512_setzero_ps(), _CMP_GT_OQ);
+    acc = _mm512_mask_add_ps(acc, m, acc, _mm512_maskz_div_ps(m, AbsAVX512(_mm512_sub_ps(a, b)), aux));
+    if ((((i + 16) & (DIST_CHECKPOINT - 1)) == 0) && (_mm512_reduce_add_ps(acc) > bound))
+      return (_mm512_reduce_add_ps(acc));
+  }
+
+  return (_mm512_reduce_add_ps(acc));
+}
+
+__attribute__((target("avx512f"))) static inline __m512 ExpAVX512(__m512 x)
+{
+  __m512 n, r, p;
+  __mmask16 valid = _mm512_cmp_ps_mask(x, _mm512_set1_ps(EXP_MINARG), _CMP_GE_OQ);
+  __m512i e;
+
+  x = _mm512_min_ps(_mm512_max_ps(x, _mm512_set1_ps(EXP_MINARG)), _mm512_set1_ps(EXP_MAXARG));
+  n = _mm512_roundscale_ps(_mm512_add_ps(_mm512_mul_ps(x, _mm512_set1_ps(EXP_LOG2E)), _mm512_set1_ps(0.5f)),
+                           _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+  r = _mm512_sub_ps(x, _mm512_mul_ps(n, _mm512_set1_ps(EXP_C1)));
+  r = _mm512_sub_ps(r, _mm512_mul_ps(n, _mm512_set1_ps(EXP_C2)));
+  p = _mm512_set1_ps(EXP_P0);
+  p = _mm512_add_ps(_mm512_mul_ps(p, r), _mm512_set1_ps(EXP_P1));
+  p = _mm512_add_ps(_mm512_mul_ps(p, r), _mm512_set1_ps(EXP_P2));
+  p = _mm512_add_ps(_mm512_mul_ps(p, r), _mm512_set1_ps(EXP_P3));
+  p = _mm512_add_ps(_mm512_mul_ps(p, r), _mm512_set1_ps(EXP_P4));
+  p = _mm512_add_ps(_mm512_mul_ps(p, r), _mm512_set1_ps(EXP_P5));
+  p = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(p, _mm512_mul_ps(r, r)), r), _mm512_set1_ps(1.0f));
+  e = _mm512_slli_epi32(_mm512_add_epi32(_mm512_cvtps_epi32(n), _mm512_set1_epi32(127)), 23);
+
+  return _mm512_maskz_mul_ps(valid, p, _mm512_castsi512_ps(e));
+}
+
+/* The inactive lanes of the last load are left out of the sum, since
+   their exponential is 1 */
+__attribute__((target("avx512f"))) static float ExpSumAVX512(float *x, int n, float k)
+{
+  float scale = 1.0f / k;
+  __m512 acc = _mm512_setzero_ps(), s = _mm512_set1_ps(-scale);
+  __mmask16 m;
+  int i;
+
+  for (i = 0; i < n; i += 16)
+  {
+    m = TailMaskAVX512(n, i);
+    acc = _mm512_mask_add_ps(acc, m, acc, ExpAVX512(_mm512_mul_ps(s, _mm512_maskz_loadu_ps(m, x + i))));
+  }
+
+  return (_mm512_reduce_add_ps(acc));
+}
+
+#endif // SIMD_X86
+
+/*------------ Dispatch ------------------------------ */
+
+DistanceKernels DistKernels = {
+    EuclDistScalar, ChiSquaredDistScalar, ManhattanDistScalar, CanberraDistScalar,
+    SquaredChordDistScalar, SquaredChiSquaredDistScalar, BrayCurtisDistScalar, ExpSumScalar};
+
+/* It returns the best instruction set supported by the CPU */
+int DetectSIMDLevel(void)
+{
+#ifdef SIMD_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f"))
+    return SIMD_AVX512;
+  if (__builtin_cpu_supports("avx2"))
+    return SIMD_AVX2;
+  if (__builtin_cpu_supports("sse4.1"))
+    return SIMD_SSE4;
+#endif
+  return SIMD_SCALAR;
+}
+
+/* It gets the kernels of a given level, without installing them */
+void GetDistanceKernels(int level, DistanceKernels *K)
+{
+  switch (level)
+  {
+#ifdef SIMD_X86
+  case SIMD_AVX512:
+    K->eucl = EuclDistAVX512;
+    K->chisquared = ChiSquaredDistAVX512;
+    K->manhattan = ManhattanDistAVX512;
+    K->canberra = CanberraDistAVX512;
+    K->squaredchord = SquaredChordDistAVX512;
+    K->squaredchisquared = SquaredChiSquaredDistAVX512;
+    K->braycurtis = BrayCurtisDistAVX512;
+    K->expsum = ExpSumAVX512;
+    break;
+  case SIMD_AVX2:
+    K->eucl = EuclDistAVX2;
+    K->chisquared = ChiSquaredDistAVX2;
+    K->manhattan = ManhattanDistAVX2;
+    K->canberra = CanberraDistAVX2;
+    K->squaredchord = SquaredChordDistAVX2;
+    K->squaredchisquared = SquaredChiSquaredDistAVX2;
+    K->braycurtis = BrayCurtisDistAVX2;
+    K->expsum = ExpSumAVX2;
+    break;
+  case SIMD_SSE4:
+    K->eucl = EuclDistSSE4;
+    K->chisquared = ChiSquaredDistSSE4;
+    K->manhattan = ManhattanDistSSE4;
+    K->canberra = CanberraDistSSE4;
+    K->squaredchord = SquaredChordDistSSE4;
+    K->squaredchisquared = SquaredChiSquaredDistSSE4;
+    K->braycurtis = BrayCurtisDistSSE4;
+    K->expsum = ExpSumSSE4;
+    break;
+#endif
+  default:
+    K->eucl = EuclDistScalar;
+    K->chisquared = ChiSquaredDistScalar;
+    K->manhattan = ManhattanDistScalar;
+    K->canberra = CanberraDistScalar;
+    K->squaredchord = SquaredChordDistScalar;
+    K->squaredchisquared = SquaredChiSquaredDistScalar;
+    K->braycurtis = BrayCurtisDistScalar;
+    K->expsum = ExpSumScalar;
+    break;
+  }
+}
+
+/* It installs the kernels of level (at most the detected one) and returns the installed level */
+int SetSIMDLevel(int level)
+{
+  int best = DetectSIMDLevel();
+
+  if (level > best)
+    level = best;
+  if (level < SIMD_SCALAR)
+    level = SIMD_SCALAR;
+  GetDistanceKernels(level, &DistKernels);
+
+  return level;
+}
+
+char *SIMDLevelName(int level)
+{
+  switch (level)
+  {
+  case SIMD_AVX512:
+    return "AVX-512";
+  case SIMD_AVX2:
+    return "AVX2";
+  case SIMD_SSE4:
+    return "SSE4";
+  default:
+    return "scalar";
+  }
+}
+
+/* It converts f to half precision, rounded to the nearest, ties to even */
+unsigned short FloatToHalf(float f)
+{
+  union { float f; unsigned int u; } v;
+  unsigned short sign;
+
+  v.f = f;
+  sign = (v.u >> 16) & 0x8000;
+  v.u &= 0x7fffffff;
+  if (v.u > 0x7f800000) // NaN
+    return sign | 0x7e00;
+  if (v.u >= 0x477ff000) // rounds above 65504
+    return sign | 0x7c00;
+  if (v.u < 0x38800000) // below 2^-14: subnormal, in units of 2^-24
+    return sign | (unsigned short)rintf(v.f * 16777216.0f);
+  v.u += 0x0fff + ((v.u >> 13) & 1);
+
+  return sign | (unsigned short)((v.u - 0x38000000) >> 13);
+}
+
+/* It installs the kernels at startup */
+__attribute__((constructor)) static void InitDistanceKernels(void)
+{
+  char *env = getenv("OPF_SIMD");
+
+  if (env != NULL)
+    SetSIMDLevel(atoi(env));
+  else
+    SetSIMDLevel(DetectSIMDLevel());
+}
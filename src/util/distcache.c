@@ -0,0 +1,214 @@
+/*
+  Copyright (C) <2009> <Alexandre Xavier Falcão and João Paulo Papa>
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+  please see full copyright in COPYING file.
+  -------------------------------------------------------------------------
+
+  Bounded cache of the distances between pairs of samples, kept in
+  tiles of rows that share a fixed number of slots. */
+
+#include "distcache.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#define DcLockType omp_lock_t
+#define DcInitLock(l) omp_init_lock(l)
+#define DcDestroyLock(l) omp_destroy_lock(l)
+#else
+#define DcLockType char
+#define DcInitLock(l)
+#define DcDestroyLock(l)
+#endif
+
+/* The locks are only taken inside parallel regions (par = 1): out of
+   them, a lock would cost more than the lookup itself */
+static inline int DcParallel(void)
+{
+#ifdef _OPENMP
+  return omp_in_parallel();
+#else
+  return 0;
+#endif
+}
+
+static inline void DcSetLock(DcLockType *l, int par)
+{
+#ifdef _OPENMP
+  if (par)
+    omp_set_lock(l);
+#endif
+}
+
+static inline void DcUnsetLock(DcLockType *l, int par)
+{
+#ifdef _OPENMP
+  if (par)
+    omp_unset_lock(l);
+#endif
+}
+
+#define DcTile(C, slot) ((C)->value + (size_t)(slot) * DC_TILEROWS * (C)->nsamples) //distances of a slot
+
+DistCache *CreateDistCache(int nsamples, size_t maxbytes)
+{
+  DistCache *C = (DistCache *)calloc(1, sizeof(DistCache));
+  size_t tilebytes = (size_t)DC_TILEROWS * MAX(nsamples, 1) * sizeof(float), nslots = maxbytes / tilebytes;
+  int ntiles = (nsamples + DC_TILEROWS - 1) / DC_TILEROWS, nways, s, t;
+  DcLockType *lock;
+
+  if (C == NULL)
+    Error(MSG1, "CreateDistCache");
+  C->nsamples = nsamples;
+  nslots = MIN(MAX(nslots, 1), (size_t)MAX(ntiles, 1));
+  // a power of 2, so that the set of a tile is found by a mask
+  C->nsets = 1;
+  while ((C->nsets * 2 <= DC_MAXSETS) && ((size_t)C->nsets * 2 <= nslots))
+    C->nsets *= 2;
+  nways = (int)(nslots / C->nsets);
+  // when every tile fits, each set gets room for all its tiles if the size allows
+  if ((nslots == (size_t)ntiles) && ((size_t)C->nsets * ((ntiles + C->nsets - 1) / C->nsets) * tilebytes <= maxbytes))
+    nways = (ntiles + C->nsets - 1) / C->nsets;
+  C->nslots = C->nsets * nways;
+
+  C->tileslot = AllocIntArray(MAX(ntiles, 1));
+  C->slottile = AllocIntArray(C->nslots);
+  C->set = (DistCacheSet *)calloc(C->nsets, sizeof(DistCacheSet));
+  C->value = (float *)malloc((size_t)C->nslots * tilebytes);
+  C->lock = lock = (DcLockType *)calloc(C->nsets, sizeof(DcLockType));
+  if ((C->set == NULL) || (C->value == NULL) || (C->lock == NULL))
+    Error(MSG1, "CreateDistCache");
+
+  for (t = 0; t < ntiles; t++)
+    C->tileslot[t] = NIL;
+  for (s = 0; s < C->nslots; s++)
+    C->slottile[s] = NIL;
+  for (s = 0; s < C->nsets; s++)
+    DcInitLock(&lock[s]);
+
+  return C;
+}
+
+void DestroyDistCache(DistCache **C)
+{
+  DcLockType *lock;
+  int s;
+
+  if (*C != NULL)
+  {
+    lock = (DcLockType *)(*C)->lock;
+    for (s = 0; s < (*C)->nsets; s++)
+      DcDestroyLock(&lock[s]);
+    free((*C)->lock);
+    free((*C)->value);
+    free((*C)->set);
+    free((*C)->slottile);
+    free((*C)->tileslot);
+    free(*C);
+    *C = NULL;
+  }
+}
+
+/* It returns 1 and the distance of the row i and column j in d if it
+   is stored. The hit, or the miss if last is 1, is counted in the set
+   of row i, under its lock (taken if par is 1). */
+static int DistCacheRowGet(DistCache *C, int i, int j, float *d, int last, int par)
+{
+  DcLockType *lock = (DcLockType *)C->lock;
+  int t = i / DC_TILEROWS, s = t & (C->nsets - 1), slot, found = 0;
+  float value;
+
+  DcSetLock(&lock[s], par);
+  slot = C->tileslot[t];
+  if (slot != NIL)
+  {
+    value = DcTile(C, slot)[(size_t)(i % DC_TILEROWS) * C->nsamples + j];
+    found = (value == value); // NaN if not stored
+    if (found)
+      *d = value;
+  }
+  if (found)
+    C->set[s].hits++;
+  else if (last)
+    C->set[s].misses++;
+  DcUnsetLock(&lock[s], par);
+
+  return found;
+}
+
+int DistCacheGet(DistCache *C, int i, int j, float *d)
+{
+  int par;
+
+  if ((i < 0) || (j < 0) || (i >= C->nsamples) || (j >= C->nsamples))
+    return 0;
+
+  par = DcParallel();
+
+  return DistCacheRowGet(C, i, j, d, 0, par) || DistCacheRowGet(C, j, i, d, 1, par);
+}
+
+// It stores d in the row i and column j, taking a slot for the tile of i if insert is 1 (under the lock of its set if par is 1)
+static void DistCacheRowPut(DistCache *C, int i, int j, float d, int insert, int par)
+{
+  DcLockType *lock = (DcLockType *)C->lock;
+  DistCacheSet *S;
+  int t = i / DC_TILEROWS, s = t & (C->nsets - 1), slot, k;
+  float *tile;
+
+  DcSetLock(&lock[s], par);
+  slot = C->tileslot[t];
+  if ((slot == NIL) && insert)
+  {
+    S = &C->set[s];
+    slot = s + S->next * C->nsets;
+    S->next = (S->next + 1) % (C->nslots / C->nsets);
+    if (C->slottile[slot] != NIL)
+      C->tileslot[C->slottile[slot]] = NIL;
+    C->slottile[slot] = t;
+    C->tileslot[t] = slot;
+    tile = DcTile(C, slot);
+    for (k = 0; k < DC_TILEROWS * C->nsamples; k++)
+      tile[k] = NAN;
+  }
+  if (slot != NIL)
+    DcTile(C, slot)[(size_t)(i % DC_TILEROWS) * C->nsamples + j] = d;
+  DcUnsetLock(&lock[s], par);
+}
+
+void DistCachePut(DistCache *C, int i, int j, float d)
+{
+  int par;
+
+  if ((i < 0) || (j < 0) || (i >= C->nsamples) || (j >= C->nsamples))
+    return;
+
+  par = DcParallel();
+  DistCacheRowPut(C, i, j, d, 1, par);
+  DistCacheRowPut(C, j, i, d, 0, par);
+}
+
+void DistCacheStats(DistCache *C, long long *hits, long long *misses)
+{
+  int s;
+
+  *hits = *misses = 0;
+  for (s = 0; s < C->nsets; s++)
+  {
+    *hits += C->set[s].hits;
+    *misses += C->set[s].misses;
+  }
+}
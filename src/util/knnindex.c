@@ -0,0 +1,682 @@
+/*
+  Copyright (C) <2009> <Alexandre Xavier Falcão and João Paulo Papa>
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+  please see full copyright in COPYING file.
+  -------------------------------------------------------------------------
+
+  Exact k-d tree and VP-tree for the k-nearest neighbors of the nodes
+  of a subgraph, and an approximate knn graph built by NN-Descent. */
+
+#include "knnindex.h"
+
+/*----------- Construction ------------------------*/
+
+#define KnnFeatRow(T, i) ((T)->feat + (size_t)(i) * (T)->featstride) //feature vector of perm[i]
+
+static KnnIndex *CreateKnnIndex(Subgraph *sg, int type)
+{
+  KnnIndex *T = (KnnIndex *)calloc(1, sizeof(KnnIndex));
+  int i;
+
+  T->type = type;
+  T->sg = sg;
+  T->perm = AllocIntArray(MAX(sg->nnodes, 1));
+  for (i = 0; i < sg->nnodes; i++)
+    T->perm[i] = i;
+  // a tree with a leaf of at least one node per two nodes of the subgraph
+  T->node = (KnnTreeNode *)calloc(2 * MAX(sg->nnodes, 1), sizeof(KnnTreeNode));
+  T->root = NIL;
+
+  return T;
+}
+
+static int NewKnnTreeNode(KnnIndex *T, int first, int last)
+{
+  KnnTreeNode *node = &T->node[T->nnodes];
+
+  node->first = first;
+  node->last = last;
+  node->left = node->right = NIL;
+  node->vp = NIL;
+
+  return T->nnodes++;
+}
+
+// It rearranges perm[first..last-1] so that key[perm[mid]] has its sorted place (quickselect)
+static void SelectByKey(int *perm, float *key, int first, int last, int mid)
+{
+  int i, j, tmp;
+  float pivot;
+
+  last--;
+  while (first < last)
+  {
+    pivot = key[perm[(first + last) / 2]];
+    i = first;
+    j = last;
+    while (i <= j)
+    {
+      while (key[perm[i]] < pivot)
+        i++;
+      while (key[perm[j]] > pivot)
+        j--;
+      if (i <= j)
+      {
+        tmp = perm[i];
+        perm[i] = perm[j];
+        perm[j] = tmp;
+        i++;
+        j--;
+      }
+    }
+    if (mid <= j)
+      last = j;
+    else if (mid >= i)
+      first = i;
+    else
+      break;
+  }
+}
+
+// It copies the feature vectors in the order of the leaves
+static void CopyKnnFeats(KnnIndex *T)
+{
+  Subgraph *sg = T->sg;
+  void *feat = NULL;
+  int i;
+
+  T->featstride = SgFeatStride(sg->nfeats);
+  if (posix_memalign(&feat, SG_ALIGNMENT, MAX((size_t)sg->nnodes * T->featstride * sizeof(float), SG_ALIGNMENT)) != 0)
+    Error(MSG1, "CopyKnnFeats");
+  T->feat = (float *)feat;
+  for (i = 0; i < sg->nnodes; i++)
+    memcpy(KnnFeatRow(T, i), sg->node[T->perm[i]].feat, sg->nfeats * sizeof(float));
+}
+
+static int BuildKdTree(KnnIndex *T, float *key, int first, int last)
+{
+  Subgraph *sg = T->sg;
+  int id = NewKnnTreeNode(T, first, last), i, j, dim = 0, mid;
+  float lo, hi, spread = 0.0f;
+
+  if (last - first <= KNN_LEAFSIZE)
+    return id;
+
+  // coordinate of largest spread
+  for (j = 0; j < sg->nfeats; j++)
+  {
+    lo = hi = sg->node[T->perm[first]].feat[j];
+    for (i = first + 1; i < last; i++)
+    {
+      lo = MIN(lo, sg->node[T->perm[i]].feat[j]);
+      hi = MAX(hi, sg->node[T->perm[i]].feat[j]);
+    }
+    if (hi - lo > spread)
+    {
+      spread = hi - lo;
+      dim = j;
+    }
+  }
+  if (!(spread > 0.0f)) // identical nodes stay in one leaf
+    return id;
+
+  for (i = first; i < last; i++)
+    key[T->perm[i]] = sg->node[T->perm[i]].feat[dim];
+  mid = (first + last) / 2;
+  SelectByKey(T->perm, key, first, last, mid);
+
+  T->node[id].dim = dim;
+  T->node[id].split = key[T->perm[mid]];
+  T->node[id].left = BuildKdTree(T, key, first, mid);
+  T->node[id].right = BuildKdTree(T, key, mid, last);
+
+  return id;
+}
+
+KnnIndex *CreateKdTree(Subgraph *sg, int norm)
+{
+  KnnIndex *T = CreateKnnIndex(sg, KNN_KDTREE);
+  float *key = AllocFloatArray(MAX(sg->nnodes, 1));
+
+  T->norm = norm;
+  if (sg->nnodes > 0)
+    T->root = BuildKdTree(T, key, 0, sg->nnodes);
+  free(key);
+  CopyKnnFeats(T);
+
+  return T;
+}
+
+static int BuildVpTree(KnnIndex *T, float *key, int first, int last)
+{
+  Subgraph *sg = T->sg;
+  int id = NewKnnTreeNode(T, first, last), i, vp, mid;
+
+  if (last - first <= KNN_LEAFSIZE)
+    return id;
+
+  // the first node is the vantage point, the others are split by the median distance to it
+  vp = T->perm[first];
+  for (i = first + 1; i < last; i++)
+    key[T->perm[i]] = T->metric(sg->node[vp].feat, sg->node[T->perm[i]].feat, sg->nfeats);
+  mid = (first + 1 + last) / 2;
+  SelectByKey(T->perm, key, first + 1, last, mid);
+
+  T->node[id].vp = vp;
+  T->node[id].mu = key[T->perm[mid]];
+  T->node[id].left = BuildVpTree(T, key, first + 1, mid + 1);
+  T->node[id].right = BuildVpTree(T, key, mid + 1, last);
+
+  return id;
+}
+
+KnnIndex *CreateVpTree(Subgraph *sg, KnnMetricFun metric)
+{
+  KnnIndex *T = CreateKnnIndex(sg, KNN_VPTREE);
+  float *key = AllocFloatArray(MAX(sg->nnodes, 1));
+
+  T->metric = metric;
+  if (sg->nnodes > 0)
+    T->root = BuildVpTree(T, key, 0, sg->nnodes);
+  free(key);
+  CopyKnnFeats(T);
+
+  return T;
+}
+
+void DestroyKnnIndex(KnnIndex **T)
+{
+  if (*T != NULL)
+  {
+    free((*T)->feat);
+    free((*T)->graphd);
+    free((*T)->graphnn);
+    free((*T)->perm);
+    free((*T)->node);
+    free(*T);
+    *T = NULL;
+  }
+}
+
+/*----------- Files ------------------------*/
+/* A tree is written as its type, norm, root and number of tree nodes,
+   followed by perm and by the tree nodes. The feature vectors are not
+   written: they are copied from the subgraph when the tree is read. */
+
+void WriteKnnIndex(KnnIndex *T, FILE *fp)
+{
+  if ((T->type != KNN_KDTREE) && (T->type != KNN_VPTREE))
+    Error("Only trees can be written", "WriteKnnIndex");
+  fwrite(&T->type, sizeof(int), 1, fp);
+  fwrite(&T->norm, sizeof(int), 1, fp);
+  fwrite(&T->root, sizeof(int), 1, fp);
+  fwrite(&T->nnodes, sizeof(int), 1, fp);
+  fwrite(T->perm, sizeof(int), T->sg->nnodes, fp);
+  fwrite(T->node, sizeof(KnnTreeNode), T->nnodes, fp);
+}
+
+KnnIndex *ReadKnnIndex(Subgraph *sg, FILE *fp, KnnMetricFun metric)
+{
+  KnnIndex *T = NULL;
+  char *seen = NULL;
+  int type, i;
+
+  if ((fread(&type, sizeof(int), 1, fp) != 1) || ((type != KNN_KDTREE) && (type != KNN_VPTREE)))
+    Error("Could not read type of the index", "ReadKnnIndex");
+  T = CreateKnnIndex(sg, type);
+  T->metric = metric;
+  if ((fread(&T->norm, sizeof(int), 1, fp) != 1) || (fread(&T->root, sizeof(int), 1, fp) != 1) ||
+      (fread(&T->nnodes, sizeof(int), 1, fp) != 1))
+    Error("Could not read header of the index", "ReadKnnIndex");
+  if ((T->nnodes < 0) || (T->nnodes > 2 * MAX(sg->nnodes, 1)) || (T->root < NIL) || (T->root >= T->nnodes))
+    Error("Invalid header of the index", "ReadKnnIndex");
+  if ((fread(T->perm, sizeof(int), sg->nnodes, fp) != sg->nnodes) ||
+      (fread(T->node, sizeof(KnnTreeNode), T->nnodes, fp) != T->nnodes))
+    Error("Could not read the index", "ReadKnnIndex");
+  // perm must be a permutation, otherwise the tree would miss nodes
+  seen = (char *)calloc(MAX(sg->nnodes, 1), sizeof(char));
+  if (seen == NULL)
+    Error(MSG1, "ReadKnnIndex");
+  for (i = 0; i < sg->nnodes; i++)
+  {
+    if ((T->perm[i] < 0) || (T->perm[i] >= sg->nnodes) || seen[T->perm[i]])
+      Error("Invalid node of the index", "ReadKnnIndex");
+    seen[T->perm[i]] = 1;
+  }
+  free(seen);
+  for (i = 0; i < T->nnodes; i++)
+    if ((T->node[i].first < 0) || (T->node[i].first > T->node[i].last) || (T->node[i].last > sg->nnodes) ||
+        (T->node[i].left < NIL) || (T->node[i].left >= T->nnodes) || (T->node[i].right < NIL) ||
+        (T->node[i].right >= T->nnodes) || ((T->node[i].left == NIL) != (T->node[i].right == NIL)) ||
+        ((type == KNN_KDTREE) && (T->node[i].left != NIL) && ((T->node[i].dim < 0) || (T->node[i].dim >= sg->nfeats))) ||
+        ((type == KNN_VPTREE) && (T->node[i].left != NIL) &&
+         ((T->node[i].first == T->node[i].last) || (T->node[i].vp != T->perm[T->node[i].first]))))
+      Error("Invalid tree node of the index", "ReadKnnIndex");
+  CopyKnnFeats(T);
+
+  return T;
+}
+
+/*----------- Search ------------------------*/
+
+typedef struct _knnsearch {
+  KnnIndex *T;
+  float *feat;
+  int exclude, k;
+  KnnWeightFun weight;
+  KnnBoundFun bound;
+  float *d;
+  int *nn;
+  float thresh; //metric distance above which no node can enter the list
+  float *off;   //k-d tree: offsets of the current cell from feat in each coordinate
+} KnnSearch;
+
+// It inserts node j with weight w if it precedes the k-th node in (weight, index) order
+static void KnnSearchInsert(KnnSearch *S, int j, float w)
+{
+  float *d = S->d;
+  int *nn = S->nn, p = S->k - 1;
+
+  if (!((w < d[p]) || ((w == d[p]) && (d[p] != FLT_MAX) && (j < nn[p]))))
+    return;
+
+  while ((p > 0) && ((w < d[p - 1]) || ((w == d[p - 1]) && (j < nn[p - 1]))))
+  {
+    d[p] = d[p - 1];
+    nn[p] = nn[p - 1];
+    p--;
+  }
+  d[p] = w;
+  nn[p] = j;
+
+  if (d[S->k - 1] != FLT_MAX)
+    S->thresh = S->bound(d[S->k - 1]);
+}
+
+// It returns 1 if a cell at bounding distance rd (squared for KNN_L2) may hold a node of the list
+static int KnnSearchReaches(KnnSearch *S, float rd)
+{
+  if (S->T->norm == KNN_L2)
+    return ((rd <= S->thresh * S->thresh) || (S->thresh == FLT_MAX));
+  return (rd <= S->thresh);
+}
+
+static void KnnSearchNode(KnnSearch *S, int id, float rd)
+{
+  KnnIndex *T = S->T;
+  float *feat = S->feat;
+  KnnTreeNode *node = &T->node[id];
+  Subgraph *sg = T->sg;
+  float diff, dvp, slack, old, far;
+  int i, j, near, other;
+
+  if (node->left == NIL) // leaf
+  {
+    for (i = node->first; i < node->last; i++)
+    {
+      j = T->perm[i];
+      if (j != S->exclude)
+        KnnSearchInsert(S, j, S->weight(feat, KnnFeatRow(T, i), sg->nfeats, S->d[S->k - 1]));
+    }
+    return;
+  }
+
+  if (T->type == KNN_KDTREE)
+  {
+    // the near cell keeps the offsets, the far one is at least |diff| away in dim
+    diff = feat[node->dim] - node->split;
+    near = (diff <= 0) ? node->left : node->right;
+    other = (diff <= 0) ? node->right : node->left;
+    KnnSearchNode(S, near, rd);
+
+    old = S->off[node->dim];
+    diff = fabs(diff);
+    if (T->norm == KNN_L2)
+      far = rd - old * old + diff * diff;
+    else
+      far = rd - old + diff;
+    if (KnnSearchReaches(S, far))
+    {
+      S->off[node->dim] = diff;
+      KnnSearchNode(S, other, far);
+      S->off[node->dim] = old;
+    }
+    return;
+  }
+
+  // VP-tree
+  dvp = T->metric(feat, KnnFeatRow(T, node->first), sg->nfeats); // vp is perm[first]
+  if (node->vp != S->exclude)
+    KnnSearchInsert(S, node->vp, S->weight(feat, KnnFeatRow(T, node->first), sg->nfeats, S->d[S->k - 1]));
+  slack = KNN_SLACK * (dvp + node->mu);
+  if (dvp <= node->mu)
+  {
+    KnnSearchNode(S, node->left, rd);
+    if (node->mu - dvp - slack <= S->thresh)
+      KnnSearchNode(S, node->right, rd);
+  }
+  else
+  {
+    KnnSearchNode(S, node->right, rd);
+    if (dvp - node->mu - slack <= S->thresh)
+      KnnSearchNode(S, node->left, rd);
+  }
+}
+
+void KnnIndexSearch(KnnIndex *T, float *feat, int exclude, int k, KnnWeightFun weight, KnnBoundFun bound,
+                    float *d, int *nn)
+{
+  KnnSearch S;
+  int l;
+
+  for (l = 0; l < k; l++)
+    d[l] = FLT_MAX;
+  if ((k <= 0) || (T->root == NIL))
+    return;
+
+  S.T = T;
+  S.feat = feat;
+  S.exclude = exclude;
+  S.k = k;
+  S.weight = weight;
+  S.bound = bound;
+  S.d = d;
+  S.nn = nn;
+  S.thresh = FLT_MAX;
+  S.off = (T->type == KNN_KDTREE) ? AllocFloatArray(T->sg->nfeats) : NULL;
+
+  KnnSearchNode(&S, T->root, 0.0f);
+  free(S.off);
+}
+
+void KnnIndexNodeSearch(KnnIndex *T, int i, int k, KnnWeightFun weight, KnnBoundFun bound, float *d, int *nn)
+{
+  int l;
+
+  if (T->type != KNN_GRAPH)
+  {
+    KnnIndexSearch(T, T->sg->node[i].feat, i, k, weight, bound, d, nn);
+    return;
+  }
+
+  if (k > T->k)
+    Error("The graph has fewer neighbors than requested", "KnnIndexNodeSearch");
+  for (l = 0; l < k; l++)
+  {
+    d[l] = T->graphd[(size_t)i * T->k + l];
+    nn[l] = T->graphnn[(size_t)i * T->k + l];
+  }
+}
+
+/*----------- Approximate graph (NN-Descent) ------------------------*/
+/* Each node starts with k random neighbors. Every round joins, for each
+   node, its neighbors with each other ("a neighbor of a neighbor is
+   likely a neighbor") and keeps the k best pairs found so far. Only the
+   pairs with at least one neighbor that entered a list in the previous
+   round are joined. The rounds stop when the recall measured on a
+   sample of nodes, whose exact lists are found by a scan, reaches the
+   target, when a round changes too few entries, or after
+   KNN_DESCENT_MAXITER rounds. */
+
+// Deterministic generator (splitmix64), so that the graph does not depend on the state of rand()
+static unsigned int KnnRandom(unsigned long long *state)
+{
+  unsigned long long z = (*state += 0x9E3779B97F4A7C15ull);
+
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+
+  return (unsigned int)((z ^ (z >> 31)) >> 32);
+}
+
+// It returns a uniform integer in [0, n), rejecting the draws below 2^32 mod n, which would bias the modulo
+static int KnnRandomBelow(unsigned long long *state, unsigned int n)
+{
+  unsigned int r, min = (0u - n) % n;
+
+  do
+    r = KnnRandom(state);
+  while (r < min);
+
+  return (int)(r % n);
+}
+
+// It inserts node j with weight w in the list (d, nn, isnew) of size k, returning 1 if the list changed
+static int KnnDescentInsert(float *d, int *nn, char *isnew, int k, int j, float w)
+{
+  int p = k - 1, l;
+
+  if (!((w < d[p]) || ((w == d[p]) && (d[p] != FLT_MAX) && (j < nn[p]))))
+    return 0;
+  for (l = 0; (l < k) && (d[l] <= w); l++)
+    if (nn[l] == j)
+      return 0;
+
+  while ((p > 0) && ((w < d[p - 1]) || ((w == d[p - 1]) && (j < nn[p - 1]))))
+  {
+    d[p] = d[p - 1];
+    nn[p] = nn[p - 1];
+    isnew[p] = isnew[p - 1];
+    p--;
+  }
+  d[p] = w;
+  nn[p] = j;
+  isnew[p] = 1;
+
+  return 1;
+}
+
+// It adds j to the candidate list c of size k with cnt nodes offered so far (reservoir sampling)
+static void KnnDescentSample(int *c, int *cnt, int k, int j, unsigned long long *state)
+{
+  int r;
+
+  if (*cnt < k)
+    c[*cnt] = j;
+  else if ((r = KnnRandomBelow(state, *cnt + 1)) < k)
+    c[r] = j;
+  (*cnt)++;
+}
+
+// It returns the fraction of the exact k-nearest neighbors of the sample found by the graph
+static float KnnDescentRecall(KnnIndex *T, int nsample, int *sample, float *kth)
+{
+  int s, l, found = 0, k = T->k;
+  float *d;
+
+  for (s = 0; s < nsample; s++)
+  {
+    d = &T->graphd[(size_t)sample[s] * k];
+    for (l = 0; l < k; l++) // ties with the k-th weight are as good as the exact node
+      if ((d[l] != FLT_MAX) && (d[l] <= kth[s]))
+        found++;
+  }
+
+  return ((float)found / (nsample * k));
+}
+
+// It joins node i with node j, returning the number of lists that changed
+static int KnnDescentJoin(KnnIndex *T, char *isnew, KnnWeightFun weight, int i, int j)
+{
+  Subgraph *sg = T->sg;
+  size_t ki = (size_t)i * T->k, kj = (size_t)j * T->k;
+  float w;
+
+  if (i == j)
+    return 0;
+  w = weight(sg->node[i].feat, sg->node[j].feat, sg->nfeats, MAX(T->graphd[ki + T->k - 1], T->graphd[kj + T->k - 1]));
+
+  return (KnnDescentInsert(&T->graphd[ki], &T->graphnn[ki], &isnew[ki], T->k, j, w) +
+          KnnDescentInsert(&T->graphd[kj], &T->graphnn[kj], &isnew[kj], T->k, i, w));
+}
+
+// It collects in c[0..*m-1] the nodes of the two halves of a candidate list, without repetitions
+static void KnnDescentCandidates(int *c, int *cnt, int k, int v, int *mark, int *m)
+{
+  int h, l, j, *half;
+
+  *m = 0;
+  for (h = 0; h < 2; h++)
+  {
+    half = c + h * k;
+    for (l = 0; l < MIN(cnt[h], k); l++)
+    {
+      j = half[l];
+      if ((j != v) && (mark[j] != v))
+      {
+        mark[j] = v;
+        c[2 * k + (*m)++] = j;
+      }
+    }
+  }
+}
+
+KnnIndex *CreateKnnGraph(Subgraph *sg, int k, KnnWeightFun weight, float recall)
+{
+  KnnIndex *T = (KnnIndex *)calloc(1, sizeof(KnnIndex));
+  int n = sg->nnodes, i, j, l, a, b, u, v, iter, updates, nsample, mn, mo;
+  int *newc, *oldc, *nnew, *nold, *mark, *sample, *snn, *cn, *co;
+  float *sd, *kth;
+  char *isnew, *sisnew;
+  size_t e;
+  unsigned long long state = 1;
+
+  if ((k <= 0) || (k >= n))
+    Error("Invalid number of neighbors", "CreateKnnGraph");
+
+  T->type = KNN_GRAPH;
+  T->sg = sg;
+  T->root = NIL;
+  T->k = k;
+  T->graphd = AllocFloatArray(n * k);
+  T->graphnn = AllocIntArray(n * k);
+  isnew = (char *)calloc((size_t)n * k, sizeof(char));
+  /* candidate lists of each node: k sampled neighbors, k sampled
+     reverse neighbors and room for their union */
+  newc = AllocIntArray(n * 4 * k);
+  oldc = AllocIntArray(n * 4 * k);
+  nnew = AllocIntArray(2 * n);
+  nold = AllocIntArray(2 * n);
+  mark = AllocIntArray(n);
+  for (e = 0; e < (size_t)n * k; e++)
+    T->graphd[e] = FLT_MAX;
+
+  // exact lists of the sample
+  nsample = MIN(n, KNN_RECALL_SAMPLE);
+  sample = AllocIntArray(nsample);
+  kth = AllocFloatArray(nsample);
+  sd = AllocFloatArray(k);
+  snn = AllocIntArray(k);
+  sisnew = (char *)calloc(k, sizeof(char));
+  for (i = 0; i < n; i++)
+    mark[i] = NIL;
+  for (i = 0; i < nsample; i++)
+  {
+    do
+      j = KnnRandomBelow(&state, n);
+    while (mark[j] != NIL);
+    mark[j] = 0;
+    sample[i] = j;
+    for (l = 0; l < k; l++)
+      sd[l] = FLT_MAX;
+    for (l = 0; l < n; l++)
+      if (l != j)
+        KnnDescentInsert(sd, snn, sisnew, k, l, weight(sg->node[j].feat, sg->node[l].feat, sg->nfeats, sd[k - 1]));
+    kth[i] = sd[k - 1];
+  }
+
+  // random initial lists
+  for (i = 0; i < n; i++)
+    mark[i] = NIL;
+  for (i = 0; i < n; i++)
+  {
+    mark[i] = i;
+    for (l = 0; l < k; l++)
+    {
+      do
+        j = KnnRandomBelow(&state, n);
+      while (mark[j] == i);
+      mark[j] = i;
+      KnnDescentInsert(&T->graphd[(size_t)i * k], &T->graphnn[(size_t)i * k], &isnew[(size_t)i * k], k, j,
+                       weight(sg->node[i].feat, sg->node[j].feat, sg->nfeats, FLT_MAX));
+    }
+  }
+
+  T->recall = KnnDescentRecall(T, nsample, sample, kth);
+  for (iter = 0; (iter < KNN_DESCENT_MAXITER) && (T->recall < recall); iter++)
+  {
+    // candidates: neighbors and reverse neighbors, split by whether they entered the lists in the last round
+    for (i = 0; i < 2 * n; i++)
+      nnew[i] = nold[i] = 0;
+    for (v = 0; v < n; v++)
+      for (l = 0; l < k; l++)
+      {
+        e = (size_t)v * k + l;
+        if (T->graphd[e] == FLT_MAX)
+          continue;
+        u = T->graphnn[e];
+        if (isnew[e])
+        {
+          KnnDescentSample(&newc[(size_t)v * 4 * k], &nnew[2 * v], k, u, &state);
+          KnnDescentSample(&newc[(size_t)u * 4 * k + k], &nnew[2 * u + 1], k, v, &state);
+          isnew[e] = 0;
+        }
+        else
+        {
+          KnnDescentSample(&oldc[(size_t)v * 4 * k], &nold[2 * v], k, u, &state);
+          KnnDescentSample(&oldc[(size_t)u * 4 * k + k], &nold[2 * u + 1], k, v, &state);
+        }
+      }
+
+    // local joins: new with new and new with old
+    for (i = 0; i < n; i++)
+      mark[i] = NIL;
+    updates = 0;
+    for (v = 0; v < n; v++)
+    {
+      KnnDescentCandidates(&newc[(size_t)v * 4 * k], &nnew[2 * v], k, v, mark, &mn);
+      KnnDescentCandidates(&oldc[(size_t)v * 4 * k], &nold[2 * v], k, v, mark, &mo);
+      cn = &newc[(size_t)v * 4 * k + 2 * k];
+      co = &oldc[(size_t)v * 4 * k + 2 * k];
+      for (a = 0; a < mn; a++)
+      {
+        for (b = a + 1; b < mn; b++)
+          updates += KnnDescentJoin(T, isnew, weight, cn[a], cn[b]);
+        for (b = 0; b < mo; b++)
+          updates += KnnDescentJoin(T, isnew, weight, cn[a], co[b]);
+      }
+    }
+
+    T->recall = KnnDescentRecall(T, nsample, sample, kth);
+    if (updates <= KNN_DESCENT_DELTA * n * k)
+      break;
+  }
+
+  free(isnew);
+  free(newc);
+  free(oldc);
+  free(nnew);
+  free(nold);
+  free(mark);
+  free(sample);
+  free(kth);
+  free(sd);
+  free(snn);
+  free(sisnew);
+
+  return T;
+}
@@ -33,7 +33,7 @@ SgCTree *CreateSgMaxTree(Subgraph *g)
     GQueue *Q;
     int *nsons = NULL;
     int *size = NULL;
-    Set *adj;
+    int a, first, last;
 
     n = g->nnodes;
     level = AllocIntArray(n);
@@ -69,10 +69,11 @@ SgCTree *CreateSgMaxTree(Subgraph *g)
         p = RemoveGQueue(Q);
         rp = SgRepresentative(cmap, p);
 
-        adj = g->node[p].adj;
-        while (adj != NULL)
+        first = (g->arcoffset != NULL) ? g->arcoffset[p] : 0;
+        last = (g->arcoffset != NULL) ? g->arcoffset[p + 1] : 0;
+        for (a = first; a < last; a++)
         {
-            q = adj->elem;
+            q = g->arcnode[a];
             if (val[p] == val[q]) /* propagate component */
             {
                 if (Q->L.elem[q].color == GRAY)
@@ -119,7 +120,6 @@ SgCTree *CreateSgMaxTree(Subgraph *g)
                     }
                 }
             }
-            adj = adj->next;
         }
     }
 
@@ -24,6 +24,8 @@
   classifier.*/
 
 #include "subgraph.h"
+#include "knnindex.h"
+#include <sys/mman.h>
 
 /*----------- Constructor and destructor ------------------------*/
 // Allocate nodes without features
@@ -53,6 +55,34 @@ Subgraph *CreateSubgraph(int nnodes)
   return (sg);
 }
 
+// Allocate a contiguous feature matrix, aligned to SG_ALIGNMENT bytes
+// and with zero-padded rows, and point node[i].feat to its i-th row
+void AllocSubgraphFeats(Subgraph *sg, int nfeats)
+{
+  size_t size;
+  void *matrix = NULL;
+  int i;
+
+  sg->nfeats = nfeats;
+  sg->featstride = SgFeatStride(nfeats);
+  size = (size_t)sg->nnodes * sg->featstride * sizeof(float);
+
+  if (posix_memalign(&matrix, SG_ALIGNMENT, MAX(size, SG_ALIGNMENT)) != 0)
+    Error(MSG1, "AllocSubgraphFeats");
+  memset(matrix, 0, size);
+  sg->featmatrix = (float *)matrix;
+
+  for (i = 0; i < sg->nnodes; i++)
+    sg->node[i].feat = SgFeatRow(sg, i);
+}
+
+// It returns 1 if feat points into the feature matrix of sg
+static char IsFeatMatrixRow(Subgraph *sg, float *feat)
+{
+  return (sg->featmatrix != NULL) && (feat >= sg->featmatrix) &&
+         (feat < sg->featmatrix + (size_t)sg->nnodes * sg->featstride);
+}
+
 // Deallocate memory for subgraph
 void DestroySubgraph(Subgraph **sg)
 {
@@ -62,13 +92,19 @@ void DestroySubgraph(Subgraph **sg)
   {
     for (i = 0; i < (*sg)->nnodes; i++)
     {
-      if ((*sg)->node[i].feat != NULL)
+      if (((*sg)->node[i].feat != NULL) && !IsFeatMatrixRow(*sg, (*sg)->node[i].feat))
         free((*sg)->node[i].feat);
-      if ((*sg)->node[i].adj != NULL)
-        DestroySet(&(*sg)->node[i].adj);
     }
+    DestroySgArcs(*sg);
+    DestroyKnnIndex(&(*sg)->knnindex);
+    if ((*sg)->mapping != NULL)
+      munmap((*sg)->mapping, (*sg)->mappingsize);
+    else if ((*sg)->featmatrix != NULL)
+      free((*sg)->featmatrix);
     free((*sg)->node);
     free((*sg)->ordered_list_of_nodes);
+    free((*sg)->pivot);
+    free((*sg)->pivotdist);
     free((*sg));
     *sg = NULL;
   }
@@ -105,7 +141,7 @@ Subgraph *ReadSubgraph(char *file)
 {
   Subgraph *g = NULL;
   FILE *fp = NULL;
-  int nnodes, i, j;
+  int nnodes, nfeats, i;
   char msg[256];
 
   if ((fp = fopen(file, "rb")) == NULL)
@@ -120,21 +156,20 @@ Subgraph *ReadSubgraph(char *file)
   g = CreateSubgraph(nnodes);
   if (fread(&g->nlabels, sizeof(int), 1, fp) != 1)
     Error("Could not read the number of labels", "ReadSubGraph");
-  if (fread(&g->nfeats, sizeof(int), 1, fp) != 1)
+  if (fread(&nfeats, sizeof(int), 1, fp) != 1)
     Error("Could not read the number of features", "ReadSubGraph");
+  AllocSubgraphFeats(g, nfeats);
 
   /*reading features*/
   for (i = 0; i < g->nnodes; i++)
   {
-    g->node[i].feat = AllocFloatArray(g->nfeats);
     if (fread(&g->node[i].position, sizeof(int), 1, fp) != 1)
       Error("Could not read node position", "ReadSubGraph");
     if (fread(&g->node[i].truelabel, sizeof(int), 1, fp) != 1)
       Error("Could not read node true label", "ReadSubGraph");
 
-    for (j = 0; j < g->nfeats; j++)
-      if (fread(&g->node[i].feat[j], sizeof(float), 1, fp) != 1)
-        Error("Could not read node features", "ReadSubGraph");
+    if (fread(g->node[i].feat, sizeof(float), g->nfeats, fp) != g->nfeats)
+      Error("Could not read node features", "ReadSubGraph");
   }
 
   fclose(fp);
@@ -151,11 +186,11 @@ Subgraph *CopySubgraph(Subgraph *g)
   if (g != NULL)
   {
     clone = CreateSubgraph(g->nnodes);
+    AllocSubgraphFeats(clone, g->nfeats);
 
     clone->bestk = g->bestk;
     clone->df = g->df;
     clone->nlabels = g->nlabels;
-    clone->nfeats = g->nfeats;
     clone->mindens = g->mindens;
     clone->maxdens = g->maxdens;
     clone->K = g->K;
@@ -166,16 +201,132 @@ Subgraph *CopySubgraph(Subgraph *g)
       clone->ordered_list_of_nodes[i] = g->ordered_list_of_nodes[i];
     }
 
+    if (g->arcoffset != NULL)
+    {
+      MergeSgArcs(g);
+      AllocSgArcs(clone, g->arcoffset[g->nnodes]);
+      memcpy(clone->arcoffset, g->arcoffset, (g->nnodes + 1) * sizeof(int));
+      memcpy(clone->arcnode, g->arcnode, (size_t)g->arcoffset[g->nnodes] * sizeof(int));
+      memcpy(clone->arcweight, g->arcweight, (size_t)g->arcoffset[g->nnodes] * sizeof(float));
+    }
+
+    if (g->npivots > 0)
+    {
+      clone->npivots = g->npivots;
+      clone->pivotmetric = g->pivotmetric;
+      clone->pivot = AllocIntArray(g->npivots);
+      clone->pivotdist = AllocFloatArray(g->nnodes * g->npivots);
+      memcpy(clone->pivot, g->pivot, g->npivots * sizeof(int));
+      memcpy(clone->pivotdist, g->pivotdist, (size_t)g->nnodes * g->npivots * sizeof(float));
+    }
+
     return clone;
   }
   else
     return NULL;
 }
 
-//Copy nodes
+/*----------- Arcs of knn graphs ------------------------*/
+// Allocate room for narcs arcs. The caller fills arcoffset, arcnode and arcweight node by node
+void AllocSgArcs(Subgraph *sg, int narcs)
+{
+  int i;
+
+  DestroySgArcs(sg);
+  sg->arcoffset = AllocIntArray(sg->nnodes + 1);
+  sg->arcnode = AllocIntArray(MAX(narcs, 1));
+  sg->arcweight = AllocFloatArray(MAX(narcs, 1));
+  sg->ovfhead = AllocIntArray(MAX(sg->nnodes, 1));
+  for (i = 0; i < sg->nnodes; i++)
+    sg->ovfhead[i] = NIL;
+  sg->novf = 0;
+}
+
+// Insert the arc (i,j) of weight w in front of the arcs of i, as an overflow arc
+void InsertSgOverflowArc(Subgraph *sg, int i, int j, float w)
+{
+  if (sg->novf == sg->ovfsize)
+  {
+    sg->ovfsize = MAX(2 * sg->ovfsize, 1024);
+    sg->ovfnode = (int *)realloc(sg->ovfnode, sg->ovfsize * sizeof(int));
+    sg->ovfnext = (int *)realloc(sg->ovfnext, sg->ovfsize * sizeof(int));
+    sg->ovfweight = (float *)realloc(sg->ovfweight, sg->ovfsize * sizeof(float));
+    if ((sg->ovfnode == NULL) || (sg->ovfnext == NULL) || (sg->ovfweight == NULL))
+      Error(MSG1, "InsertSgOverflowArc");
+  }
+  sg->ovfnode[sg->novf] = j;
+  sg->ovfweight[sg->novf] = w;
+  sg->ovfnext[sg->novf] = sg->ovfhead[i];
+  sg->ovfhead[i] = sg->novf;
+  sg->novf++;
+}
+
+// Move the overflow arcs in front of the arcs of their nodes, the last inserted first.
+// Shared arc arrays are left to their owner and the merged arrays become private
+void MergeSgArcs(Subgraph *sg)
+{
+  int i, e, a, narcs, *offset, *node;
+  float *weight;
+
+  if ((sg->arcoffset == NULL) || (sg->novf == 0))
+    return;
+
+  narcs = sg->arcoffset[sg->nnodes] + sg->novf;
+  offset = AllocIntArray(sg->nnodes + 1);
+  node = AllocIntArray(narcs);
+  weight = AllocFloatArray(narcs);
+  for (i = 0, a = 0; i < sg->nnodes; i++)
+  {
+    offset[i] = a;
+    for (e = sg->ovfhead[i]; e != NIL; e = sg->ovfnext[e], a++)
+    {
+      node[a] = sg->ovfnode[e];
+      weight[a] = sg->ovfweight[e];
+    }
+    sg->ovfhead[i] = NIL;
+    memcpy(&node[a], &sg->arcnode[sg->arcoffset[i]], SgNumArcs(sg, i) * sizeof(int));
+    memcpy(&weight[a], &sg->arcweight[sg->arcoffset[i]], SgNumArcs(sg, i) * sizeof(float));
+    a += SgNumArcs(sg, i);
+  }
+  offset[sg->nnodes] = a;
+
+  if (!sg->arcsshared)
+  {
+    free(sg->arcoffset);
+    free(sg->arcnode);
+    free(sg->arcweight);
+  }
+  sg->arcsshared = 0;
+  sg->arcoffset = offset;
+  sg->arcnode = node;
+  sg->arcweight = weight;
+  sg->novf = 0;
+}
+
+// Deallocate the arcs
+void DestroySgArcs(Subgraph *sg)
+{
+  if (!sg->arcsshared)
+  {
+    free(sg->arcoffset);
+    free(sg->arcnode);
+    free(sg->arcweight);
+  }
+  sg->arcsshared = 0;
+  free(sg->ovfhead);
+  free(sg->ovfnode);
+  free(sg->ovfnext);
+  free(sg->ovfweight);
+  sg->arcoffset = sg->arcnode = sg->ovfhead = sg->ovfnode = sg->ovfnext = NULL;
+  sg->arcweight = sg->ovfweight = NULL;
+  sg->novf = sg->ovfsize = 0;
+}
+
+//Copy nodes (the feature vector of dest is allocated if it has none)
 void CopySNode(SNode *dest, SNode *src, int nfeats)
 {
-  dest->feat = AllocFloatArray(nfeats);
+  if (dest->feat == NULL)
+    dest->feat = AllocFloatArray(nfeats);
   memcpy(dest->feat, src->feat, nfeats * sizeof(float));
   dest->pathval = src->pathval;
   dest->dens = src->dens;
@@ -188,8 +339,6 @@ void CopySNode(SNode *dest, SNode *src, int nfeats)
   dest->relevant = src->relevant;
   dest->radius = src->radius;
   dest->nplatadj = src->nplatadj;
-
-  dest->adj = CloneSet(src->adj);
 }
 
 //Swap nodes
@@ -201,3 +350,20 @@ void SwapSNode(SNode *a, SNode *b)
   *a = *b;
   *b = tmp;
 }
+
+//Swap nodes of distinct subgraphs, keeping each feature vector in its subgraph
+void ExchangeSNode(SNode *a, SNode *b, int nfeats)
+{
+  float *fa = a->feat, *fb = b->feat, tmp;
+  int j;
+
+  SwapSNode(a, b);
+  a->feat = fa;
+  b->feat = fb;
+  for (j = 0; j < nfeats; j++)
+  {
+    tmp = fa[j];
+    fa[j] = fb[j];
+    fb[j] = tmp;
+  }
+}
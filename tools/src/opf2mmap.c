@@ -0,0 +1,20 @@
+#include "OPF.h"
+
+int main(int argc, char **argv)
+{
+	if (argc != 3)
+	{
+		fprintf(stderr, "\nusage: opf2mmap <input model file> <output model file>\n");
+		exit(-1);
+	}
+
+	fprintf(stderr, "\nProgram to convert OPF model files (e.g. classifier.opf) to the memory-mapped model format.");
+	fprintf(stderr, "\nThe converted file is read by opf_classify and opfknn_classify as any model file.\n");
+
+	Subgraph *g = opf_ReadModelFile(argv[1]);
+
+	opf_WriteMappedModelFile(g, argv[2]);
+	DestroySubgraph(&g);
+
+	return 0;
+}
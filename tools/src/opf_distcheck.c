@@ -0,0 +1,170 @@
+#include "OPF.h"
+
+/* It checks the vector distance kernels against the scalar ones on
+   random feature vectors of several sizes. A result is accepted when
+   |vector - scalar| <= TOLERANCE * max(|scalar|, ABS_FLOOR). It also checks
+   that every kernel called with a bound returns exactly its full
+   distance when it is not above the bound, and a value above the
+   bound otherwise. Last, it checks every exponential of the ExpSum
+   kernels against the double precision exp, for arguments in
+   [-EXP_RANGE, 0], within the relative error EXP_MAXRELERR, and that
+   every half precision number converted to float and back is the same. */
+
+#define TOLERANCE 1e-4
+#define ABS_FLOOR 1e-6 /* below it, errors are taken as absolute */
+#define MAXFEATS 300
+#define NTRIALS 200
+#define EXP_RANGE 90.0
+#define EXP_TRIALS 200000
+
+typedef struct
+{
+  char *name;
+  int signedfeats; /* 1 if the kernel is also checked with negative features */
+} KernelInfo;
+
+static KernelInfo Info[7] = {
+    {"Euclidean", 1}, {"Chi-Square", 0}, {"Manhattan", 1}, {"Canberra", 1},
+    {"Squared Chord", 0}, {"Squared Chi-Squared", 1}, {"BrayCurtis", 1}};
+
+static DistanceKernel KernelAt(DistanceKernels *K, int i)
+{
+  DistanceKernel k[7] = {K->eucl, K->chisquared, K->manhattan, K->canberra,
+                         K->squaredchord, K->squaredchisquared, K->braycurtis};
+  return k[i];
+}
+
+static void RandomFeats(float *f, int n, int signedfeats)
+{
+  int i;
+
+  for (i = 0; i < n; i++)
+  {
+    f[i] = (float)rand() / RAND_MAX;
+    if (signedfeats)
+      f[i] = 2 * f[i] - 1;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  DistanceKernels scalar, vector;
+  float *f1 = NULL, *f2 = NULL, ref, val, err, maxerr, full, bound, bounded;
+  float scale[3] = {0.3f, 0.9f, 1.0f};
+  int level, best, k, n, t, s, b, nbad, fail = 0;
+
+  if (argc != 1)
+  {
+    fprintf(stderr, "\nusage opf_distcheck\n");
+    exit(-1);
+  }
+
+  srand(1);
+  /* odd offsets exercise the unaligned loads */
+  f1 = AllocFloatArray(MAXFEATS + 1) + 1;
+  f2 = AllocFloatArray(MAXFEATS + 1) + 1;
+
+  best = DetectSIMDLevel();
+  GetDistanceKernels(SIMD_SCALAR, &scalar);
+  fprintf(stdout, "\nBest instruction set of the CPU: %s\n", SIMDLevelName(best));
+
+  for (level = SIMD_SCALAR; level <= best; level++)
+  {
+    GetDistanceKernels(level, &vector);
+    nbad = 0;
+    for (k = 0; k < 7; k++)
+      for (n = 1; n <= MAXFEATS; n += (n < 40) ? 1 : 37)
+        for (t = 0; t < NTRIALS; t++)
+        {
+          RandomFeats(f1, n, 0);
+          RandomFeats(f2, n, 0);
+          full = KernelAt(&vector, k)(f1, f2, n, FLT_MAX);
+          for (b = 0; b < 3; b++)
+          {
+            bound = scale[b] * full;
+            bounded = KernelAt(&vector, k)(f1, f2, n, bound);
+            if ((full <= bound) ? (bounded != full) : !(bounded > bound))
+              nbad++;
+          }
+        }
+    fprintf(stdout, "%-8s bounded kernels: %d wrong results %s\n", SIMDLevelName(level), nbad, nbad ? "FAILED" : "OK");
+    if (nbad)
+      fail = 1;
+  }
+
+  for (level = SIMD_SSE4; level <= best; level++)
+  {
+    GetDistanceKernels(level, &vector);
+    for (k = 0; k < 7; k++)
+    {
+      maxerr = 0.0f;
+      for (s = 0; s <= Info[k].signedfeats; s++)
+        for (n = 1; n <= MAXFEATS; n += (n < 40) ? 1 : 37)
+          for (t = 0; t < NTRIALS; t++)
+          {
+            RandomFeats(f1, n, s);
+            RandomFeats(f2, n, s);
+            ref = KernelAt(&scalar, k)(f1, f2, n, FLT_MAX);
+            val = KernelAt(&vector, k)(f1, f2, n, FLT_MAX);
+            err = fabs(val - ref) / MAX(fabs(ref), ABS_FLOOR);
+            if ((err > maxerr) || (err != err))
+              maxerr = err;
+          }
+      fprintf(stdout, "%-8s %-20s max relative error %e %s\n", SIMDLevelName(level), Info[k].name,
+              maxerr, (maxerr <= TOLERANCE) ? "OK" : "FAILED");
+      if (!(maxerr <= TOLERANCE))
+        fail = 1;
+    }
+  }
+
+  /* the exponential under test takes a different lane at each trial,
+     and the other lanes have arguments far below EXP_MINARG, whose
+     exponentials are 0 */
+  for (level = SIMD_SCALAR; level <= best; level++)
+  {
+    GetDistanceKernels(level, &vector);
+    maxerr = 0.0f;
+    nbad = 0;
+    for (t = 0; t < EXP_TRIALS; t++)
+    {
+      for (n = 0; n < 16; n++)
+        f1[n] = 1e30f;
+      f1[t % 16] = EXP_RANGE * (float)rand() / RAND_MAX;
+      ref = exp(-(double)f1[t % 16]);
+      val = vector.expsum(f1, 16, 1.0f);
+      if (ref < FLT_MIN)
+      {
+        if (!(val <= FLT_MIN))
+          nbad++;
+        continue;
+      }
+      err = fabs(val - ref) / ref;
+      if ((err > maxerr) || (err != err))
+        maxerr = err;
+    }
+    fprintf(stdout, "%-8s %-20s max relative error %e, %d wrong results below FLT_MIN %s\n", SIMDLevelName(level), "Exponential",
+            maxerr, nbad, ((maxerr <= EXP_MAXRELERR) && !nbad) ? "OK" : "FAILED");
+    if (!(maxerr <= EXP_MAXRELERR) || nbad)
+      fail = 1;
+  }
+
+  nbad = 0;
+  for (t = 0; t < 0x10000; t++)
+    if ((((t & 0x7c00) != 0x7c00) || !(t & 0x3ff)) && (FloatToHalf(HalfToFloat(t)) != t)) // NaNs excluded
+      nbad++;
+  fprintf(stdout, "%-8s %-20s %d wrong conversions %s\n", "", "Half precision", nbad, nbad ? "FAILED" : "OK");
+  if (nbad)
+    fail = 1;
+
+  free(f1 - 1);
+  free(f2 - 1);
+
+  if (fail)
+  {
+    fprintf(stdout, "\nThe vector kernels are out of the tolerance %g.\n", TOLERANCE);
+    return 1;
+  }
+  fprintf(stdout, "\nAll vector kernels are within the tolerance %g.\n", TOLERANCE);
+
+  return 0;
+}
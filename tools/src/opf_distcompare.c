@@ -0,0 +1,74 @@
+#include "OPF.h"
+
+/* It trains and tests the supervised OPF once with the float32
+   precomputed distances and once with their reduced-precision version
+   (float16, uint16 or uint8), and reports how many decisions changed:
+   the prototypes, predecessors and labels of the training nodes, and
+   the labels of the test samples. Only the order of the distances
+   matters to these decisions, so a quantization changes them only where
+   it merges or swaps close distances. */
+
+// It trains on ftrain and classifies ftest with the precomputed distances of fdist
+static void TrainAndClassify(char *ftrain, char *ftest, char *fdist, Subgraph **train, Subgraph **test)
+{
+  int n;
+
+  *train = ReadSubgraph(ftrain);
+  *test = ReadSubgraph(ftest);
+  opf_DistanceValue = opf_ReadDistances(fdist, &n);
+  opf_OPFTraining(*train);
+  opf_OPFClassifying(*train, *test);
+  opf_DestroyDistances(&opf_DistanceValue, n);
+}
+
+int main(int argc, char **argv)
+{
+  Subgraph *train32 = NULL, *test32 = NULL, *train = NULL, *test = NULL;
+  int i, nstatus = 0, npred = 0, ntrainlabel = 0, ntestlabel = 0;
+  float acc32, acc;
+
+  if (argc != 5)
+  {
+    fprintf(stderr, "\nusage opf_distcompare <P1> <P2> <P3> <P4>");
+    fprintf(stderr, "\nP1: training set in the OPF file format");
+    fprintf(stderr, "\nP2: test set in the OPF file format");
+    fprintf(stderr, "\nP3: float32 precomputed distances file");
+    fprintf(stderr, "\nP4: reduced-precision precomputed distances file of the same samples\n");
+    exit(-1);
+  }
+
+  opf_PrecomputedDistance = 1;
+  TrainAndClassify(argv[1], argv[2], argv[3], &train32, &test32);
+  if (opf_DistanceType != opf_DIST_FLOAT32)
+    Error("The reference distances are not float32", "opf_distcompare");
+  TrainAndClassify(argv[1], argv[2], argv[4], &train, &test);
+
+  for (i = 0; i < train->nnodes; i++)
+  {
+    if (train->node[i].status != train32->node[i].status)
+      nstatus++;
+    if (train->node[i].pred != train32->node[i].pred)
+      npred++;
+    if (train->node[i].label != train32->node[i].label)
+      ntrainlabel++;
+  }
+  for (i = 0; i < test->nnodes; i++)
+    if (test->node[i].label != test32->node[i].label)
+      ntestlabel++;
+  acc32 = opf_Accuracy(test32);
+  acc = opf_Accuracy(test);
+
+  fprintf(stdout, "\nDecisions changed against float32 (%s distances):", argv[4]);
+  fprintf(stdout, "\nTraining nodes with another prototype status: %d of %d", nstatus, train->nnodes);
+  fprintf(stdout, "\nTraining nodes with another predecessor: %d of %d", npred, train->nnodes);
+  fprintf(stdout, "\nTraining nodes with another label: %d of %d", ntrainlabel, train->nnodes);
+  fprintf(stdout, "\nTest samples with another label: %d of %d", ntestlabel, test->nnodes);
+  fprintf(stdout, "\nTest accuracy: %.2f%% with float32, %.2f%% with the reduced distances\n", 100 * acc32, 100 * acc);
+
+  DestroySubgraph(&train32);
+  DestroySubgraph(&test32);
+  DestroySubgraph(&train);
+  DestroySubgraph(&test);
+
+  return 0;
+}
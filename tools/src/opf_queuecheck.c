@@ -0,0 +1,105 @@
+#include "OPF.h"
+
+/* It clusters a data set with the bucket queue and with the heap, on
+   the same knn graph and the same rounded densities, and reports where
+   the results differ. Both queues give the same path values; the roots
+   and labels may differ on plateaus, where nodes of equal path value
+   leave the queues in different orders. */
+
+// It returns 1 if the labels of a and b define the same partition of the nodes
+static int SamePartition(int *a, int *b, int n, int nlabels)
+{
+  int *ab = AllocIntArray(nlabels), *ba = AllocIntArray(nlabels), i, same = 1;
+
+  for (i = 0; i < nlabels; i++)
+    ab[i] = ba[i] = NIL;
+  for (i = 0; (i < n) && same; i++)
+  {
+    if ((ab[a[i]] == NIL) && (ba[b[i]] == NIL))
+    {
+      ab[a[i]] = b[i];
+      ba[b[i]] = a[i];
+    }
+    else if ((ab[a[i]] != b[i]) || (ba[b[i]] != a[i]))
+      same = 0;
+  }
+  free(ab);
+  free(ba);
+
+  return same;
+}
+
+int main(int argc, char **argv)
+{
+  Subgraph *g = NULL;
+  float *pathval = NULL, *bucketpathval = NULL;
+  int *bucketlabel = NULL, *bucketroot = NULL, *heaplabel = NULL, bucketnlabels, i, k, npathval = 0, nroot = 0, nlabel = 0;
+
+  if (argc != 3)
+  {
+    fprintf(stderr, "\nusage opf_queuecheck <P1> <P2>");
+    fprintf(stderr, "\nP1: data set in the OPF file format");
+    fprintf(stderr, "\nP2: k (degree of the knn graph)\n");
+    exit(-1);
+  }
+
+  g = ReadSubgraph(argv[1]);
+  k = atoi(argv[2]);
+  if ((k < 1) || (k >= g->nnodes))
+    Error("Invalid k", "opf_queuecheck");
+
+  opf_ClusteringQueue = opf_QUEUE_BUCKET;
+  g->bestk = k;
+  opf_CreateArcs(g, k);
+  opf_PDF(g);
+
+  pathval = AllocFloatArray(g->nnodes);
+  bucketpathval = AllocFloatArray(g->nnodes);
+  bucketlabel = AllocIntArray(g->nnodes);
+  bucketroot = AllocIntArray(g->nnodes);
+  heaplabel = AllocIntArray(g->nnodes);
+  for (i = 0; i < g->nnodes; i++)
+    pathval[i] = g->node[i].pathval;
+
+  opf_OPFClustering(g);
+  bucketnlabels = g->nlabels;
+  for (i = 0; i < g->nnodes; i++)
+  {
+    bucketpathval[i] = g->node[i].pathval;
+    bucketlabel[i] = g->node[i].label;
+    bucketroot[i] = g->node[i].root;
+    g->node[i].pathval = pathval[i];
+  }
+
+  /* the plateau arcs inserted by the first clustering are already there */
+  opf_ClusteringQueue = opf_QUEUE_HEAP;
+  opf_OPFClustering(g);
+
+  for (i = 0; i < g->nnodes; i++)
+  {
+    if (g->node[i].pathval != bucketpathval[i])
+      npathval++;
+    if (g->node[i].root != bucketroot[i])
+      nroot++;
+    if (g->node[i].label != bucketlabel[i])
+      nlabel++;
+  }
+
+  fprintf(stdout, "\nClusters: %d with the bucket queue, %d with the heap", bucketnlabels, g->nlabels);
+  fprintf(stdout, "\nNodes with another path value: %d", npathval);
+  fprintf(stdout, "\nNodes with another root (tie order): %d", nroot);
+  fprintf(stdout, "\nNodes with another label (tie order): %d", nlabel);
+  for (i = 0; i < g->nnodes; i++)
+    heaplabel[i] = g->node[i].label;
+  fprintf(stdout, "\nSame partition into clusters: %s\n",
+          ((bucketnlabels == g->nlabels) && SamePartition(bucketlabel, heaplabel, g->nnodes, g->nlabels)) ? "yes" : "no");
+
+  free(pathval);
+  free(bucketpathval);
+  free(bucketlabel);
+  free(bucketroot);
+  free(heaplabel);
+  DestroySubgraph(&g);
+
+  return (npathval > 0);
+}
@@ -25,7 +25,7 @@ int main(int argc, char **argv)
 	acc = (float *)malloc(it * sizeof(float));
 	for (i = 1; i <= it; i++)
 	{
-		if (fscanf(fpIn, "%f", &aux) != 1)
+		if (fscanf(fpIn, "%f%*[^\n]", &aux) != 1) /* only the first value of each line is used */
 		{
 			fprintf(stderr, "\n Could not read accuracy");
 			exit(-1);
@@ -103,7 +103,7 @@ int main(int argc, char **argv)
 	fprintf(stderr, "OK.\n\n");
 	//struct label *node = NULL;
 	graph->nlabels = d.nlabels;
-	graph->nfeats = d.nfeats;
+	AllocSubgraphFeats(graph, d.nfeats);
 	fprintf(stderr, "Creating graph...\n");
 	for (i = 0; i < d.ndata; i++)
 	{
@@ -119,7 +119,6 @@ int main(int argc, char **argv)
 			InsertLabel(&node, label, aux);
 			aux++;
 		}*/
-		graph->node[i].feat = calloc(d.nfeats, sizeof(float));
 		while (seg != NULL)
 		{
 			seg = strtok(NULL, ":\n");